@@ -48,6 +48,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #include <lillydap/mem.h>
 
@@ -78,6 +79,29 @@ typedef struct LillyConnection LDAP;
 typedef struct LillyStructural LillyDAP;
 typedef struct lillyctl_filter   *LillyControlAllOpsFilter;
 typedef union lillyctl_filtertab *LillyControlOpcodeFilters;
+typedef struct LillyLazy LillyLazy;
+typedef int (*LillyLazyOpcode) (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				LillyLazy *lazy,
+				const dercursor controls);
+
+/* The dispatch plan of a LillyStructural, as set by lillydap_compile().
+ * Opcodes in drop are refused right after their tag is seen, and target
+ * holds the lillyget_operation() or lillyget_response() function that the
+ * default layers pass unpacked data for an opcode to, or NULL when other
+ * layers are in the way.
+ */
+struct LillyPlan {
+	bool compiled;
+	uint32_t drop [1];
+	int (*target [31]) (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor *data,
+				const dercursor controls);
+};
 
 struct LillyStructural {
 	//
@@ -92,6 +116,7 @@ struct LillyStructural {
 	LillyControlAllOpsFilter  lillyctl_recvall;
 	LillyControlAllOpsFilter  lillyctl_sendall;
 	uint32_t control_unpack [1];
+	uint32_t seqof_unpack [1];
 	//
 	// API Layer: Receiving a DER blob
 	int (*lillyget_dercursor) (LDAP *lil,
@@ -167,6 +192,36 @@ struct LillyStructural {
 	//
 	// API Layer: Receive a per-operation callback based on a registry
 	const union LillyOpRegistry *opregistry;
+	//
+	// API Layer: Receive a handle that decodes fields on demand, indexed
+	// by opcode; where this is NULL, the layers above are used
+	const LillyLazyOpcode *lazyregistry;
+	//
+	// Output queue backpressure: the high watermark was reached, or the
+	// queue drained to the low watermark after that; both are optional
+	void (*lillyput_highwater) (LDAP *lil);
+	void (*lillyput_lowwater) (LDAP *lil);
+	//
+	// Output queue went from empty to non-empty; hint the event loop
+	void (*lillyput_signal) (LDAP *lil);
+	//
+	// A request from lillymsg_id_alloc() ran out of ld_timelimit; the
+	// MessageID is freed after it returns, and when this is NULL, an
+	// AbandonRequest is sent as with lillymsg_abandon()
+	void (*lillymsg_timeout) (LDAP *lil, LillyMsgId mid);
+	//
+	// Dispatch plan, set by lillydap_compile() from the fields above
+	struct LillyPlan plan;
+};
+
+/* Counts of waits in the output queue that were contended, classified by
+ * how they ended: while spinning, after yielding the processor, or after
+ * parking the thread.  The counters wrap around when they overflow.
+ */
+struct LillyPutContention {
+	int spun;
+	int yielded;
+	int parked;
 };
 
 struct LillyConnection {
@@ -193,14 +248,68 @@ struct LillyConnection {
 	size_t get_gotten;
 	uint8_t get_head6 [6];	//TODO// overlay get_msg
 	dercursor get_msg;
+	uint8_t *get_buf;	// Receive buffer under LILLYCNX_GET_BUFFERED
+	size_t get_bufofs;	// Start of unprocessed bytes in get_buf
+	size_t get_buflen;	// End of the bytes read into get_buf
+	struct LillyGetChunk *get_chunk;  // Holds get_buf under _GET_ZEROCOPY
+	dercursor *get_extcrs;	// Extended operation fields, in its qpool
+	uint8_t *get_extop;	// The operation that get_extcrs is unpacked from
+	uint64_t get_dropped;	// Messages dropped by the dispatch plan
 	struct LillySend *put_qhead, **put_qtail;
+	int put_wakeseq;	// Futex word for threads parked on the queue
+	int put_parked;		// Number of threads parked on the queue
+	struct LillyPutContention put_contention;
+	size_t put_qbytes;	// Bytes queued, counted under put_highwater
+	size_t put_highwater;	// Bytes that throttle producers, 0 for none
+	size_t put_lowwater;	// Bytes at which throttling ends
+	int put_throttled;	// Set between high and low watermarks
+	int put_sigfd;		// -1, or set by lillyput_eventfd_open()
+	uint8_t get_ringstate;	// Receiving state under a LillyRing
+	int get_ringerror;	// Why receiving ended under a LillyRing
+	unsigned put_ringwrites;  // Linked writes in flight under a LillyRing
 	//
 	// Memory management for the connection and messages
 	LillyPool cnxpool;
-	struct LillyMsgLayer *msghash;
+	struct LillyMsgTable *msgtab;
+	int msgtab_lock;	// Serialises growth of msgtab
+	int msgid_next;		// Counter for lillymsg_id_alloc()
+	struct LillyTimers *msg_timers;  // Set by lillytimer_attach()
 };
 
 
+/* Flags for the LillyConnection, to be set in lil->flags before the first
+ * event is processed on the connection.
+ *
+ * LILLYCNX_GET_BUFFERED makes lillyget_event() read as much as the socket
+ * has to offer into a receive buffer of LILLYGET_BUFSIZE bytes, and then
+ * cut out every complete LDAPMessage in it.  This saves system calls when
+ * many small messages arrive in a burst.  The buffer is allocated from the
+ * cnxpool, messages are copied into their own qpool.
+ *
+ * LILLYCNX_GET_ZEROCOPY implies LILLYCNX_GET_BUFFERED, but it does not
+ * copy messages.  Instead, the receive buffer is a refcounted chunk and
+ * every dercursor delivered to lillyget_dercursor() points straight into
+ * it.  The chunk is released when the last qpool referencing it ends.
+ * This requires lillymem_atend_fun; without it, messages are copied.
+ * Note that the connection structure must outlive its cnxpool.
+ *
+ * LILLYCNX_PUT_GATHER makes lillyput_event() collect the bytes of as many
+ * queued items as LILLYPUT_IOVMAX permits, and send them with one writev().
+ * Items that were sent completely have their qpools ended in bulk.
+ */
+#define LILLYCNX_GET_BUFFERED	0x0001
+#define LILLYCNX_GET_ZEROCOPY	0x0002
+#define LILLYCNX_PUT_GATHER	0x0004
+
+
+/* The size of the receive buffer for LILLYCNX_GET_BUFFERED.  Messages that
+ * are larger than this are read into a buffer of their own.
+ */
+#ifndef LILLYGET_BUFSIZE
+#define LILLYGET_BUFSIZE 65536
+#endif
+
+
 /* Functions lillyget_xxx() represent the flow of operations from the network
  * to the program.  These definitions match the fields in (LDAP *) by the same
  * name, so you can choose these as default implementations to pass work on
@@ -208,6 +317,7 @@ struct LillyConnection {
  * at the given level-- or you might do something and then call these.
  */
 ssize_t lillyget_event (LDAP *lil);
+int lillyget_netbytes (LDAP *lil, const uint8_t *bytes, size_t len);
 int lillyget_dercursor (LDAP *lil, LillyPool qpool_opt, dercursor msg);
 int lillyget_ldapmessage (LDAP *lil,
 				LillyPool qpool,
@@ -228,6 +338,79 @@ int lillyget_operation (LDAP *lil,
 				const dercursor controls);
 
 
+/* Functions lillymsg_xxx() keep track of requests sent to the remote side.
+ * A MessageID from lillymsg_id_alloc() has its own qpool until it is
+ * freed with lillymsg_id_free().  These functions may be called by many
+ * threads at once.  The returned MessageID has the high bit set, which
+ * is reset when it is sent; it is 0 on failure.
+ */
+LillyMsgId lillymsg_id_alloc (LDAP *lil, LillyPool *newpool);
+LillyMsgId lillymsg_id_alloc_cb (LDAP *lil, LillyPool *newpool,
+				lillymsg_callback cb, void *cbdata);
+void lillymsg_id_free (LDAP *lil, LillyMsgId cango);
+LillyPool lillymsg_id_qpool (LDAP *lil, LillyMsgId mid);
+
+
+/* Correlate responses with their requests, for use as lillyget_response.
+ * Responses to a MessageID from lillymsg_id_alloc_cb() are passed to its
+ * callback, and the final response frees the MessageID and its qpool.
+ * This allows many requests to be outstanding on a connection, without
+ * looking for the request that a response belongs to.  Other responses
+ * are passed to lillyget_operation().
+ */
+int lillyget_correlate (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor *data,
+				const dercursor controls);
+
+
+/* Abandon a request that is still outstanding.  This sends an
+ * AbandonRequest for it through lillyput_operation, and then frees the
+ * MessageID and its qpool.
+ * Returns 0 on success or -1 with errno set; the MessageID is freed
+ * either way.
+ */
+int lillymsg_abandon (LDAP *lil, LillyMsgId cango);
+
+
+/* Expire a request that ran out of its time limit, as a LillyTimers does.
+ * The MessageID is claimed atomically, so it cannot be freed by a response
+ * at the same time.  Then the lillymsg_timeout callback is called, or an
+ * AbandonRequest is sent when it is NULL, and finally the MessageID and its
+ * qpool are freed.  Returns false when the request was not outstanding.
+ */
+bool lillymsg_id_expire (LDAP *lil, LillyMsgId mid);
+
+
+/* Compile the lillyget_xxx() layers of a LillyStructural into its plan.
+ * Call this after setting its fields and before connections use it, and
+ * again after changing them.  For every opcode, the chain of functions
+ * that a message passes through is resolved once.  When the chain would
+ * refuse the opcode, because it is set in reject_ops or because there is
+ * no function or opregistry entry to pass it to, the opcode is marked to
+ * be dropped.  This is only done when the layers from lillyget_dercursor()
+ * to lillyget_opcode() are the library defaults.  Extended operations are
+ * never dropped, as they are only known by their OID.
+ *
+ * Dropped messages are refused by lillyget_dercursor() and by the buffered
+ * readers right after the tag of their operation, before a qpool is
+ * allocated or anything is unpacked.  They are not reported as errors, but
+ * counted in the get_dropped field of the connection.  This is useful for
+ * cheaply shedding unwanted operations under overload.  Messages with a
+ * messageID outside 1 to 2^31-1 are never dropped, so they still fail.
+ */
+void lillydap_compile (LillyDAP *def);
+
+
+/* Test whether a message is dropped by the plan of its connection, and
+ * count it if so.  This looks no further than the tag of the operation,
+ * and only needs that many bytes of the message.
+ */
+bool lillyget_dropped (LDAP *lil, dercursor msg);
+
+
 /* Functions lillyput_xxx() represent the flow of operations from the program
  * to the network.  These definitions match the fields in (LDAP *) by the same
  * name, so you can choose these as default implementations to pass work on
@@ -247,10 +430,94 @@ int lillyput_ldapmessage (LDAP *lil,
 				const dercursor controls);
 int lillyput_dercursor (LDAP *lil, LillyPool qpool, dercursor dermsg);
 void lillyput_enqueue (LDAP *lil, struct LillySend *addend);
+void lillyput_enqueue_chain (LDAP *lil, struct LillySend *first, struct LillySend *last);
 bool lillyput_cansend (LDAP *lil);
+bool lillyput_canqueue (LDAP *lil);
+void lillyput_contention (LDAP *lil, struct LillyPutContention *counts);
 int lillyput_event (LDAP *lil);
 
 
+/* Operations are unpacked and packed by code that is generated from their
+ * derwalk programs at build time, with the Quick DER interpreter to fall
+ * back on.  These are the functions that lillyget_opcode() and
+ * lillyput_operation() use.  Set interpret to use only the interpreter,
+ * for instance to compare the two.  Return values are like those from
+ * der_unpack() and der_pack().  For Extended operations with a structured
+ * value, only the requestValue or responseValue is handled.
+ */
+int lillyop_unpack (uint8_t opcode, dercursor op, dercursor *data,
+				bool interpret);
+size_t lillyop_pack (uint8_t opcode, const dercursor *data,
+				uint8_t *outbuf_end_opt, bool interpret);
+
+/* Unpack and pack with only the generated code, which derbench.test uses to
+ * be sure that it compares it with the interpreter.  Operations that are
+ * left to the interpreter fail with ENOSYS.  Otherwise, the generated code
+ * fails with EBADMSG on input that is not in strict DER form, and with
+ * EINVAL when it cannot pack the data.
+ */
+int lillyop_unpack_generated (uint8_t opcode, dercursor op, dercursor *data);
+size_t lillyop_pack_generated (uint8_t opcode, const dercursor *data,
+				uint8_t *outbuf_end_opt);
+
+
+/* Index the elements in the contents of a constructed value, such as a
+ * SEQUENCE OF or SET OF, in one pass.  Up to *count elements are stored
+ * in elems_opt, if given, and crs is moved past them.  The number of
+ * elements found is returned in *count.  Returns 0 on success, or -1 with
+ * errno set to EBADMSG when an element header is malformed or overruns crs.
+ */
+int qder2b_scan (dercursor *crs, dercursor *elems_opt, size_t *count);
+
+
+/* Operations can be decoded lazily, by setting a callback for their opcode
+ * in lazyregistry.  Instead of lillyget_operation() with all the fields
+ * unpacked, the callback receives a LillyLazy handle from lillyget_opcode(),
+ * and decodes no more than the fields that it asks for.  Decoded fields are
+ * kept in the handle, which is allocated in the qpool.  A field is named by
+ * its index in the overlay, as LILLYLAZY_FIELD (SearchRequest, baseObject).
+ *
+ * Since not all of the operation is checked up front, malformed input may
+ * only be found when a field is requested.  The functions then return an
+ * error, with errno set.
+ */
+struct LillyLazy {
+	uint8_t opcode;
+	uint8_t parts;		// Number of parts located in op
+	bool whole;		// Set when data was unpacked at once
+	uint32_t decoded;	// Bitmap of parts that were decoded into data
+	unsigned fields;	// Number of dercursor in data
+	dercursor op;		// The operation as it was received
+	dercursor rest;		// The elements after the located parts
+	dercursor *elems;	// The elements of the located parts
+	dercursor *data;	// The overlay, filled as fields are decoded
+	unsigned iter_field;	// The field that lillylazy_child() iterates
+	unsigned iter_index;	// The index of the next child in iter_rest
+	dercursor iter_rest;	// The children that were not yet passed
+};
+
+#define LILLYLAZY_FIELD(opnm,field) \
+	(offsetof (LillyPack_##opnm, field) / sizeof (dercursor))
+
+/* Return a decoded field, or NULL with errno set.  When the field is not
+ * present in the operation, its dercursor is NULL.
+ */
+const dercursor *lillylazy_field (LillyLazy *lazy, unsigned field);
+
+/* Return the complete overlay, decoding what was not yet decoded, or NULL
+ * with errno set.
+ */
+const dercursor *lillylazy_data (LillyLazy *lazy);
+
+/* Return a child of a SEQUENCE OF or SET OF field, by its index, in the
+ * form of a complete DER element.  After the last child, a NULL cursor is
+ * returned.  Iterating with increasing index is cheap, since the position
+ * of the last child is kept.  Returns 0 on success or -1 with errno set.
+ */
+int lillylazy_child (LillyLazy *lazy, unsigned field, unsigned index,
+				dercursor *child);
+
+
 /* Send an operation based on the given msgid, operation and control.
  * Ignore the opcode, since it ought to be contained in the operation.
  * In other words, this is just here for mirrorring purposes!
@@ -527,6 +794,58 @@ mko (rfc5805, TxnEndReq, TxnEndRequest);
 mko (rfc5805, TxnEndRes, TxnEndResponse);
 
 
+/* The SEQUENCE OF and SET OF fields in operations can be unpacked into
+ * arrays, for the opcodes whose bit is set in seqof_unpack.  The overlay
+ * of such an operation is then followed by a LillyArray for every such
+ * field, as in the LillyArrays_ structures below, so the data passed to
+ * lillyget_operation() can be cast to those.  Array elements are overlays
+ * too, followed by the arrays for their own collections, as described by
+ * the LillyElem_ structures.  All of it is allocated in the qpool.
+ *
+ * Note how a LillyArray takes the same space as a dercursor.
+ */
+typedef struct LillyArray {
+	void *elems;
+	size_t count;
+} LillyArray;
+
+typedef struct {
+	DER_OVLY_rfc4511_PartialAttribute attr;
+	LillyArray vals;	/* of DER_OVLY_rfc4511_AttributeValue */
+} LillyElem_PartialAttribute;
+
+typedef struct {
+	DER_OVLY_rfc4511_Attribute attr;
+	LillyArray vals;	/* of DER_OVLY_rfc4511_AttributeValue */
+} LillyElem_Attribute;
+
+typedef struct {
+	dercursor operation;
+	DER_OVLY_rfc4511_PartialAttribute modification;
+	LillyArray vals;	/* of DER_OVLY_rfc4511_AttributeValue */
+} LillyElem_Change;
+
+typedef struct {
+	LillyPack_SearchRequest op;
+	LillyArray attributes;	/* of DER_OVLY_rfc4511_LDAPString */
+} LillyArrays_SearchRequest;
+
+typedef struct {
+	LillyPack_SearchResultEntry op;
+	LillyArray attributes;	/* of LillyElem_PartialAttribute */
+} LillyArrays_SearchResultEntry;
+
+typedef struct {
+	LillyPack_ModifyRequest op;
+	LillyArray changes;	/* of LillyElem_Change */
+} LillyArrays_ModifyRequest;
+
+typedef struct {
+	LillyPack_AddRequest op;
+	LillyArray attributes;	/* of LillyElem_Attribute */
+} LillyArrays_AddRequest;
+
+
 /* Callback operation support.  We assume a table, indexed by opcode,
  * for each of the recognised operations.  In addition, we define
  * a structure that can overlay such a table.  We combine them in a
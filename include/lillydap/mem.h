@@ -28,6 +28,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+#include <quick-der/api.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -44,13 +46,34 @@ typedef void *LillyPool;
 typedef uint32_t LillyMsgId;
 
 
-/* The hash of LillyMsgId uses layers, and this determines the risk of a hit.
- * This may be set to a rough estimate of the number of quick requests while
- * a slower one is in action.  By way of a default, we make an estimated
- * based on the size of the address space.
+/* The callback for responses to a request, as registered with
+ * lillymsg_id_alloc_cb() and called by lillyget_correlate().  It has the
+ * parameters of lillyget_response(), plus the cbdata that was registered.
+ * The MessageID is in the internal notation, so it has the high bit set.
  */
-#ifndef LILLYDAP_MSGID_LAYERSIZE
-#define LILLYDAP_MSGID_LAYERSIZE (16 * sizeof (void *))
+struct LillyConnection;
+typedef int (*lillymsg_callback) (struct LillyConnection *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor *data,
+				const dercursor controls,
+				void *cbdata);
+
+
+/* The table of LillyMsgId starts with this number of entries, which must
+ * be a power of two.  It grows when more requests are outstanding.
+ */
+#ifndef LILLYDAP_MSGID_TABLESIZE
+#define LILLYDAP_MSGID_TABLESIZE 64
+#endif
+
+
+/* The number of MessageID values that are tried before the table of
+ * LillyMsgId grows.  They are tried when their entry is still taken.
+ */
+#ifndef LILLYDAP_MSGID_PROBES
+#define LILLYDAP_MSGID_PROBES 4
 #endif
 
 
@@ -79,6 +102,25 @@ typedef void (*lillydap_endpool) (LillyPool cango);
 typedef void * (*lillydap_alloc) (LillyPool pool, size_t szbytes);
 
 
+/* Allocate memory within a pool, and fill it with zeroes.  Supplying this
+ * function is optional for the environment; without it, lillymem_alloc0()
+ * clears what it gets from lillydap_alloc().  Allocators that know when
+ * their memory is already clear can save that work.
+ */
+typedef void * (*lillydap_alloc0) (LillyPool pool, size_t szbytes);
+
+
+/* Register a cleanup routine to be called when a pool ends.  Cleanup
+ * routines run before the pool memory is released, in the reverse order
+ * of registration.  The function returns false when it cannot register
+ * the routine.  Supplying this function is optional for the environment;
+ * without it, a few facilities such as zero-copy reception are disabled.
+ */
+typedef bool (*lillydap_atend) (LillyPool pool,
+				void (*cleanup) (void *cbdata),
+				void *cbdata);
+
+
 
 /* The following symbols are shared between the LillyDAP modules for their
  * allocation of memory.  They must be setup by the application before
@@ -90,13 +132,54 @@ typedef void * (*lillydap_alloc) (LillyPool pool, size_t szbytes);
 extern lillydap_newpool lillymem_newpool_fun;
 extern lillydap_endpool lillymem_endpool_fun;
 extern lillydap_alloc   lillymem_alloc_fun;
+extern lillydap_alloc0  lillymem_alloc0_fun;
+extern lillydap_atend   lillymem_atend_fun;
+
+
+/* Pools may optionally start with a LillyPoolHead, which describes the
+ * free space in the chunk of memory that they currently allocate from.
+ * The application announces this by setting lillymem_poolhead_abi, after
+ * which lillymem_alloc() can bump alloc_ptr without calling a function,
+ * as long as there is room before alloc_end.  Otherwise, it still calls
+ * lillymem_alloc_fun, which should then continue in a new chunk.
+ *
+ * The alloc_ptr must always be aligned to LILLYMEM_ALIGN.  A pool may set
+ * both pointers to the same address to have all allocations go through
+ * the function.
+ */
+struct LillyPoolHead {
+	uint8_t *alloc_ptr;
+	uint8_t *alloc_end;
+};
+
+extern bool lillymem_poolhead_abi;
+
+#ifndef LILLYMEM_ALIGN
+#define LILLYMEM_ALIGN (2 * sizeof (void *))
+#endif
+
+static inline void *lillymem_alloc_inline (LillyPool pool, size_t szbytes) {
+	if (lillymem_poolhead_abi) {
+		struct LillyPoolHead *head = pool;
+		size_t need = (szbytes + LILLYMEM_ALIGN - 1) &
+					~ (size_t) (LILLYMEM_ALIGN - 1);
+		if ((need >= szbytes) &&
+				(need <= (size_t) (head->alloc_end - head->alloc_ptr))) {
+			void *mem = head->alloc_ptr;
+			head->alloc_ptr += need;
+			return mem;
+		}
+	}
+	return lillymem_alloc_fun (pool, szbytes);
+}
 
 
 /* The following wrappers help with access of the function pointers.
  */
 #define lillymem_newpool (*lillymem_newpool_fun)
 #define lillymem_endpool (*lillymem_endpool_fun)
-#define lillymem_alloc   (*lillymem_alloc_fun  )
+#define lillymem_alloc   lillymem_alloc_inline
+#define lillymem_atend   (*lillymem_atend_fun  )
 
 /* Ensure having a memory pool.  When the pointer has a NULL value, it will be
  * allocated on the spot.  If that fails, errno will be set to ENOMEM and the
@@ -110,43 +193,93 @@ bool lillymem_havepool (LillyPool *pool);
 void *lillymem_alloc0 (LillyPool pool, size_t szbytes);
 
 
+/* Memory accounting is an optional layer over the memory functions.  It is
+ * enabled by calling lillymem_accounting() after the lillymem_xxx_fun have
+ * been set, and before the first pool is created.  From then on, pools are
+ * accounting pools that hold on to a pool of the underlying allocator.
+ * Only use the lillymem_ functions on them, not those of the allocator.
+ *
+ * Every pool counts the bytes and the number of allocations made from it,
+ * and may have a quota for the bytes.  An allocation beyond the quota
+ * fails with errno set to ENOMEM, as if memory had run out.  New pools get
+ * the quota given to lillymem_accounting(), which is meant for qpools; use
+ * lillymem_setquota() to change it, for instance for a cnxpool.  A quota
+ * of 0 means unlimited.
+ *
+ * A cnxpool can also limit the qpools of its connection together, with a
+ * cnxquota set by lillymem_setcnxquota().  LillyDAP has the qpools that it
+ * creates for a connection charge to its cnxpool with lillymem_chargeto(),
+ * counted in whole kilobytes per qpool, as cnxbytes.  This is only done
+ * when the cnxquota is not 0, and then the cnxpool must outlive all those
+ * qpools.
+ *
+ * Process-wide totals count the pools and the kilobytes allocated from
+ * them, as well as the allocations that were refused.
+ */
+struct LillyMemStats {
+	size_t bytes;
+	size_t allocs;
+	size_t quota;
+	size_t cnxbytes;
+	size_t cnxquota;
+};
+
+struct LillyMemTotals {
+	int pools;
+	int kbytes;
+	int refused;
+};
+
+void lillymem_accounting (size_t quota);
+bool lillymem_setquota (LillyPool pool, size_t quota);
+bool lillymem_setcnxquota (LillyPool cnxpool, size_t cnxquota);
+bool lillymem_chargeto (LillyPool qpool, LillyPool cnxpool);
+bool lillymem_poolstats (LillyPool pool, struct LillyMemStats *stats);
+void lillymem_totals (struct LillyMemTotals *totals);
+
+
 /* The sillymem module, definitions are optionally included
  */
 #ifdef USE_SILLYMEM
 LillyPool sillymem_newpool (void);
 void sillymem_endpool (LillyPool cango);
 void *sillymem_alloc (LillyPool pool, size_t szbytes);
+bool sillymem_atend (LillyPool pool, void (*cleanup) (void *), void *cbdata);
 #endif /* USE_SILLYMEM */
 
 
-/* Connections hold a hash of requests.  They are indexed by MessageID, and
- * have a memory pool attached.
- *
- * The hashes are stored in layers, usually not too many.  The number of
- * layers adapts to a high degree of concurrency, and will not shrink.
- * Note that the generation of MessageID values is internally initiated,
- * so attacks are not to be expected.
- *
- * The entries can be wiped given the LillyMsgId, and at that time the
- * query-specific memory pool will be cleaned up.  Once a LillyMsgId has
- * been supplied to an application, it has been given the responsibility
- * to cause this cleanup.
+/* Connections hold a table of requests.  They are indexed by MessageID,
+ * and have a memory pool attached.
  *
- * Entries in the cache are considered free when the reqid is 0; attempts
- * to replace the reqid are performed with an atomic test-and-set operation.
- * Access to the other field (reqpool) is guarded by this field.
+ * MessageID values are taken from a counter, so the values that are out
+ * at any time are close together.  The table is therefore direct-mapped:
+ * every MessageID has one entry in it, found by masking its low bits.  The
+ * counter skips values whose entry is still taken by an older request.
+ * After LILLYDAP_MSGID_PROBES such skips, a table of twice the size takes
+ * over for new requests.  Older tables are only used to find requests that
+ * were already in them, so a lookup checks a few tables at most, starting
+ * with the newest.
  *
- * Similarly, adding a new LillyMsgLayer is done by replacing the last in
- * the list with a test-and-set operation that requires the old value to
- * be NULL.
+ * Entries are free when their reqid is 0, and taken with an atomic
+ * compare-and-swap from 0 to the new MessageID.  Access to the reqpool is
+ * guarded by this field, so it is set before the MessageID is handed out,
+ * and cleared before the reqid is reset to 0.  The same holds for the
+ * callback that lillyget_correlate() passes responses to.  Freeing first
+ * swaps the reqid for a busy marker, so only one thread ends the reqpool.  A new table is
+ * installed with a compare-and-swap as well.  Tables are allocated from
+ * the cnxpool.
  */
 struct LillyMsgInfo {
 	LillyMsgId reqid;
 	LillyPool reqpool;
+	lillymsg_callback reqcb;
+	void *reqcbdata;
 };
-struct LillyMsgLayer {
-	struct LillyMsgLayer *next_layer;
-	struct LillyMsgInfo msgid_info [LILLYDAP_MSGID_LAYERSIZE];
+struct LillyMsgTable {
+	struct LillyMsgTable *older;
+	uint32_t mask;
+	int live;
+	struct LillyMsgInfo msgid_info [];
 };
 
 
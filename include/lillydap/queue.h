@@ -58,6 +58,15 @@ typedef struct LillySend {
 void lillyput_enqueue (struct LillyConnection *lil, struct LillySend *addend);
 
 
+/* Append a chain of LillySend structures, linked from first to last through
+ * their put_qnext pointers, in one atomic step.  This is cheaper than many
+ * calls to lillyput_enqueue() when a lot of output is ready at once, and
+ * the items will not be interleaved with those of other threads.
+ */
+void lillyput_enqueue_chain (struct LillyConnection *lil,
+				struct LillySend *first, struct LillySend *last);
+
+
 /* Enqueue a message in a single dercursor.  Normally, we supply a series of
  * dermessages, so this is just there to mirror properly; it may actually be
  * useful as a value for a lillyget_dercursor() pointer.
@@ -70,6 +79,52 @@ int lillyput_dercursor (LDAP *lil, LillyPool qpool, dercursor dermsg);
 bool lillyput_cansend (struct LillyConnection *lil);
 
 
+/* A reference implementation for the lillyput_signal() callback, for Linux.
+ * Set put_sigfd to -1 along with get_fd and put_fd, and open an eventfd for
+ * the connection with lillyput_eventfd_open(), which returns it and also
+ * stores it in put_sigfd.  Have the event loop wait for it to be readable,
+ * and then call lillyput_eventfd_drain() before it starts calling
+ * lillyput_event().  Set lillyput_eventfd_signal() as the lillyput_signal()
+ * callback in the LillyStructural.  Since signals are only sent when the
+ * queue was empty, a burst of output costs one wakeup at most.
+ *
+ * This also means that no signal comes while the queue is not empty.  When
+ * lillyput_event() reports EAGAIN because put_fd is full, the event loop
+ * must wait for put_fd to be writable as long as lillyput_cansend() is
+ * true; waiting for the eventfd alone would stall the connection.
+ */
+int lillyput_eventfd_open (struct LillyConnection *lil);
+void lillyput_eventfd_signal (struct LillyConnection *lil);
+int lillyput_eventfd_drain (struct LillyConnection *lil);
+
+
+/* Test if producers may add to the queue.  This returns false after the
+ * queued bytes reached put_highwater, until they drained to put_lowwater.
+ * Producers that are driven by events can instead use the callbacks
+ * lillyput_highwater() and lillyput_lowwater() in the LillyStructural.
+ * Enqueueing is always possible; it is up to producers to hold back.
+ */
+bool lillyput_canqueue (struct LillyConnection *lil);
+
+
+/* Retrieve how often threads had to wait for each other in the queue,
+ * and whether they spun, yielded or parked until the wait was over.
+ */
+struct LillyPutContention;
+void lillyput_contention (struct LillyConnection *lil,
+				struct LillyPutContention *counts);
+
+
+/* Collect the bytes ready for sending, across queue items, into an iovec.
+ * This is meant for event engines that do their own writing; they should
+ * report back how much was sent with lillyput_sent(), which then ends the
+ * items that were sent completely.  Both are only for the queue consumer.
+ */
+struct iovec;
+int lillyput_iovec (struct LillyConnection *lil, struct iovec *iov, int iovcnt);
+void lillyput_sent (struct LillyConnection *lil, size_t sent);
+
+
 #ifdef __cplusplus
 }
 #endif
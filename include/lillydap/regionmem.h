@@ -0,0 +1,166 @@
+/* <lillydap/regionmem.h> -- A region allocator for LillyDAP memory pools.
+ *
+ * This is an allocator that is fit for production, unlike sillymem.  Each
+ * pool is a list of chunks, and allocation bumps a pointer through the
+ * current chunk.  When a chunk is full, the next is twice as large, up to
+ * a maximum size.  Ending a pool returns its chunks to freelists, from
+ * where new pools pick them up, so the system allocator is rarely called.
+ * The first chunk of an ended pool stays with the pool, which is cached
+ * for the thread that created it, so the next pool it creates is ready.
+ *
+ * To use it, call regionmem_setup() before processing any LDAP, or set
+ * the lillymem_xxx_fun pointers from <lillydap/mem.h> to the functions
+ * below yourself.  Link with -lregionmem.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#ifndef LILLYDAP_REGIONMEM_H
+#define LILLYDAP_REGIONMEM_H
+
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <lillydap/mem.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* The smallest and largest chunk sizes.  Pools start with the smallest,
+ * and grow geometrically up to the largest.  Allocations that do not fit
+ * in the largest chunk get a chunk of their own.  Both must be powers of
+ * two, because retired chunks are kept in a freelist per size.
+ */
+#ifndef REGIONMEM_MINCHUNK
+#define REGIONMEM_MINCHUNK 4096
+#endif
+#ifndef REGIONMEM_MAXCHUNK
+#define REGIONMEM_MAXCHUNK (1024 * 1024)
+#endif
+
+
+/* The number of bytes in retired chunks that the freelists may hold on to.
+ * Chunks that would exceed it are returned to the system.
+ */
+#ifndef REGIONMEM_KEEPBYTES
+#define REGIONMEM_KEEPBYTES (64 * 1024 * 1024)
+#endif
+
+
+/* The number of bytes in ended pools that each thread may cache.  Pools
+ * that would exceed it are retired to the freelists instead.  Pools ended
+ * by another thread count separately, up to the same number of bytes.
+ */
+#ifndef REGIONMEM_CACHEBYTES
+#define REGIONMEM_CACHEBYTES (256 * REGIONMEM_MINCHUNK)
+#endif
+
+
+/* The size of the arenas that chunks are carved from, when they are used.
+ * This is the size of a huge page, to which arenas are also aligned.
+ */
+#ifndef REGIONMEM_ARENASIZE
+#define REGIONMEM_ARENASIZE (2 * 1024 * 1024)
+#endif
+
+
+/* The number of NUMA nodes with their own arenas and freelists.  Threads
+ * on higher nodes share with lower ones.
+ */
+#ifndef REGIONMEM_NODES
+#define REGIONMEM_NODES 8
+#endif
+
+
+/* The number of pools that a thread collects before it returns them to
+ * the thread that created them.
+ */
+#ifndef REGIONMEM_REMOTEBATCH
+#define REGIONMEM_REMOTEBATCH 16
+#endif
+
+
+/* Allocations from regionmem_alloc() are aligned to this many bytes.
+ * This matches what the inline lillymem_alloc() expects.
+ */
+#define REGIONMEM_ALIGN LILLYMEM_ALIGN
+
+
+/* The functions that plug into the lillymem_xxx_fun pointers.
+ */
+LillyPool regionmem_newpool (void);
+void regionmem_endpool (LillyPool cango);
+void *regionmem_alloc (LillyPool pool, size_t szbytes);
+bool regionmem_atend (LillyPool pool, void (*cleanup) (void *), void *cbdata);
+
+
+/* Allocate memory that is filled with zeroes.  Memory that is known to be
+ * clear, because it came from the system that way, is not cleared again.
+ */
+void *regionmem_alloc0 (LillyPool pool, size_t szbytes);
+
+
+/* Allocate memory at an alignment that is a power of two.
+ */
+void *regionmem_alloc_aligned (LillyPool pool, size_t szbytes, size_t align);
+
+
+/* Carve chunks from arenas instead of allocating them one by one.  This
+ * works on Linux, and is ignored elsewhere.  Call it before regionmem_setup()
+ * and before any pool is created.  The flags combine:
+ *
+ *  - REGIONMEM_ARENAS     to map arenas of REGIONMEM_ARENASIZE
+ *  - REGIONMEM_HUGEPAGES  to advise transparent huge pages for arenas
+ *  - REGIONMEM_HUGETLB    to map arenas from the reserved huge pages,
+ *                         falling back to other arenas when none are left
+ *  - REGIONMEM_NUMANODES  to keep arenas and freelists per NUMA node
+ *
+ * Any of the last three implies the first.  Arena memory is not returned
+ * to the system, but reused through the freelists.
+ */
+#define REGIONMEM_ARENAS     0x0001
+#define REGIONMEM_HUGEPAGES  0x0002
+#define REGIONMEM_HUGETLB    0x0004
+#define REGIONMEM_NUMANODES  0x0008
+
+void regionmem_arenas (unsigned flags);
+
+
+/* Return the pools that this thread ended for other threads, without
+ * waiting for a full batch.  Call this when the thread goes idle, so the
+ * pools do not linger.
+ */
+void regionmem_flush (void);
+
+
+/* Statistics about the memory held by regionmem.  The counts of chunks
+ * taken from and returned to the system are meant to be compared between
+ * two calls; they may wrap around.  The cached kilobytes are for the
+ * calling thread only.
+ */
+struct regionmem_stats {
+	int sysallocs;
+	int sysfrees;
+	int retained_kb;
+	int cached_kb;
+};
+
+void regionmem_stats (struct regionmem_stats *stats);
+
+
+/* Set the lillymem_xxx_fun pointers to use regionmem.  Since regionmem
+ * pools start with a LillyPoolHead, this also sets lillymem_poolhead_abi.
+ */
+void regionmem_setup (void);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LILLYDAP_REGIONMEM_H */
@@ -0,0 +1,100 @@
+/* <lillydap/timer.h> -- Timeouts for outstanding requests.
+ *
+ * Requests that are sent with a MessageID from lillymsg_id_alloc() hold on
+ * to their qpool until a response frees them with lillymsg_id_free().  When
+ * the remote side never responds, that never happens.  A LillyTimers can
+ * enforce the ld_timelimit of a connection on these requests.
+ *
+ * There should be one LillyTimers per event thread, attached to all of its
+ * connections.  When a connection has a positive ld_timelimit, in seconds,
+ * every MessageID that lillymsg_id_alloc() hands out is registered with its
+ * LillyTimers.  This may be done from any thread.  The event thread calls
+ * lillytimer_run() once per tick, and that expires requests that are still
+ * outstanding after their time limit.  Requests that were freed before are
+ * not looked for; they are simply skipped when their time has come.
+ *
+ * Expiry claims the MessageID with lillymsg_id_expire(), so a response
+ * that arrives at the same time cannot free it too.  It then calls
+ * lillymsg_timeout in the LillyStructural of the connection, or when that
+ * is NULL, sends an AbandonRequest to the remote side.  After that, the
+ * MessageID is freed along with its qpool.
+ *
+ * The timers are kept in a hierarchical wheel, so registering, running a
+ * tick and expiring a request each take constant time.  Its memory comes
+ * from a pool supplied by the caller, which must outlive the LillyTimers.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#ifndef LILLYDAP_TIMER_H
+#define LILLYDAP_TIMER_H
+
+
+#include <stdint.h>
+
+#include <lillydap/api.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* The LillyTimers is opaque to the application.
+ */
+typedef struct LillyTimers LillyTimers;
+
+
+/* The number of bits for the slots in each level of the timer wheel, and
+ * the number of levels.  The wheel covers 2^(bits*levels) ticks; longer
+ * time limits take a few extra rounds through the highest level.
+ */
+#ifndef LILLYTIMER_BITS
+#define LILLYTIMER_BITS 6
+#endif
+#ifndef LILLYTIMER_LEVELS
+#define LILLYTIMER_LEVELS 4
+#endif
+
+
+/* Open a LillyTimers with ticks of the given number of milliseconds.
+ * Returns NULL with errno set on failure.
+ */
+LillyTimers *lillytimer_open (LillyPool pool, unsigned tickms);
+
+
+/* Attach a connection to a LillyTimers, so its requests are timed.  This
+ * sets lil->msg_timers, and the connection is expected to run on the event
+ * thread of the LillyTimers.
+ */
+void lillytimer_attach (LillyTimers *tmr, LDAP *lil);
+
+
+/* Detach a connection from a LillyTimers, and forget about its requests.
+ * This must be done on the event thread before the connection is cleaned
+ * up.  It takes time in proportion to the number of registered requests.
+ */
+void lillytimer_detach (LillyTimers *tmr, LDAP *lil);
+
+
+/* Register a MessageID to time out after the given number of milliseconds.
+ * This is called by lillymsg_id_alloc(), from any thread.  Returns 0 on
+ * success or -1 with errno set.
+ */
+int lillytimer_register (LillyTimers *tmr, LDAP *lil, LillyMsgId mid,
+				unsigned ms);
+
+
+/* Run the ticks that have passed since the last call, and expire requests
+ * whose time has come.  Call this from the event thread, at least once per
+ * tick.  Returns the number of requests that expired.
+ */
+int lillytimer_run (LillyTimers *tmr);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LILLYDAP_TIMER_H */
@@ -0,0 +1,113 @@
+/* <lillydap/uring.h> -- An io_uring event engine for LillyDAP connections.
+ *
+ * The usual way of driving LillyDAP is to wait for readiness of get_fd and
+ * put_fd, and then call lillyget_event() or lillyput_event() to do a read()
+ * or write().  With thousands of mostly idle connections, that spends more
+ * time in the kernel than in LDAP processing.
+ *
+ * The LillyRing is an alternative for Linux.  It runs one io_uring per
+ * event thread.  Each attached connection has a multishot receive that
+ * lands in buffers registered with the kernel, from where the bytes are
+ * passed to lillyget_netbytes() and so into lillyget_dercursor().  Output
+ * is taken from the same LillySend queue as lillyput_event() uses, and
+ * is submitted as a chain of linked writes, so they are done in order.
+ *
+ * The memory for the LillyRing comes from a pool supplied by the caller;
+ * the ring must be closed before that pool ends.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#ifndef LILLYDAP_URING_H
+#define LILLYDAP_URING_H
+
+
+#include <stdbool.h>
+
+#include <lillydap/api.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+/* The LillyRing is opaque to the application.
+ */
+typedef struct LillyRing LillyRing;
+
+
+/* The callback that reports that a connection is done with the ring.  This
+ * happens when the receiving side has ended and no writes are in flight
+ * anymore.  The error is 0 when the remote side closed the connection,
+ * ECANCELED after lillyring_detach(), or another errno value on failure.
+ * After this callback, the connection may be cleaned up.
+ */
+typedef void (*lillyring_done) (LDAP *lil, int error);
+
+
+/* The number of receive buffers and their size.  All connections on a
+ * ring share these buffers; they are returned to the kernel as soon as
+ * the received bytes have been passed to lillyget_netbytes().
+ */
+#ifndef LILLYRING_BUFCOUNT
+#define LILLYRING_BUFCOUNT 256
+#endif
+#ifndef LILLYRING_BUFSIZE
+#define LILLYRING_BUFSIZE 4096
+#endif
+
+
+/* The largest number of linked writes submitted at once for a connection.
+ */
+#ifndef LILLYRING_MAXWRITES
+#define LILLYRING_MAXWRITES 64
+#endif
+
+
+/* Open a LillyRing with the given number of submission queue entries.
+ * Returns NULL with errno set on failure.
+ */
+LillyRing *lillyring_open (LillyPool pool, unsigned entries,
+				lillyring_done cnxdone);
+
+
+/* Close a LillyRing.  Connections that are still attached are not
+ * reported to their lillyring_done callback anymore.
+ */
+void lillyring_close (LillyRing *ring);
+
+
+/* Attach a connection to a LillyRing, and start receiving on its get_fd.
+ * Returns 0 on success or -1 with errno set.
+ */
+int lillyring_attach (LillyRing *ring, LDAP *lil);
+
+
+/* Stop receiving on a connection.  The lillyring_done callback reports when
+ * this has completed.  Returns 0 on success or -1 with errno set.
+ */
+int lillyring_detach (LillyRing *ring, LDAP *lil);
+
+
+/* Send what is in the queue of a connection over its put_fd.  Call this
+ * where you would otherwise await writeability and call lillyput_event().
+ * When writes are still in flight, the queue is sent when they are done.
+ * Returns 0 on success or -1 with errno set.
+ */
+int lillyring_send (LillyRing *ring, LDAP *lil);
+
+
+/* Submit the work prepared for the ring, and process all completions.
+ * When wait is set, this blocks until at least one completion arrives.
+ * Returns the number of completions processed, or -1 with errno set.
+ */
+int lillyring_run (LillyRing *ring, bool wait);
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LILLYDAP_URING_H */
@@ -6,6 +6,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <errno.h>
 
@@ -15,6 +16,417 @@
 
 #define lillymsg_packinfo_ext codeop_lillymsg_packinfo_ext
 #include "msgop.tab"
+#include "derspec.tab"
+
+
+/* Unpack an operation with the code that derwalk2c generated for it.
+ * Fails with ENOSYS when there is no such code, and with EBADMSG when it
+ * does not accept the input.
+ */
+int lillyop_unpack_generated (uint8_t opcode, dercursor op, dercursor *data) {
+	if ((opcode >= 31) || (derspec_table [opcode].unpacker == NULL)) {
+		errno = ENOSYS;
+		return -1;
+	}
+	if (derspec_table [opcode].unpacker (op, data) != 0) {
+		errno = EBADMSG;
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Pack an operation with the code that derwalk2c generated for it.
+ * Returns 0 with ENOSYS when there is no such code, and with EINVAL when
+ * it cannot pack the data.
+ */
+size_t lillyop_pack_generated (uint8_t opcode, const dercursor *data,
+				uint8_t *outbuf_end_opt) {
+	if ((opcode >= 31) || (derspec_table [opcode].packer == NULL)) {
+		errno = ENOSYS;
+		return 0;
+	}
+	size_t len = derspec_table [opcode].packer (data, outbuf_end_opt);
+	if (len == DERSPEC_CANNOT) {
+		errno = EINVAL;
+		return 0;
+	}
+	return len;
+}
+
+
+/* Unpack an operation with the code that derwalk2c generated for it, or
+ * with the Quick DER interpreter when there is none.  The generated code
+ * only accepts input in a strict DER form, and leaves the rest to the
+ * interpreter, which may still process or reject it.
+ */
+int lillyop_unpack (uint8_t opcode, dercursor op, dercursor *data,
+				bool interpret) {
+	if ((opcode >= OPCODE_EXT_UNDEF) ||
+			(opcode_table [opcode].pck_message == NULL)) {
+		errno = ENOSYS;
+		return -1;
+	}
+	if ((!interpret) && (lillyop_unpack_generated (opcode, op, data) == 0)) {
+		return 0;
+	}
+	return der_unpack (&op, opcode_table [opcode].pck_message, data, 1);
+}
+
+
+/* Pack an operation with the code that derwalk2c generated for it, or
+ * with the Quick DER interpreter when there is none.
+ */
+size_t lillyop_pack (uint8_t opcode, const dercursor *data,
+				uint8_t *outbuf_end_opt, bool interpret) {
+	if ((opcode >= OPCODE_EXT_UNDEF) ||
+			(opcode_table [opcode].pck_message == NULL)) {
+		errno = ENOSYS;
+		return 0;
+	}
+	if (!interpret) {
+		size_t len = lillyop_pack_generated (opcode, data, outbuf_end_opt);
+		if (len != 0) {
+			return len;
+		}
+	}
+	return der_pack (opcode_table [opcode].pck_message, data, outbuf_end_opt);
+}
+
+
+/* Unpack the SEQUENCE OF and SET OF fields of a structure into arrays in
+ * the qpool.  The elements of each collection are indexed with
+ * qder2b_scan(), in chunks that are unpacked into the array straight away.
+ * Only when a collection does not fit in the first chunk is the rest of
+ * it scanned once more, to learn the size of the array.
+ */
+#define SEQOF_CHUNK 64
+
+static int unpack_seqof (LillyPool qpool, const struct seqof_info *seqof,
+				dercursor *base) {
+	dercursor bounds [SEQOF_CHUNK];
+	for (; seqof->pck_element != NULL; seqof++) {
+		LillyArray *array = (LillyArray *) &base [seqof->array];
+		dercursor crs = base [seqof->field];
+		size_t chunk = SEQOF_CHUNK;
+		if (qder2b_scan (&crs, bounds, &chunk) == -1) {
+			return -1;
+		}
+		size_t count = chunk;
+		if (crs.derlen > 0) {
+			dercursor more = crs;
+			size_t extra = SIZE_MAX;
+			if (qder2b_scan (&more, NULL, &extra) == -1) {
+				return -1;
+			}
+			count += extra;
+		}
+		array->elems = NULL;
+		array->count = count;
+		if (count == 0) {
+			continue;
+		}
+		uint8_t *elems = lillymem_alloc (qpool, count * seqof->len_element);
+		if (elems == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+		array->elems = elems;
+		while (chunk > 0) {
+			size_t i;
+			for (i = 0; i < chunk; i++) {
+				if (der_unpack (&bounds [i], seqof->pck_element,
+							(dercursor *) elems, 1) == -1) {
+					return -1;
+				}
+				if ((seqof->sub != NULL) && (unpack_seqof (qpool,
+						seqof->sub, (dercursor *) elems) == -1)) {
+					return -1;
+				}
+				elems += seqof->len_element;
+			}
+			chunk = SEQOF_CHUNK;
+			if (qder2b_scan (&crs, bounds, &chunk) == -1) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+/* Unpack all of a lazily decoded operation at once.  This is done when a
+ * field is requested that is not described by parts, or when the parts
+ * are not in the strict form that lazy decoding handles.
+ */
+static int lazy_whole (LillyLazy *lazy) {
+	if (!lazy->whole) {
+		if (lillyop_unpack (lazy->opcode, lazy->op, lazy->data, false) == -1) {
+			return -1;
+		}
+		lazy->whole = true;
+	}
+	return 0;
+}
+
+
+/* Locate the parts of a lazily decoded operation, up to the given one.
+ * The parts before it are only recognised by their tag, not decoded.
+ */
+static int lazy_locate (LillyLazy *lazy, int part) {
+	const struct derspec *spec = &derspec_table [lazy->opcode];
+	if (lazy->whole) {
+		return 0;
+	}
+	while (lazy->parts <= part) {
+		const struct derspec_part *p = &spec->parts [lazy->parts];
+		dercursor *elem = &lazy->elems [lazy->parts];
+		size_t hlen, len;
+		int tag = derspec_peek (&lazy->rest, &hlen, &len);
+		if (tag == -1) {
+			return lazy_whole (lazy);
+		}
+		if ((tag != DERSPEC_NONE) && ((tag & p->mask) == p->tag)) {
+			elem->derptr = lazy->rest.derptr;
+			elem->derlen = hlen + len;
+			lazy->rest.derptr += hlen + len;
+			lazy->rest.derlen -= hlen + len;
+		} else if (p->optional) {
+			elem->derptr = NULL;
+			elem->derlen = 0;
+		} else {
+			return lazy_whole (lazy);
+		}
+		lazy->parts++;
+	}
+	if ((lazy->parts == spec->nparts) && (lazy->rest.derlen != 0)) {
+		// Trailing elements, let the interpreter decide
+		return lazy_whole (lazy);
+	}
+	return 0;
+}
+
+
+/* Decode one part of a lazily decoded operation into its fields.
+ */
+static int lazy_decode (LillyLazy *lazy, int part) {
+	if (lazy_locate (lazy, part) == -1) {
+		return -1;
+	}
+	if (lazy->whole || ((lazy->decoded & (1UL << part)) != 0)) {
+		return 0;
+	}
+	const struct derspec_part *p = &derspec_table [lazy->opcode].parts [part];
+	dercursor elem = lazy->elems [part];
+	dercursor *out = lazy->data + p->out;
+	size_t hlen, len;
+	if (elem.derptr == NULL) {
+		memset (out, 0, p->outs * sizeof (dercursor));
+	} else if (p->kind == DERSPEC_PART_STORE) {
+		derspec_peek (&elem, &hlen, &len);
+		out->derptr = elem.derptr + hlen;
+		out->derlen = len;
+	} else if (p->kind == DERSPEC_PART_ANY) {
+		*out = elem;
+	} else if (der_unpack (&elem, p->walk, out, 1) == -1) {
+		return -1;
+	}
+	lazy->decoded |= (1UL << part);
+	return 0;
+}
+
+
+const dercursor *lillylazy_field (LillyLazy *lazy, unsigned field) {
+	if (field >= lazy->fields) {
+		errno = EINVAL;
+		return NULL;
+	}
+	const struct derspec *spec = &derspec_table [lazy->opcode];
+	int part;
+	for (part = 0; part < spec->nparts; part++) {
+		const struct derspec_part *p = &spec->parts [part];
+		if ((field >= p->out) && (field < p->out + p->outs)) {
+			break;
+		}
+	}
+	int rv = (part < spec->nparts) ? lazy_decode (lazy, part) : lazy_whole (lazy);
+	return (rv == -1) ? NULL : &lazy->data [field];
+}
+
+
+const dercursor *lillylazy_data (LillyLazy *lazy) {
+	const struct derspec *spec = &derspec_table [lazy->opcode];
+	int part;
+	if (spec->nparts == 0) {
+		return (lazy_whole (lazy) == -1) ? NULL : lazy->data;
+	}
+	for (part = 0; part < spec->nparts; part++) {
+		if (lazy_decode (lazy, part) == -1) {
+			return NULL;
+		}
+	}
+	return lazy->data;
+}
+
+
+int lillylazy_child (LillyLazy *lazy, unsigned field, unsigned index,
+				dercursor *child) {
+	const dercursor *seq = lillylazy_field (lazy, field);
+	if (seq == NULL) {
+		return -1;
+	}
+	if ((field != lazy->iter_field) || (index < lazy->iter_index)) {
+		lazy->iter_field = field;
+		lazy->iter_index = 0;
+		lazy->iter_rest = *seq;
+	}
+	while (lazy->iter_rest.derlen > 0) {
+		dercursor elem = lazy->iter_rest;
+		if (der_skip (&lazy->iter_rest) == -1) {
+			errno = EBADMSG;
+			return -1;
+		}
+		elem.derlen -= lazy->iter_rest.derlen;
+		if (lazy->iter_index++ == index) {
+			*child = elem;
+			return 0;
+		}
+	}
+	child->derptr = NULL;
+	child->derlen = 0;
+	return 0;
+}
+
+
+/* Pass an operation to its callback in lazyregistry, with a handle that
+ * decodes fields when they are asked for.  The operation is entered here,
+ * and its parts are located as they are needed.
+ */
+static int lillyget_lazy (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor op,
+				const dercursor controls) {
+	const struct derspec *spec = &derspec_table [opcode];
+	//
+	// Request a memory pool for the msgid
+	if (qpool == NULL) {
+		qpool = lillymem_newpool ();
+		if (qpool == NULL) {
+			errno = ENOMEM;
+			goto bail_out;
+		}
+	}
+	if (opcode_table [opcode].pck_message == NULL) {
+		errno = ENOSYS;
+		goto bail_out;
+	}
+	//
+	// Allocate the handle with its overlay and parts
+	size_t len_message = opcode_table [opcode].len_message;
+	LillyLazy *lazy = lillymem_alloc (qpool, sizeof (LillyLazy) + len_message +
+				spec->nparts * sizeof (dercursor));
+	if (lazy == NULL) {
+		errno = ENOMEM;
+		goto bail_out;
+	}
+	memset (lazy, 0, sizeof (LillyLazy));
+	lazy->opcode = opcode;
+	lazy->fields = len_message / sizeof (dercursor);
+	lazy->op = op;
+	lazy->data = (dercursor *) (lazy + 1);
+	lazy->elems = lazy->data + lazy->fields;
+	lazy->iter_field = ~0U;
+	//
+	// Enter the operation to find its parts; without parts, it will be
+	// unpacked at once when a field is first requested
+	size_t hlen, len;
+	if (spec->nparts == 0) {
+		;
+	} else if ((op.derlen > 0) &&
+			(derspec_peek (&op, &hlen, &len) == *op.derptr) &&
+			(hlen + len == op.derlen)) {
+		lazy->rest.derptr = op.derptr + hlen;
+		lazy->rest.derlen = len;
+	} else if (lazy_whole (lazy) == -1) {
+		goto bail_out;
+	}
+	//
+	// Pass down the handle -- and the responsibility
+	return lil->def->lazyregistry [opcode] (lil, qpool, msgid, lazy, controls);
+	//
+	// Upon failure, cleanup and report the failure to the upstream
+bail_out:
+	if (qpool != NULL) {
+		lillymem_endpool (qpool);
+	}
+	return -1;
+}
+
+
+/* Test if an opcode stands for the requestValue or responseValue of an
+ * Extended operation, rather than for the ExtendedRequest or
+ * ExtendedResponse as a whole.
+ */
+static bool extended_value (uint8_t opcode) {
+	return (opcode >= OPCODE_EXT_FIRST) && (opcode < OPCODE_EXT_UNDEF) &&
+		(opcode_table [opcode].pck_message !=
+			opcode_table [OPCODE_EXTENDED_REQ ].pck_message) &&
+		(opcode_table [opcode].pck_message !=
+			opcode_table [OPCODE_EXTENDED_RESP].pck_message);
+}
+
+
+/* Unpack the requestValue or responseValue of an Extended operation from
+ * the fields of its ExtendedRequest or ExtendedResponse.  When the value
+ * is absent, all fields are NULL.
+ */
+static int extended_unpack (uint8_t opcode, bool extreq,
+				const dercursor *extcrs, dercursor *data) {
+	dercursor value = extcrs [extreq ? 1 : 5];
+	if (value.derptr == NULL) {
+		memset (data, 0, opcode_table [opcode].len_message);
+		return 0;
+	}
+	return der_unpack (&value, opcode_table [opcode].pck_message, data, 1);
+}
+
+
+/* Find the data for an Extended operation.  Its fields may have been
+ * unpacked by lillyget_ldapmessage() into extcrs, or else they are unpacked
+ * here.  When the opcode is parsed as an ExtendedRequest or
+ * ExtendedResponse, these are the fields to pass on.  Otherwise, the
+ * opcode describes the requestValue or responseValue, and only that is
+ * unpacked; when it is absent, all fields are NULL.  Returns NULL with
+ * errno set on failure.
+ */
+static dercursor *extended_data (LillyPool qpool, uint8_t opcode,
+				dercursor op, dercursor *extcrs_opt) {
+	bool extreq = (op.derlen > 0) && ((*op.derptr & ~ 0x20) ==
+			DER_TAG_APPLICATION (OPCODE_EXTENDED_REQ));
+	dercursor extcrs [6];
+	if (extcrs_opt == NULL) {
+		if (der_unpack (&op, opcode_table [extreq ?
+					OPCODE_EXTENDED_REQ : OPCODE_EXTENDED_RESP
+				].pck_message, extcrs, 1) == -1) {
+			return NULL;
+		}
+		extcrs_opt = extcrs;
+	} else if (!extended_value (opcode)) {
+		return extcrs_opt;
+	}
+	dercursor *data = lillymem_alloc (qpool,
+				opcode_table [opcode].len_message);
+	if (data == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (extended_unpack (opcode, extreq, extcrs_opt, data) == -1) {
+		return NULL;
+	}
+	return data;
+}
 
 
 /* Receive a shallow-parsed LDAPMessage whose opcode has been retrieved or,
@@ -37,6 +449,13 @@ int lillyget_opcode (LDAP *lil,
 		goto bail_out;
 	}
 #endif
+	//
+	// Hand out a lazy handle if the opcode has a callback for it
+	if ((opcode < 31) && (lil->def->lazyregistry != NULL) &&
+			(lil->def->lazyregistry [opcode] != NULL) &&
+			((lil->def->reject_ops [0] & (1UL << opcode)) == 0)) {
+		return lillyget_lazy (lil, qpool, msgid, opcode, op, controls);
+	}
 	//
 	// Lookup the function further down, and bail out if none found
 	int (*operation_fun) (LDAP *lil,
@@ -81,16 +500,46 @@ int lillyget_opcode (LDAP *lil,
 		goto bail_out;
 	}
 	//
-	// Allocate memory for unpacking the operation.
+	// Extended operations were unpacked by lillyget_ldapmessage() to find
+	// their OID; their fields or the value in them need no second pass
+	if ((lil->get_extcrs != NULL) && (lil->get_extop == op.derptr)) {
+		dercursor *data = extended_data (qpool, opcode, op, lil->get_extcrs);
+		lil->get_extcrs = NULL;
+		if (data == NULL) {
+			goto bail_out;
+		}
+		return operation_fun (lil, qpool, msgid, opcode, data, controls);
+	}
+	//
+	// Without them, the value of an Extended operation is found in its
+	// ExtendedRequest or ExtendedResponse
+	if (extended_value (opcode)) {
+		dercursor *data = extended_data (qpool, opcode, op, NULL);
+		if (data == NULL) {
+			goto bail_out;
+		}
+		return operation_fun (lil, qpool, msgid, opcode, data, controls);
+	}
+	//
+	// See if collections are to be unpacked into arrays after the overlay
+	bool arrays = (pck->seqof != NULL) && (opcode < 32) &&
+			((lil->def->seqof_unpack [0] & (1UL << opcode)) != 0);
+	//
+	// Allocate memory for unpacking the operation in the qpool, so it
+	// goes with the message and does not pile up in the connection.
 	// We need not zero the memory because der_unpack() writes NULLs.
-	dercursor *data = lillymem_alloc (lil->cnxpool, pck->len_message);
+	dercursor *data = lillymem_alloc (qpool,
+				arrays ? pck->len_arrays : pck->len_message);
 	if (data == NULL) {
 		errno = ENOMEM;
 		goto bail_out;
 	}
 	//
 	// Apply the parser to the operation
-	if (der_unpack ((dercursor *) &op, pck->pck_message, data, 1) == -1) {
+	if (lillyop_unpack (opcode, op, data, false) == -1) {
+		goto bail_out;
+	}
+	if (arrays && (unpack_seqof (qpool, pck->seqof, data) == -1)) {
 		goto bail_out;
 	}
 	//
@@ -112,6 +561,7 @@ bail_out:
  * just return the length.
  */
 size_t qder2b_prefixhead (uint8_t *dest_opt, uint8_t header, size_t len) {
+	size_t total = len;
 	int sublen = 0;
 	if (len >= 0x80) {
 		// Length of length prefix
@@ -130,7 +580,57 @@ size_t qder2b_prefixhead (uint8_t *dest_opt, uint8_t header, size_t len) {
 		dest_opt [sublen] = len;
 		dest_opt [sublen - 1] = header;
 	}
-	return len + 1 - sublen;
+	return total + 1 - sublen;
+}
+
+
+/* Find the OID for the opcode of an Extended request, or NULL if there
+ * is none.
+ */
+static const char *extended_oid (uint8_t opcode) {
+	unsigned i;
+	for (i = 0; i < sizeof (lillymsg_msgoptab_ext) /
+				sizeof (lillymsg_msgoptab_ext [0]); i++) {
+		if ((*lillymsg_msgoptab_ext [i].extoid != '\0') &&
+		    (lillymsg_msgoptab_ext [i].opc_request == opcode)) {
+			return lillymsg_msgoptab_ext [i].extoid;
+		}
+	}
+	return NULL;
+}
+
+
+/* Pack the requestValue of an Extended operation, and wrap it into an
+ * ExtendedRequest with the given OID.  Returns the total length, or 0 on
+ * failure.
+ */
+static size_t extended_pack (const char *extoid, uint8_t opcode,
+				const dercursor *data, uint8_t *outbuf_end_opt) {
+	//
+	// Pack the value at the end, as requestValue [1]
+	uint8_t *end = outbuf_end_opt;
+	size_t len = lillyop_pack (opcode, data, end, false);
+	if (len == 0) {
+		return 0;
+	}
+	len = qder2b_prefixhead ((end != NULL) ? end - len : NULL,
+			DER_TAG_CONTEXT (1),
+			len);
+	//
+	// Precede it with the requestName [0]
+	size_t oidlen = strlen (extoid);
+	len += oidlen;
+	if (end != NULL) {
+		memcpy (end - len, extoid, oidlen);
+	}
+	len += qder2b_prefixhead ((end != NULL) ? end - len : NULL,
+			DER_TAG_CONTEXT (0),
+			oidlen) - oidlen;
+	//
+	// Wrap it all in the ExtendedRequest
+	return qder2b_prefixhead ((end != NULL) ? end - len : NULL,
+			DER_TAG_APPLICATION (OPCODE_EXTENDED_REQ) | 0x20,
+			len);
 }
 
 
@@ -158,9 +658,22 @@ int lillyput_operation (LDAP *lil,
 		return -1;
 	}
 	//
+	// The value of an Extended request is sent with the OID of its opcode.
+	// The value of a response lacks the LDAPResult to send with it; such
+	// responses are sent with the ExtendedResponse opcode instead
+	const char *extoid = NULL;
+	if (extended_value (opcode)) {
+		extoid = extended_oid (opcode);
+		if (extoid == NULL) {
+			errno = ENOSYS;
+			return -1;
+		}
+	}
+	//
 	// Count the number of bytes in the DER message
-	size_t totlen = der_pack (opcode_table [opcode].pck_message,
-					data, NULL);
+	size_t totlen = (extoid != NULL)
+			? extended_pack (extoid, opcode, data, NULL)
+			: lillyop_pack (opcode, data, NULL, false);
 	if (totlen == 0) {
 		errno = EINVAL;
 		return -1;
@@ -175,13 +688,14 @@ int lillyput_operation (LDAP *lil,
 					controls.derlen));
 	}
 	//
-	// Add the number of bytes for the MessageID
-	uint32_t mid = msgid;
-	while (mid > 0) {
-		totlen++;
-		mid >>= 8;
+	// Add the number of bytes for the MessageID.  Remove the high bit that
+	// marks an internal initiative, and keep the INTEGER positive
+	uint32_t mid = msgid & 0x7fffffff;
+	uint8_t midlen = 1;
+	while ((midlen < 4) && (mid >= (0x80UL << (8 * (midlen - 1))))) {
+		midlen++;
 	}
-	totlen += 2;
+	totlen += 2 + midlen;
 	//
 	// Prefix a SEQUENCE header to complete the LDAPMessage
 	totlen = qder2b_prefixhead (NULL, DER_TAG_SEQUENCE, totlen);
@@ -211,9 +725,10 @@ int lillyput_operation (LDAP *lil,
 	}
 	//
 	// Precede with the packed data
-	totlen += der_pack (opcode_table [opcode].pck_message,
-				data,
-				dermsg.derptr + dermsg.derlen - totlen);
+	uint8_t *opend = dermsg.derptr + dermsg.derlen - totlen;
+	totlen += (extoid != NULL)
+			? extended_pack (extoid, opcode, data, opend)
+			: lillyop_pack (opcode, data, opend, false);
 	//
 	// Exceptional -- due to IMPLICIT TAGS
 	// If packaging started with DER_PACK_STORE, we may need to set
@@ -223,12 +738,11 @@ int lillyput_operation (LDAP *lil,
 	}
 	//
 	// Prefix the MessageID
-	mid = msgid;
-	uint8_t midlen = 0;
-	while (mid > 0) {
+	mid = msgid & 0x7fffffff;
+	uint8_t midi;
+	for (midi = 0; midi < midlen; midi++) {
 		dermsg.derptr [dermsg.derlen - ++totlen] = (mid & 0xff);
 		mid >>= 8;
-		midlen++;
 	}
 	totlen += qder2b_prefixhead (dermsg.derptr + dermsg.derlen - totlen,
 			DER_TAG_INTEGER,
@@ -4,14 +4,430 @@
  */
 
 
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <quick-der/api.h>
 #include <lillydap/api.h>
 
+#ifndef CONFIG_SINGLE_THREADED
+#   include "opa_primitives.h"
+#endif
+
+
+/* Reference counters for receive chunks are changed from any thread that
+ * ends a qpool, so they use atomic operations when we have threads.
+ */
+#ifndef CONFIG_SINGLE_THREADED
+# define ref_incr(intptr)        OPA_incr_int          ((OPA_int_t *) intptr)
+# define ref_decr_zero(intptr)   OPA_decr_and_test_int ((OPA_int_t *) intptr)
+# define ref_load(intptr)        OPA_load_int          ((OPA_int_t *) intptr)
+#else
+# define ref_incr(intptr)        (++*(intptr))
+# define ref_decr_zero(intptr)   (--*(intptr) == 0)
+# define ref_load(intptr)        (*(intptr))
+#endif
+
+
+/* Under LILLYCNX_GET_ZEROCOPY, the receive buffer is held in a chunk that
+ * lives in a pool of its own.  The connection holds one reference while
+ * it reads into the chunk, and every qpool for a message in it holds
+ * another.  The last one to let go ends the chunk's pool.
+ */
+struct LillyGetChunk {
+	LillyPool chunkpool;
+	int refs;
+	uint8_t buf [LILLYGET_BUFSIZE];
+};
+
+
+/* Parse the header of a DER message at the start of a buffer, as far as
+ * it has been read.  Return 1 and set *msglen to the total message length
+ * when the header is complete, return 0 when more bytes are needed, or
+ * return -1 with errno set when the header is not acceptable for LDAP.
+ */
+static int lillyget_header (const uint8_t *buf, size_t buflen, size_t *msglen) {
+	if (buflen < 2) {
+		return 0;
+	}
+	uint8_t tag = buf [0];
+	size_t len = buf [1];
+	uint8_t hlen = 2;
+	if (len > 0x84) {
+		errno = ERANGE;
+		return -1;
+	}
+	if (len > 0x80) {
+		uint8_t lenlen = len;
+		hlen += lenlen & 0x7f;
+		if (buflen < hlen) {
+			return 0;
+		}
+		len = 0;
+		buf += 2;
+		while (lenlen-- > 0x80) {
+			len <<= 8;
+			len += *buf++;
+		}
+	} else if (len == 0x80) {
+		// Indefinite-length encoding (from BER)
+		errno = EBADMSG;
+		return -1;
+	}
+	if (tag != 0x30) {
+		errno = EINVAL;
+		return -1;
+	}
+	*msglen = hlen + len;
+	return 1;
+}
+
+
+/* Deliver a complete LDAPMessage to lillyget_dercursor(), which takes over
+ * the responsibility for the qpool.
+ */
+static int lillyget_deliver (LDAP *lil, LillyPool qpool, dercursor msg) {
+	if (lil->def->lillyget_dercursor == NULL) {
+		lillymem_endpool (qpool);
+		errno = ENOSYS;
+		return -1;
+	}
+	return lil->def->lillyget_dercursor (lil, qpool, msg);
+}
+
+
+/* Allocate a qpool with a buffer for a message of the given length.  The
+ * qpool charges to the cnxpool of the connection.
+ * Return NULL with errno set to ENOMEM on failure.
+ */
+static LillyPool lillyget_newmsg (LDAP *lil, size_t msglen, dercursor *msg) {
+	LillyPool qpool = lillymem_newpool ();
+	if (qpool == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	lillymem_chargeto (qpool, lil->cnxpool);
+	msg->derptr = lillymem_alloc (qpool, msglen);
+	if (msg->derptr == NULL) {
+		lillymem_endpool (qpool);
+		errno = ENOMEM;
+		return NULL;
+	}
+	msg->derlen = msglen;
+	return qpool;
+}
+
+
+/* Drop a reference to a receive chunk, and end it when it was the last.
+ * This is registered with lillymem_atend() for the qpool of each message.
+ */
+static void lillyget_chunk_release (void *chunk) {
+	struct LillyGetChunk *chk = chunk;
+	if (ref_decr_zero (&chk->refs)) {
+		lillymem_endpool (chk->chunkpool);
+	}
+}
+
+
+/* Release the chunk of a connection when its cnxpool ends.
+ */
+static void lillyget_chunk_cnxend (void *cnx) {
+	LDAP *lil = cnx;
+	if (lil->get_chunk != NULL) {
+		lillyget_chunk_release (lil->get_chunk);
+		lil->get_chunk = NULL;
+		lil->get_buf = NULL;
+	}
+}
+
+
+/* Replace the receive chunk of a connection by a fresh one, and move the
+ * bytes not yet delivered from the old to the new chunk.  The reference
+ * that the connection holds on the old chunk is dropped.  On failure,
+ * return false with errno set, and leave the connection unchanged.
+ */
+static bool lillyget_chunk_renew (LDAP *lil) {
+	LillyPool chunkpool = lillymem_newpool ();
+	if (chunkpool == NULL) {
+		errno = ENOMEM;
+		return false;
+	}
+	struct LillyGetChunk *chk = lillymem_alloc (chunkpool,
+					sizeof (struct LillyGetChunk));
+	if (chk == NULL) {
+		lillymem_endpool (chunkpool);
+		errno = ENOMEM;
+		return false;
+	}
+	chk->chunkpool = chunkpool;
+	chk->refs = 1;
+	if (lil->get_chunk == NULL) {
+		if (!lillymem_atend (lil->cnxpool, lillyget_chunk_cnxend, lil)) {
+			lillymem_endpool (chunkpool);
+			errno = ENOMEM;
+			return false;
+		}
+		lil->get_bufofs = 0;
+		lil->get_buflen = 0;
+	} else {
+		lil->get_buflen -= lil->get_bufofs;
+		memcpy (chk->buf,
+			lil->get_buf + lil->get_bufofs,
+			lil->get_buflen);
+		lil->get_bufofs = 0;
+		lillyget_chunk_release (lil->get_chunk);
+	}
+	lil->get_chunk = chk;
+	lil->get_buf = chk->buf;
+	return true;
+}
+
+
+/* Deliver a message that resides in the current receive chunk, without
+ * copying it.  The new qpool holds a reference to the chunk.
+ */
+static int lillyget_deliver_inplace (LDAP *lil, dercursor msg) {
+	LillyPool qpool = lillymem_newpool ();
+	if (qpool == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	lillymem_chargeto (qpool, lil->cnxpool);
+	ref_incr (&lil->get_chunk->refs);
+	if (!lillymem_atend (qpool, lillyget_chunk_release, lil->get_chunk)) {
+		lillymem_endpool (qpool);
+		lillyget_chunk_release (lil->get_chunk);
+		errno = ENOMEM;
+		return -1;
+	}
+	return lillyget_deliver (lil, qpool, msg);
+}
+
+
+/* The buffered variety of lillyget_event(), used under LILLYCNX_GET_BUFFERED.
+ * This reads as much as fits into the receive buffer, and then cuts out
+ * every complete LDAPMessage, copying it into a fresh qpool.  What remains
+ * is the start of a message, and it moves to the front of the buffer.
+ * Messages that do not fit in the buffer are completed in a buffer of
+ * their own, in much the same way as lillyget_event() always does.
+ *
+ * Under LILLYCNX_GET_ZEROCOPY, the messages are not copied but delivered
+ * in place, and the buffer is a chunk that stays until all its messages
+ * are done.  Instead of moving data to the front, the remainder is moved
+ * to a new chunk when the current one has filled up.
+ *
+ * The minimum LDAPMessage is not constrained here; we only need the tag
+ * and length, and wait for as many bytes as that takes.
+ */
+static ssize_t lillyget_event_buffered (LDAP *lil) {
+	ssize_t gotten;
+	LillyPool qpool;
+	bool zerocopy = ((lil->flags & LILLYCNX_GET_ZEROCOPY) != 0)
+			&& (lillymem_atend_fun != NULL);
+loop_more_data:
+	//
+	// Stage 1.  Have a receive buffer for the connection.
+	if (lil->get_buf == NULL) {
+		if (zerocopy) {
+			if (!lillyget_chunk_renew (lil)) {
+				return -1;
+			}
+		} else {
+			lil->get_buf = lillymem_alloc (lil->cnxpool,
+							LILLYGET_BUFSIZE);
+			if (lil->get_buf == NULL) {
+				errno = ENOMEM;
+				return -1;
+			}
+			lil->get_bufofs = 0;
+			lil->get_buflen = 0;
+		}
+	}
+	//
+	// Stage 2.  Continue an oversized message in its own qpool buffer.
+	if (lil->get_qpool != NULL) {
+		gotten = read (lil->get_fd,
+				lil->get_msg.derptr + lil->get_gotten,
+				lil->get_msg.derlen - lil->get_gotten);
+		if (gotten <= 0) {
+			// 0 for closing, or -1 for error
+			return gotten;
+		}
+		if ((lil->get_gotten += gotten) < lil->get_msg.derlen) {
+			return gotten;
+		}
+		qpool = lil->get_qpool;
+		lil->get_qpool = NULL;
+		if (lillyget_deliver (lil, qpool, lil->get_msg) == -1) {
+			return -1;
+		}
+	}
+	//
+	// Stage 3.  Cut out all complete messages from the receive buffer.
+	while (lil->get_bufofs < lil->get_buflen) {
+		uint8_t *msgptr = lil->get_buf + lil->get_bufofs;
+		size_t avail = lil->get_buflen - lil->get_bufofs;
+		size_t msglen;
+		int hdr = lillyget_header (msgptr, avail, &msglen);
+		if (hdr == -1) {
+			return -1;
+		} else if (hdr == 0) {
+			break;
+		}
+		if ((msglen > avail) && (msglen <= LILLYGET_BUFSIZE)) {
+			// Wait for the rest to arrive in the buffer
+			break;
+		}
+		dercursor msg;
+		msg.derptr = msgptr;
+		msg.derlen = msglen;
+		if ((msglen <= avail) && lillyget_dropped (lil, msg)) {
+			// Refused by the plan, before allocating a qpool
+			lil->get_bufofs += msglen;
+			continue;
+		}
+		if (zerocopy && (msglen <= avail)) {
+			lil->get_bufofs += msglen;
+			if (lillyget_deliver_inplace (lil, msg) == -1) {
+				return -1;
+			}
+			continue;
+		}
+		if ((qpool = lillyget_newmsg (lil, msglen, &msg)) == NULL) {
+			return -1;
+		}
+		if (msglen > avail) {
+			//
+			// Oversized; continue reading in a buffer of its own
+			memcpy (msg.derptr, msgptr, avail);
+			lil->get_qpool = qpool;
+			lil->get_msg = msg;
+			lil->get_gotten = avail;
+			lil->get_bufofs = lil->get_buflen;
+			break;
+		}
+		memcpy (msg.derptr, msgptr, msglen);
+		lil->get_bufofs += msglen;
+		if (lillyget_deliver (lil, qpool, msg) == -1) {
+			return -1;
+		}
+	}
+	//
+	// Stage 4.  Make room for reading, and keep an incomplete message.
+	if (!zerocopy) {
+		if (lil->get_bufofs > 0) {
+			lil->get_buflen -= lil->get_bufofs;
+			memmove (lil->get_buf,
+				lil->get_buf + lil->get_bufofs,
+				lil->get_buflen);
+			lil->get_bufofs = 0;
+		}
+	} else if ((lil->get_bufofs == lil->get_buflen) &&
+			(ref_load (&lil->get_chunk->refs) == 1)) {
+		// No message refers to the chunk anymore, so reuse it
+		lil->get_bufofs = 0;
+		lil->get_buflen = 0;
+	} else if ((lil->get_bufofs > 0) &&
+			(lil->get_buflen > LILLYGET_BUFSIZE * 3 / 4)) {
+		// Little room left; continue in a new chunk
+		if (!lillyget_chunk_renew (lil)) {
+			return -1;
+		}
+	}
+	if (lil->get_qpool != NULL) {
+		goto loop_more_data;
+	}
+	//
+	// Stage 5.  Read as much as the socket has, then cycle back.
+	gotten = read (lil->get_fd,
+			lil->get_buf + lil->get_buflen,
+			LILLYGET_BUFSIZE - lil->get_buflen);
+	if (gotten <= 0) {
+		// 0 for closing, or -1 for error
+		return gotten;
+	}
+	lil->get_buflen += gotten;
+	goto loop_more_data;
+}
+
+
+/* Process bytes that were received by other means than lillyget_event(),
+ * such as an event engine that reads into buffers of its own.  This is
+ * the netbytes level; it cuts the bytes into LDAPMessages and delivers
+ * each in a qpool of its own.  The bytes are copied, so the caller can
+ * reuse its buffer on return.  Incomplete messages are kept in the
+ * connection until more bytes arrive.
+ *
+ * Returns 0 on success, or -1 with errno set.  Do not mix this with
+ * lillyget_event() on the same connection, as they share fields.
+ */
+int lillyget_netbytes (LDAP *lil, const uint8_t *bytes, size_t len) {
+	size_t msglen;
+	int hdr;
+	while (len > 0) {
+		//
+		// Stage 1.  Get a header, and a qpool for the message.
+		if (lil->get_qpool == NULL) {
+			if ((lil->get_gotten == 0) &&
+					(lillyget_header (bytes, len, &msglen) == 1)) {
+				// Commonly, the header arrives in one piece
+				dercursor msg;
+				msg.derptr = (uint8_t *) bytes;
+				msg.derlen = msglen;
+				if ((msglen <= len) && lillyget_dropped (lil, msg)) {
+					// Refused by the plan, before allocating a qpool
+					bytes += msglen;
+					len   -= msglen;
+					continue;
+				}
+			} else {
+				while ((hdr = lillyget_header (lil->get_head6,
+						lil->get_gotten, &msglen)) == 0) {
+					if ((len == 0) || (lil->get_gotten >= 6)) {
+						return 0;
+					}
+					lil->get_head6 [lil->get_gotten++] = *bytes++;
+					len--;
+				}
+				if (hdr == -1) {
+					return -1;
+				}
+			}
+			LillyPool qpool = lillyget_newmsg (lil, msglen, &lil->get_msg);
+			if (qpool == NULL) {
+				return -1;
+			}
+			memcpy (lil->get_msg.derptr,
+				lil->get_head6,
+				lil->get_gotten);
+			lil->get_qpool = qpool;
+		}
+		//
+		// Stage 2.  Fill the message, and deliver it when complete.
+		size_t todo = lil->get_msg.derlen - lil->get_gotten;
+		if (todo > len) {
+			todo = len;
+		}
+		memcpy (lil->get_msg.derptr + lil->get_gotten, bytes, todo);
+		bytes += todo;
+		len   -= todo;
+		if ((lil->get_gotten += todo) < lil->get_msg.derlen) {
+			return 0;
+		}
+		LillyPool qpool = lil->get_qpool;
+		lil->get_qpool = NULL;
+		lil->get_gotten = 0;
+		if (lillyget_deliver (lil, qpool, lil->get_msg) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
 
 /* Signal that information is available for reading to lillyget_xxx()
  * processing.  This first loads a header, determines the total length to
@@ -25,8 +441,15 @@
  *
  * This function can be a run_forever() style function for blocking I/O,
  * or a probe-as-much-as-possible for non-blocking I/O.
+ *
+ * When lil->flags has LILLYCNX_GET_BUFFERED or LILLYCNX_GET_ZEROCOPY set,
+ * the work is done in larger reads, as described for
+ * lillyget_event_buffered() above.
  */
 ssize_t lillyget_event (LDAP *lil) {
+	if (lil->flags & (LILLYCNX_GET_BUFFERED | LILLYCNX_GET_ZEROCOPY)) {
+		return lillyget_event_buffered (lil);
+	}
 	//
 	// Stage 1.  Have a qpool for allocations.
 loop_more_data:
@@ -35,6 +458,7 @@ loop_more_data:
 			errno = ENOMEM;
 			goto bail_out;
 		}
+		lillymem_chargeto (lil->get_qpool, lil->cnxpool);
 		lil->get_gotten = 0;
 	}
 	//
@@ -13,6 +13,10 @@
 #include <lillydap/mem.h>
 
 
+#define lillymsg_packinfo_ext dermsg_lillymsg_packinfo_ext
+#include "msgop.tab"
+
+
 /* The LDAPMessage has a lot of variety built in, and leads to one long
  * dercursor[] array that serialises all variants and that also crosses
  * the abstraction levels that we prefer.
@@ -26,7 +30,7 @@ static const derwalk pck_ldapmsg_shallow [] = {
 	DER_PACK_STORE | DER_TAG_INTEGER,	// messageID
 	DER_PACK_STORE | DER_PACK_ANY,		// protocolOp CHOICE { ... }
 	DER_PACK_OPTIONAL,
-	DER_PACK_STORE | DER_TAG_SEQUENCE,	// controls SEQ-OF OPTIONAL
+	DER_PACK_STORE | DER_TAG_CONTEXT(0),	// controls [0] SEQ-OF OPTIONAL
 	DER_PACK_LEAVE,				// ...}
 	DER_PACK_END
 };
@@ -44,7 +48,7 @@ static const derwalk pck_ldapmsg_shallow [] = {
 // SIMPLIFIED -- we know that INTEGER is clipped to 32 bits under RFC 4511
 // SIMPLIFIED:CHECKIFOKAY -- is the outcome always positive too?
 int32_t qder2b_unpack_int32 (dercursor data4) {
-	int32_t retval = 0;
+	uint32_t retval = 0;
 	int idx;
 #if 0
 	if (data4.derlen > 4) {
@@ -97,9 +101,266 @@ dercursor qder2b_pack_int32 (uint8_t *target_4b, int32_t value) {
 }
 
 
+/* Most traffic consists of a few operations.  For these, the LDAPMessage
+ * can be unpacked in one pass, along with the operation inside it, and
+ * then passed to lillyget_operation() or lillyget_response() straight
+ * away.  The walk stores the messageID, then the fields of the operation
+ * overlay, and then the controls, so the operation can be passed on from
+ * the middle of the dercursor[] array.  The results are the same as with
+ * lillyget_ldapmessage() and lillyget_opcode() in between, so this is only
+ * done when those are the library defaults.
+ */
+#define mkfused(id) \
+	static const derwalk fused_##id [] = { \
+		DER_PACK_ENTER | DER_TAG_SEQUENCE, \
+		DER_PACK_STORE | DER_TAG_INTEGER, \
+		DER_PACK_rfc4511_##id, \
+		DER_PACK_OPTIONAL, \
+		DER_PACK_STORE | DER_TAG_CONTEXT(0), \
+		DER_PACK_LEAVE, \
+		DER_PACK_END \
+	}
+
+mkfused (BindRequest);
+mkfused (SearchRequest);
+mkfused (SearchResultEntry);
+
+#define fusedlen(id) (sizeof (DER_OVLY_rfc4511_##id) / sizeof (dercursor))
+
+static const struct fused_info {
+	const derwalk *walk;
+	uint16_t opfields;
+} fused_table [31] = {
+	[0] = { fused_BindRequest,       fusedlen (BindRequest)       },
+	[3] = { fused_SearchRequest,     fusedlen (SearchRequest)     },
+	[4] = { fused_SearchResultEntry, fusedlen (SearchResultEntry) },
+};
+
+
+/* Peek at the opcode of an LDAPMessage, without unpacking it.  Return 31
+ * when it cannot be found, or when the messageID is not in the range from
+ * 1 to 2^31-1, so the message is refused further on rather than dropped.
+ * The tag from der_header() is the literal byte, so the SEQUENCE has its
+ * constructed flag set.
+ */
+static uint8_t fused_opcode (dercursor msg) {
+	uint8_t tag;
+	uint8_t hlen;
+	size_t len;
+	if ((der_header (&msg, &tag, &len, &hlen) == -1) ||
+			(tag != (DER_TAG_SEQUENCE | 0x20))) {
+		return 31;
+	}
+	if ((der_header (&msg, &tag, &len, &hlen) == -1) ||
+			(tag != DER_TAG_INTEGER) ||
+			(len >= msg.derlen)) {
+		return 31;
+	}
+	uint8_t nonzero = 0;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		nonzero |= msg.derptr [i];
+	}
+	if ((len > 4) || (nonzero == 0) || ((msg.derptr [0] & 0x80) != 0)) {
+		return 31;
+	}
+	uint8_t opcode = (msg.derptr [len] & ~ 0x20) - DER_TAG_APPLICATION(0);
+	return (opcode < 31) ? opcode : 31;
+}
+
+
+/* Find the lillyget_operation() or lillyget_response() function that
+ * lillyget_ldapmessage() and lillyget_opcode() would pass an opcode to.
+ * Return NULL when other layers are in the way, the opcode is rejected, or
+ * it is decoded lazily or with arrays.  A compiled plan holds the same
+ * result in its target table.
+ */
+typedef int (*fused_fun) (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor *data,
+				const dercursor controls);
+
+static fused_fun fused_target (const LillyDAP *def, uint8_t opcode) {
+	bool resp = ((1UL << opcode) & LILLYGETR_ALL_RESP) != 0;
+	if (def->lillyget_ldapmessage != lillyget_ldapmessage) {
+		return NULL;
+	}
+	if ((resp && (def->lillyget_opresp != NULL)) ?
+			(def->lillyget_opresp != lillyget_opcode) :
+			(def->lillyget_opcode != lillyget_opcode)) {
+		return NULL;
+	}
+	if ((def->reject_ops [opcode >> 5] & (1UL << opcode)) != 0) {
+		return NULL;
+	}
+	if ((def->lazyregistry != NULL) && (def->lazyregistry [opcode] != NULL)) {
+		return NULL;
+	}
+	if ((def->seqof_unpack [0] & (1UL << opcode)) != 0) {
+		return NULL;
+	}
+	if (resp && (def->lillyget_response != NULL)) {
+		return def->lillyget_response;
+	}
+	return def->lillyget_operation;
+}
+
+
+/* Decide whether the default layers refuse an opcode.  This is the case
+ * when it is set in reject_ops, when it has no parser, or when there is no
+ * function or opregistry entry to pass it to.  Opcodes that are decoded
+ * lazily have a callback, and are not refused.
+ */
+static bool plan_refuses (const LillyDAP *def, uint8_t opcode) {
+	bool resp = ((1UL << opcode) & LILLYGETR_ALL_RESP) != 0;
+	if ((def->reject_ops [0] & (1UL << opcode)) != 0) {
+		return true;
+	}
+	if ((def->lazyregistry != NULL) && (def->lazyregistry [opcode] != NULL)) {
+		return false;
+	}
+	if (opcode_table [opcode].pck_message == NULL) {
+		return true;
+	}
+	fused_fun operation_fun = def->lillyget_operation;
+	if (resp && (def->lillyget_response != NULL)) {
+		operation_fun = def->lillyget_response;
+	}
+	if (operation_fun == NULL) {
+		return true;
+	}
+	if (operation_fun == lillyget_operation) {
+		return (def->opregistry == NULL) ||
+			(def->opregistry->by_opcode [opcode] == NULL);
+	}
+	return false;
+}
+
+
+/* Compile the lillyget_xxx() layers of a LillyStructural into its plan.
+ */
+void lillydap_compile (LillyDAP *def) {
+	struct LillyPlan *plan = &def->plan;
+	uint8_t opcode;
+	plan->compiled = false;
+	plan->drop [0] = 0;
+	for (opcode = 0; opcode < 31; opcode++) {
+		bool resp = ((1UL << opcode) & LILLYGETR_ALL_RESP) != 0;
+		plan->target [opcode] = fused_target (def, opcode);
+		//
+		// Only drop what the default layers would refuse anyway
+		if ((def->lillyget_dercursor   != lillyget_dercursor) ||
+				(def->lillyget_ldapmessage != lillyget_ldapmessage)) {
+			continue;
+		}
+		if ((resp && (def->lillyget_opresp != NULL)) ?
+				(def->lillyget_opresp != lillyget_opcode) :
+				(def->lillyget_opcode != lillyget_opcode)) {
+			continue;
+		}
+		if ((opcode == OPCODE_EXTENDED_REQ) ||
+				(opcode == OPCODE_EXTENDED_RESP)) {
+			continue;
+		}
+		if (plan_refuses (def, opcode)) {
+			plan->drop [0] |= (1UL << opcode);
+		}
+	}
+	plan->compiled = true;
+}
+
+
+/* Unpack an LDAPMessage with a fused walk, and pass on its operation.
+ */
+static int lillyget_fused (LDAP *lil, LillyPool qpool, dercursor msg,
+				uint8_t opcode, fused_fun operation_fun) {
+	const struct fused_info *fused = &fused_table [opcode];
+	//
+	// Request a memory pool for the msgid
+	if (qpool == NULL) {
+		qpool = lillymem_newpool ();
+		if (qpool == NULL) {
+			errno = ENOMEM;
+			goto bail_out;
+		}
+	}
+	//
+	// Unpack messageID, operation and controls into the qpool
+	dercursor *crs = lillymem_alloc (qpool,
+				(2 + fused->opfields) * sizeof (dercursor));
+	if (crs == NULL) {
+		errno = ENOMEM;
+		goto bail_out;
+	}
+	if (der_unpack (&msg, fused->walk, crs, 1) == -1) {
+		goto bail_out;
+	}
+	int32_t msgid = qder2b_unpack_int32 (crs [0]);
+	if (msgid <= 0) {
+		errno = EINVAL;
+		goto bail_out;
+	}
+	//
+	// Pass down the information -- and the responsibility
+	return operation_fun (lil, qpool, msgid, opcode,
+				crs + 1, crs [1 + fused->opfields]);
+bail_out:
+	if (qpool != NULL) {
+		lillymem_endpool (qpool);
+	}
+	return -1;
+}
+
+
+/* Test whether the plan drops an opcode, and count it if so.
+ */
+static inline bool plan_drops (LDAP *lil, uint8_t opcode) {
+	const struct LillyPlan *plan = &lil->def->plan;
+	if ((!plan->compiled) || (opcode >= 31) ||
+			((plan->drop [0] & (1UL << opcode)) == 0)) {
+		return false;
+	}
+	lil->get_dropped++;
+	return true;
+}
+
+
+/* Test whether a message is dropped by the plan, from the tag of its
+ * operation.  This is used by the readers before they allocate a qpool.
+ */
+bool lillyget_dropped (LDAP *lil, dercursor msg) {
+	if (!lil->def->plan.compiled) {
+		return false;
+	}
+	return plan_drops (lil, fused_opcode (msg));
+}
+
+
 /* Process a dercursor, meaning a <derptr,derlen> combination as an LDAPMessage
  */
 int lillyget_dercursor (LDAP *lil, LillyPool qpool_opt, dercursor msg) {
+	//
+	// Drop the message if the plan says so, before any parsing
+	uint8_t opcode = fused_opcode (msg);
+	if (plan_drops (lil, opcode)) {
+		if (qpool_opt != NULL) {
+			lillymem_endpool (qpool_opt);
+		}
+		return 0;
+	}
+	//
+	// Take the fused path for the most common operations
+	if ((opcode < 31) && (fused_table [opcode].walk != NULL)) {
+		fused_fun operation_fun = lil->def->plan.compiled ?
+				lil->def->plan.target [opcode] :
+				fused_target (lil->def, opcode);
+		if (operation_fun != NULL) {
+			return lillyget_fused (lil, qpool_opt, msg,
+						opcode, operation_fun);
+		}
+	}
 	//
 	// Unpack the DER cursor as an LDAPMessage, but stay shallow
 	dercursor mid_op_ctl [3];
@@ -146,7 +407,8 @@ int lillyput_ldapmessage (LDAP *lil,
 	}
 	//
 	// Set the three fields to the message ID, operation and controls
-	mid_op_ctl [0] = qder2b_pack_int32 (mid_int32, msgid);
+	// The high bit marks an internal initiative, and is not sent
+	mid_op_ctl [0] = qder2b_pack_int32 (mid_int32, msgid & 0x7fffffff);
 	mid_op_ctl [1] = operation;
 	mid_op_ctl [2] = controls;
 	//
@@ -160,6 +422,20 @@ int lillyput_ldapmessage (LDAP *lil,
 		goto bail_out;
 	}
 	der_pack (pck_ldapmsg_shallow, mid_op_ctl, total.derptr + total.derlen);
+	//
+	// The controls are stored as the contents of their [0] tag, which
+	// der_pack() writes as a primitive tag.  They are a SEQUENCE OF, so
+	// set the flag for a constructed tag, as lillyput_operation() does
+	if (controls.derptr != NULL) {
+		size_t ctlhead = 2;
+		size_t len;
+		if (controls.derlen >= 0x80) {
+			for (len = controls.derlen; len > 0; len >>= 8) {
+				ctlhead++;
+			}
+		}
+		total.derptr [total.derlen - controls.derlen - ctlhead] |= 0x20;
+	}
 	return lillyput_dercursor (lil, qpool, total);
 	//
 	// We ran into a problem
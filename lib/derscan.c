@@ -0,0 +1,88 @@
+/* derscan.c -- Index the elements of a constructed DER value in one pass.
+ *
+ * Collections such as a SEQUENCE OF or SET OF are a series of elements,
+ * and finding where each starts means decoding every header in turn.
+ * Most elements in LDAP are small, with a one-byte tag and a length below
+ * 128, so the headers are decoded inline here rather than with a call to
+ * der_skip() for each element.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <lillydap/api.h>
+
+#include <quick-der/api.h>
+
+
+/* Decode the header of the element at p and return its total size, or 0
+ * if it is malformed or does not fit in the left bytes.  Indefinite
+ * lengths are not DER, and are considered malformed.
+ */
+static inline size_t scan_header (const uint8_t *p, size_t left) {
+	size_t h = 1;
+	if (left < 2) {
+		return 0;
+	}
+	if ((p [0] & 0x1f) == 0x1f) {
+		// Tags that take more than one byte
+		do {
+			if (h >= left) {
+				return 0;
+			}
+		} while ((p [h++] & 0x80) != 0);
+		if (h >= left) {
+			return 0;
+		}
+	}
+	size_t len = p [h++];
+	if (len >= 0x80) {
+		size_t lenlen = len & 0x7f;
+		if ((lenlen == 0) || (lenlen > sizeof (size_t)) ||
+				(lenlen > left - h)) {
+			return 0;
+		}
+		len = 0;
+		while (lenlen-- > 0) {
+			len = (len << 8) | p [h++];
+		}
+	}
+	if (len > left - h) {
+		return 0;
+	}
+	return h + len;
+}
+
+
+/* Index the elements of a collection by decoding one header after
+ * another; see <lillydap/api.h>.
+ */
+int qder2b_scan (dercursor *crs, dercursor *elems_opt, size_t *count) {
+	uint8_t *p = crs->derptr;
+	size_t left = crs->derlen;
+	size_t max = *count;
+	size_t n = 0;
+	while ((n < max) && (left > 0)) {
+		size_t el = scan_header (p, left);
+		if (el == 0) {
+			errno = EBADMSG;
+			return -1;
+		}
+		if (elems_opt != NULL) {
+			elems_opt [n].derptr = p;
+			elems_opt [n].derlen = el;
+		}
+		n++;
+		p += el;
+		left -= el;
+	}
+	crs->derptr = p;
+	crs->derlen = left;
+	*count = n;
+	return 0;
+}
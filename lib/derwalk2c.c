@@ -0,0 +1,627 @@
+/* derwalk2c.c -- Generate specialised C code from derwalk programs.
+ *
+ * Quick DER unpacks and packs by interpreting a derwalk program, which is
+ * a byte code that describes the layout of an ASN.1 type.  This program
+ * runs at build time, and turns the derwalk programs for the operations
+ * of RFC 4511 into C functions that do the same for one type each.  Their
+ * tag checks and stores are unrolled, and they write straight into the
+ * overlay of the operation.
+ *
+ * The output is derspec.tab, included by codeop.c after msgop.tab.  It
+ * holds derspec_table with an unpack and a pack function per opcode, and
+ * a description of the parts of the operation for lazy decoding.  The
+ * generated code is strict; it returns a failure on anything unusual, and
+ * leaves it to the interpreter to process or reject such input.  When a
+ * derwalk program holds constructs that this generator does not handle,
+ * the functions are NULL and the interpreter is used.
+ *
+ * Usage: derwalk2c > derspec.tab
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <quick-der/api.h>
+#include <quick-der/rfc4511.h>
+
+
+/* The derwalk programs to generate code for, by opcode.  These are the
+ * same as the ones from mkpqr() in msgop.gperf.
+ */
+#define walk(opcd,id) { opcd, #id, \
+		(const derwalk []) { DER_PACK_rfc4511_##id, DER_PACK_END }, \
+		sizeof (DER_OVLY_rfc4511_##id) / sizeof (dercursor) }
+
+static const struct walkdef {
+	uint8_t opcode;
+	const char *name;
+	const derwalk *walk;
+	int fields;
+} walkdefs [] = {
+	walk (0, BindRequest),
+	walk (1, BindResponse),
+	walk (2, UnbindRequest),
+	walk (3, SearchRequest),
+	walk (4, SearchResultEntry),
+	walk (5, SearchResultDone),
+	walk (6, ModifyRequest),
+	walk (7, ModifyResponse),
+	walk (8, AddRequest),
+	walk (9, AddResponse),
+	walk (10, DelRequest),
+	walk (11, DelResponse),
+	walk (12, ModifyDNRequest),
+	walk (13, ModifyDNResponse),
+	walk (14, CompareRequest),
+	walk (15, CompareResponse),
+	walk (16, AbandonRequest),
+	walk (19, SearchResultReference),
+	walk (23, ExtendedRequest),
+	walk (24, ExtendedResponse),
+	walk (25, IntermediateResponse),
+};
+
+#define NUM_WALKDEFS (sizeof (walkdefs) / sizeof (walkdefs [0]))
+
+
+/* A derwalk program is parsed into a tree of nodes before code is
+ * generated for it.  Every node covers a range of the dercursor[] array.
+ */
+#define MAX_NODES 64
+#define MAX_DEPTH 16
+
+enum nodekind {
+	NODE_STORE,
+	NODE_ANY,
+	NODE_ENTER,
+	NODE_CHOICE,
+};
+
+struct node {
+	enum nodekind kind;
+	uint8_t tag;
+	bool optional;
+	int out;
+	int outs;
+	int nkids;
+	struct node *kids;
+	const derwalk *wfrom;
+	const derwalk *wto;
+};
+
+
+/* The derwalk instructions that are told apart by value must not collide,
+ * or they could be confused when parsing.  This is a property of the
+ * Quick DER version, so a collision disables all generated code.
+ */
+static bool unambiguous (void) {
+	return (DER_PACK_ENTER != 0) &&
+		(DER_PACK_CHOICE_BEGIN != DER_PACK_LEAVE) &&
+		(DER_PACK_CHOICE_BEGIN != DER_PACK_END) &&
+		(DER_PACK_CHOICE_BEGIN != DER_PACK_OPTIONAL) &&
+		(DER_PACK_CHOICE_END != DER_PACK_OPTIONAL) &&
+		(DER_PACK_LEAVE != DER_PACK_OPTIONAL) &&
+		((DER_PACK_ANY & DER_PACK_ENTER) == 0);
+}
+
+
+/* Parse derwalk instructions into nodes, up to the instruction that ends
+ * the current level.  Returns the number of nodes, or -1 for anything
+ * that this generator does not handle.
+ */
+static int parse (const derwalk **wp, struct node *nodes, int *outp,
+				int depth, bool inchoice) {
+	int n = 0;
+	bool optional = false;
+	if (depth >= MAX_DEPTH) {
+		return -1;
+	}
+	while (true) {
+		derwalk cmd = *(*wp)++;
+		if (cmd == DER_PACK_OPTIONAL) {
+			optional = true;
+			continue;
+		}
+		if (inchoice ? (cmd == DER_PACK_CHOICE_END) :
+				((cmd == DER_PACK_LEAVE) || (cmd == DER_PACK_END))) {
+			return optional ? -1 : n;
+		}
+		if (n >= MAX_NODES) {
+			return -1;
+		}
+		struct node *nd = &nodes [n++];
+		memset (nd, 0, sizeof (struct node));
+		nd->optional = optional;
+		nd->out = *outp;
+		nd->wfrom = *wp - 1;
+		optional = false;
+		if ((cmd == DER_PACK_CHOICE_BEGIN) && !inchoice) {
+			nd->kind = NODE_CHOICE;
+			nd->kids = calloc (MAX_NODES, sizeof (struct node));
+			if (nd->kids == NULL) {
+				return -1;
+			}
+			nd->nkids = parse (wp, nd->kids, outp, depth + 1, true);
+			if (nd->nkids <= 0) {
+				return -1;
+			}
+		} else if ((cmd == DER_PACK_ANY) ||
+				(cmd == (DER_PACK_STORE | DER_PACK_ANY))) {
+			nd->kind = NODE_ANY;
+			(*outp)++;
+		} else if ((cmd & DER_PACK_ENTER) == DER_PACK_ENTER) {
+			nd->kind = NODE_ENTER;
+			nd->tag = cmd;
+			nd->kids = calloc (MAX_NODES, sizeof (struct node));
+			if (nd->kids == NULL) {
+				return -1;
+			}
+			nd->nkids = parse (wp, nd->kids, outp, depth + 1, false);
+			if (nd->nkids < 0) {
+				return -1;
+			}
+		} else {
+			nd->kind = NODE_STORE;
+			nd->tag = cmd;
+			(*outp)++;
+		}
+		if ((nd->kind != NODE_CHOICE) && (nd->kind != NODE_ANY) &&
+				((nd->tag & 0x1f) == 0x1f)) {
+			// Tags that take more than one byte
+			return -1;
+		}
+		nd->outs = *outp - nd->out;
+		nd->wto = *wp;
+	}
+}
+
+
+/* Print indentation.
+ */
+static void indent (int level) {
+	while (level-- > 0) {
+		putchar ('\t');
+	}
+}
+
+
+/* Print the condition under which a node matches the tag of the element
+ * in the local variable tag.
+ */
+static void print_match (const struct node *nd) {
+	switch (nd->kind) {
+	case NODE_STORE:
+		printf ("(tag & 0xdf) == 0x%02x", nd->tag & 0xdf);
+		break;
+	case NODE_ENTER:
+		printf ("tag == 0x%02x", nd->tag);
+		break;
+	default:
+		printf ("tag != DERSPEC_NONE");
+		break;
+	}
+}
+
+
+/* Print code that sets the outputs of a node to NULL cursors.
+ */
+static void print_absent (const struct node *nd, int level) {
+	int i;
+	for (i = nd->out; i < nd->out + nd->outs; i++) {
+		indent (level);
+		printf ("out [%d].derptr = NULL;\n", i);
+		indent (level);
+		printf ("out [%d].derlen = 0;\n", i);
+	}
+}
+
+
+/* Print the unpacking code for a list of nodes, taken from crs [depth].
+ */
+static void print_unpack_nodes (const struct node *nodes, int n,
+				int depth, int level);
+
+static void print_unpack_node (const struct node *nd, int depth, int level) {
+	int i;
+	indent (level);
+	printf ("tag = derspec_peek (&crs [%d], &hlen, &len);\n", depth);
+	indent (level);
+	printf ("if (tag == -1) {\n");
+	indent (level + 1);
+	printf ("return -1;\n");
+	indent (level);
+	printf ("}\n");
+	if (nd->kind == NODE_CHOICE) {
+		print_absent (nd, level);
+		for (i = 0; i < nd->nkids; i++) {
+			indent (level);
+			printf ("%sif (", (i > 0) ? "} else " : "");
+			print_match (&nd->kids [i]);
+			printf (") {\n");
+			print_unpack_node (&nd->kids [i], depth, level + 1);
+		}
+		indent (level);
+		printf ("}%s\n", nd->optional ? "" : " else {");
+		if (!nd->optional) {
+			indent (level + 1);
+			printf ("return -1;\n");
+			indent (level);
+			printf ("}\n");
+		}
+		return;
+	}
+	indent (level);
+	printf ("if (");
+	print_match (nd);
+	printf (") {\n");
+	switch (nd->kind) {
+	case NODE_STORE:
+		indent (level + 1);
+		printf ("out [%d].derptr = crs [%d].derptr + hlen;\n", nd->out, depth);
+		indent (level + 1);
+		printf ("out [%d].derlen = len;\n", nd->out);
+		break;
+	case NODE_ANY:
+		indent (level + 1);
+		printf ("out [%d].derptr = crs [%d].derptr;\n", nd->out, depth);
+		indent (level + 1);
+		printf ("out [%d].derlen = hlen + len;\n", nd->out);
+		break;
+	case NODE_ENTER:
+		indent (level + 1);
+		printf ("crs [%d].derptr = crs [%d].derptr + hlen;\n", depth + 1, depth);
+		indent (level + 1);
+		printf ("crs [%d].derlen = len;\n", depth + 1);
+		break;
+	default:
+		break;
+	}
+	indent (level + 1);
+	printf ("crs [%d].derptr += hlen + len;\n", depth);
+	indent (level + 1);
+	printf ("crs [%d].derlen -= hlen + len;\n", depth);
+	if (nd->kind == NODE_ENTER) {
+		print_unpack_nodes (nd->kids, nd->nkids, depth + 1, level + 1);
+		indent (level + 1);
+		printf ("if (crs [%d].derlen != 0) {\n", depth + 1);
+		indent (level + 2);
+		printf ("return -1;\n");
+		indent (level + 1);
+		printf ("}\n");
+	}
+	indent (level);
+	printf ("} else {\n");
+	if (nd->optional) {
+		print_absent (nd, level + 1);
+	} else {
+		indent (level + 1);
+		printf ("return -1;\n");
+	}
+	indent (level);
+	printf ("}\n");
+}
+
+static void print_unpack_nodes (const struct node *nodes, int n,
+				int depth, int level) {
+	int i;
+	for (i = 0; i < n; i++) {
+		print_unpack_node (&nodes [i], depth, level);
+	}
+}
+
+
+/* Check whether the packing code can be generated for a list of nodes.
+ * How the interpreter packs choices and optional constructed elements is
+ * left to the interpreter.
+ */
+static bool can_pack (const struct node *nodes, int n) {
+	int i;
+	for (i = 0; i < n; i++) {
+		if (nodes [i].kind == NODE_CHOICE) {
+			return false;
+		}
+		if (nodes [i].kind == NODE_ENTER) {
+			if (nodes [i].optional) {
+				return false;
+			}
+			if (!can_pack (nodes [i].kids, nodes [i].nkids)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+
+/* Print the packing code for a list of nodes.  Elements are written back
+ * to front, so they are handled in reverse order.  The tag of a stored
+ * SEQUENCE OF or SET OF is marked constructed.
+ */
+static void print_pack_nodes (const struct node *nodes, int n, int level) {
+	int i;
+	for (i = n - 1; i >= 0; i--) {
+		const struct node *nd = &nodes [i];
+		uint8_t tag = nd->tag;
+		if (nd->kind == NODE_ENTER) {
+			indent (level);
+			printf ("{\n");
+			indent (level + 1);
+			printf ("size_t mark = tot;\n");
+			print_pack_nodes (nd->kids, nd->nkids, level + 1);
+			indent (level + 1);
+			printf ("tot += derspec_head (end, tot, 0x%02x, tot - mark);\n", tag);
+			indent (level);
+			printf ("}\n");
+			continue;
+		}
+		indent (level);
+		printf ("if (in [%d].derptr == NULL) {\n", nd->out);
+		indent (level + 1);
+		printf (nd->optional ? "// Absent\n" : "return DERSPEC_CANNOT;\n");
+		indent (level);
+		printf ("} else {\n");
+		indent (level + 1);
+		printf ("if (end != NULL) {\n");
+		indent (level + 2);
+		printf ("memcpy (end - tot - in [%d].derlen, in [%d].derptr, in [%d].derlen);\n",
+				nd->out, nd->out, nd->out);
+		indent (level + 1);
+		printf ("}\n");
+		indent (level + 1);
+		printf ("tot += in [%d].derlen;\n", nd->out);
+		if (nd->kind == NODE_STORE) {
+			if (((tag & 0xdf) == 0x10) || ((tag & 0xdf) == 0x11)) {
+				tag |= 0x20;
+			}
+			indent (level + 1);
+			printf ("tot += derspec_head (end, tot, 0x%02x, in [%d].derlen);\n",
+					tag, nd->out);
+		}
+		indent (level);
+		printf ("}\n");
+	}
+}
+
+
+/* Check whether an operation can be decoded lazily, part by part.  The
+ * parts are the elements inside the operation's tag, and they must be
+ * recognisable by their tag alone, so an optional CHOICE is not allowed.
+ */
+static bool can_lazy (const struct node *top, int n) {
+	int i;
+	if ((n != 1) || (top [0].kind != NODE_ENTER) || (top [0].nkids > 32)) {
+		return false;
+	}
+	for (i = 0; i < top [0].nkids; i++) {
+		const struct node *nd = &top [0].kids [i];
+		if ((nd->kind == NODE_CHOICE) && nd->optional) {
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/* Print the parts of an operation for lazy decoding.  Parts that hold
+ * more than one field are unpacked by the interpreter, with a derwalk
+ * program of their own.
+ */
+static void print_parts (const char *name, const struct node *op) {
+	int i;
+	for (i = 0; i < op->nkids; i++) {
+		const struct node *nd = &op->kids [i];
+		const derwalk *wp;
+		if ((nd->kind != NODE_ENTER) && (nd->kind != NODE_CHOICE)) {
+			continue;
+		}
+		printf ("static const derwalk derspec_walk_%s_%d [] = {", name, i);
+		for (wp = nd->wfrom; wp < nd->wto; wp++) {
+			printf (" 0x%02x,", *wp);
+		}
+		printf (" DER_PACK_END };\n");
+	}
+	printf ("static const struct derspec_part derspec_parts_%s [] = {\n", name);
+	for (i = 0; i < op->nkids; i++) {
+		const struct node *nd = &op->kids [i];
+		switch (nd->kind) {
+		case NODE_STORE:
+			printf ("\t{ DERSPEC_PART_STORE, 0xdf, 0x%02x, %d, %d, %d, NULL },\n",
+				nd->tag & 0xdf, nd->optional, nd->out, nd->outs);
+			break;
+		case NODE_ANY:
+			printf ("\t{ DERSPEC_PART_ANY, 0x00, 0x00, %d, %d, %d, NULL },\n",
+				nd->optional, nd->out, nd->outs);
+			break;
+		case NODE_ENTER:
+			printf ("\t{ DERSPEC_PART_WALK, 0xff, 0x%02x, %d, %d, %d, derspec_walk_%s_%d },\n",
+				nd->tag, nd->optional, nd->out, nd->outs, name, i);
+			break;
+		case NODE_CHOICE:
+			printf ("\t{ DERSPEC_PART_WALK, 0x00, 0x00, %d, %d, %d, derspec_walk_%s_%d },\n",
+				nd->optional, nd->out, nd->outs, name, i);
+			break;
+		}
+	}
+	printf ("};\n\n\n");
+}
+
+
+/* Print the helper functions for the generated code.
+ */
+static void print_helpers (void) {
+	printf (
+"/* Generated by derwalk2c -- do not edit.\n"
+" */\n"
+"\n"
+"\n"
+"#define DERSPEC_NONE   0x100\n"
+"#define DERSPEC_CANNOT ((size_t) -1)\n"
+"\n"
+"\n"
+"/* Look at the next element in a cursor, without moving over it.  Return\n"
+" * its tag, DERSPEC_NONE when the cursor is empty, or -1 when the element\n"
+" * is not in the strict DER form that generated code accepts.\n"
+" */\n"
+"static inline int derspec_peek (const dercursor *crs, size_t *hlen, size_t *len) {\n"
+"\tif (crs->derlen == 0) {\n"
+"\t\treturn DERSPEC_NONE;\n"
+"\t}\n"
+"\tif ((crs->derlen < 2) || ((crs->derptr [0] & 0x1f) == 0x1f)) {\n"
+"\t\treturn -1;\n"
+"\t}\n"
+"\tsize_t l = crs->derptr [1];\n"
+"\tsize_t h = 2;\n"
+"\tif (l >= 0x80) {\n"
+"\t\tint lenlen = l & 0x7f;\n"
+"\t\tif ((lenlen == 0) || (lenlen > 4) || (crs->derlen < 2 + lenlen) ||\n"
+"\t\t\t\t(crs->derptr [2] == 0x00)) {\n"
+"\t\t\treturn -1;\n"
+"\t\t}\n"
+"\t\tl = 0;\n"
+"\t\twhile (lenlen-- > 0) {\n"
+"\t\t\tl = (l << 8) | crs->derptr [h++];\n"
+"\t\t}\n"
+"\t\tif (l < 0x80) {\n"
+"\t\t\treturn -1;\n"
+"\t\t}\n"
+"\t}\n"
+"\tif (l > crs->derlen - h) {\n"
+"\t\treturn -1;\n"
+"\t}\n"
+"\t*hlen = h;\n"
+"\t*len = l;\n"
+"\treturn crs->derptr [0];\n"
+"}\n"
+"\n"
+"\n"
+"/* Write a header before the tot bytes at the end of a buffer, unless end\n"
+" * is NULL.  Return the size of the header.\n"
+" */\n"
+"static inline size_t derspec_head (uint8_t *end, size_t tot, uint8_t tag, size_t len) {\n"
+"\tsize_t h = 2;\n"
+"\tsize_t l;\n"
+"\tif (len >= 0x80) {\n"
+"\t\tfor (l = len; l > 0; l >>= 8) {\n"
+"\t\t\th++;\n"
+"\t\t}\n"
+"\t}\n"
+"\tif (end != NULL) {\n"
+"\t\tuint8_t *hdr = end - tot - h;\n"
+"\t\thdr [0] = tag;\n"
+"\t\tif (h == 2) {\n"
+"\t\t\thdr [1] = len;\n"
+"\t\t} else {\n"
+"\t\t\thdr [1] = 0x80 | (h - 2);\n"
+"\t\t\tfor (l = h - 1; l >= 2; l--) {\n"
+"\t\t\t\thdr [l] = len & 0xff;\n"
+"\t\t\t\tlen >>= 8;\n"
+"\t\t\t}\n"
+"\t\t}\n"
+"\t}\n"
+"\treturn h;\n"
+"}\n"
+"\n"
+"\n"
+"typedef int (*derspec_unpack_fun) (dercursor crs0, dercursor *out);\n"
+"typedef size_t (*derspec_pack_fun) (const dercursor *in, uint8_t *end);\n"
+"\n"
+"/* The parts of an operation, as used for lazy decoding.  A part is\n"
+" * present when the tag of the next element, masked, matches.\n"
+" */\n"
+"#define DERSPEC_PART_STORE 0\n"
+"#define DERSPEC_PART_ANY   1\n"
+"#define DERSPEC_PART_WALK  2\n"
+"\n"
+"struct derspec_part {\n"
+"\tuint8_t kind;\n"
+"\tuint8_t mask;\n"
+"\tuint8_t tag;\n"
+"\tuint8_t optional;\n"
+"\tuint8_t out;\n"
+"\tuint8_t outs;\n"
+"\tconst derwalk *walk;\n"
+"};\n"
+"\n"
+"struct derspec {\n"
+"\tderspec_unpack_fun unpacker;\n"
+"\tderspec_pack_fun packer;\n"
+"\tconst struct derspec_part *parts;\n"
+"\tint nparts;\n"
+"};\n"
+"\n");
+}
+
+
+int main (int argc, char *argv []) {
+	bool unpackable [NUM_WALKDEFS];
+	bool packable [NUM_WALKDEFS];
+	int lazyparts [NUM_WALKDEFS];
+	struct node top [MAX_NODES];
+	unsigned i;
+	print_helpers ();
+	for (i = 0; i < NUM_WALKDEFS; i++) {
+		const struct walkdef *wd = &walkdefs [i];
+		const derwalk *wp = wd->walk;
+		int out = 0;
+		int n = unambiguous () ? parse (&wp, top, &out, 0, false) : -1;
+		unpackable [i] = (n >= 0) && (out == wd->fields);
+		packable [i] = unpackable [i] && can_pack (top, n);
+		lazyparts [i] = (unpackable [i] && can_lazy (top, n)) ? top [0].nkids : -1;
+		if (!unpackable [i]) {
+			printf ("/* %s is left to the interpreter */\n\n\n", wd->name);
+			continue;
+		}
+		printf ("static int derspec_unpack_%s (dercursor crs0, dercursor *out) {\n", wd->name);
+		printf ("\tdercursor crs [%d];\n", MAX_DEPTH + 1);
+		printf ("\tsize_t hlen, len;\n");
+		printf ("\tint tag;\n");
+		printf ("\tcrs [0] = crs0;\n");
+		print_unpack_nodes (top, n, 0, 1);
+		printf ("\treturn (crs [0].derlen == 0) ? 0 : -1;\n");
+		printf ("}\n\n\n");
+		if (lazyparts [i] >= 0) {
+			print_parts (wd->name, &top [0]);
+		}
+		if (!packable [i]) {
+			continue;
+		}
+		printf ("static size_t derspec_pack_%s (const dercursor *in, uint8_t *end) {\n", wd->name);
+		printf ("\tsize_t tot = 0;\n");
+		print_pack_nodes (top, n, 1);
+		printf ("\treturn tot;\n");
+		printf ("}\n\n\n");
+	}
+	printf ("static const struct derspec derspec_table [31] = {\n");
+	int opcode;
+	for (opcode = 0; opcode < 31; opcode++) {
+		for (i = 0; i < NUM_WALKDEFS; i++) {
+			if ((walkdefs [i].opcode == opcode) && unpackable [i]) {
+				break;
+			}
+		}
+		if (i == NUM_WALKDEFS) {
+			printf ("\t/* %2d */ { NULL, NULL, NULL, 0 },\n", opcode);
+			continue;
+		}
+		const char *name = walkdefs [i].name;
+		printf ("\t/* %2d */ { derspec_unpack_%s, ", opcode, name);
+		if (packable [i]) {
+			printf ("derspec_pack_%s, ", name);
+		} else {
+			printf ("NULL, ");
+		}
+		if (lazyparts [i] >= 0) {
+			printf ("derspec_parts_%s, %d },\n", name, lazyparts [i]);
+		} else {
+			printf ("NULL, 0 },\n");
+		}
+	}
+	printf ("};\n");
+	return (ferror (stdout) != 0) ? 1 : 0;
+}
@@ -0,0 +1,70 @@
+/* eventfd.c -- Signal write work for LillyDAP connections over an eventfd.
+ *
+ * This is a reference implementation of the lillyput_signal() callback in
+ * the LillyStructural.  It is called when the output queue goes from empty
+ * to non-empty, and it makes an eventfd readable.  The event loop waits
+ * for that, drains it, and then calls lillyput_event() until the queue is
+ * empty again, waiting for put_fd to be writable in between when needed.
+ * This is for Linux, where eventfd() is available.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <lillydap/api.h>
+#include <lillydap/queue.h>
+
+
+/* Open an eventfd for the connection, store it in put_sigfd and return it.
+ * Returns -1 with errno set on failure.
+ */
+int lillyput_eventfd_open (LDAP *lil) {
+	int fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	lil->put_sigfd = fd;
+	return fd;
+}
+
+
+/* Signal the eventfd of a connection.  This is meant to be used as the
+ * lillyput_signal() callback in the LillyStructural.  Nothing is done
+ * while put_sigfd is -1, so output may be queued before the eventfd is
+ * opened.
+ */
+void lillyput_eventfd_signal (LDAP *lil) {
+	uint64_t one = 1;
+	if (lil->put_sigfd < 0) {
+		return;
+	}
+	if (write (lil->put_sigfd, &one, sizeof (one)) < 0) {
+		// The counter is saturated, so it is readable anyway
+		;
+	}
+}
+
+
+/* Drain the eventfd of a connection after it was reported as readable.
+ * Returns 0 on success or when there was nothing to drain, or -1 with
+ * errno set on failure, which is EBADF when put_sigfd is -1.
+ */
+int lillyput_eventfd_drain (LDAP *lil) {
+	uint64_t count;
+	if (lil->put_sigfd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if (read (lil->put_sigfd, &count, sizeof (count)) < 0) {
+		if (errno != EAGAIN) {
+			return -1;
+		}
+	}
+	return 0;
+}
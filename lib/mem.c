@@ -23,6 +23,65 @@
 
 #include <lillydap/api.h>
 #include <lillydap/mem.h>
+#include <lillydap/timer.h>
+
+#ifndef CONFIG_SINGLE_THREADED
+#   include <sched.h>
+#   include "opa_primitives.h"
+#endif
+
+
+/* The process-wide totals of memory accounting are shared between threads.
+ * Under ThreadSanitizer, the compiler's atomics are used instead of OpenPA,
+ * whose inline assembly hides the ordering of memory accesses from it.
+ */
+#if !defined (CONFIG_SINGLE_THREADED) && defined (__SANITIZE_THREAD__)
+# define lock_take(lockptr)      while (__atomic_exchange_n (lockptr, 1, __ATOMIC_ACQUIRE) != 0) { \
+                                         sched_yield (); \
+                                 }
+# define lock_free(lockptr)      __atomic_store_n (lockptr, 0, __ATOMIC_RELEASE)
+# define int_add(intptr,delta)   __atomic_add_fetch (intptr, delta, __ATOMIC_SEQ_CST)
+# define int_load(intptr)        __atomic_load_n (intptr, __ATOMIC_SEQ_CST)
+# define int_incr(intptr)        __atomic_add_fetch (intptr, 1, __ATOMIC_SEQ_CST)
+# define int_decr(intptr)        __atomic_sub_fetch (intptr, 1, __ATOMIC_SEQ_CST)
+# define int_next(intptr)        __atomic_fetch_add (intptr, 1, __ATOMIC_SEQ_CST)
+# define int_cas(intptr,old,new) ({ int _old = (old); \
+                                    __atomic_compare_exchange_n (intptr, &_old, new, false, \
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+                                    _old; })
+# define int_set(intptr,new)     __atomic_store_n (intptr, new, __ATOMIC_SEQ_CST)
+# define cas_ptr(ptrptr,old,new) ({ __typeof__ (*(ptrptr)) _old = (old); \
+                                    __atomic_compare_exchange_n (ptrptr, &_old, new, false, \
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+                                    _old; })
+# define get_ptr(ptrptr)         __atomic_load_n (ptrptr, __ATOMIC_SEQ_CST)
+#elif !defined (CONFIG_SINGLE_THREADED)
+# define lock_take(lockptr)      while (OPA_cas_int ((OPA_int_t *) lockptr, 0, 1) != 0) { \
+                                         OPA_busy_wait (); \
+                                 }
+# define lock_free(lockptr)      OPA_store_int ((OPA_int_t *) lockptr, 0)
+# define int_add(intptr,delta)   OPA_add_int   ((OPA_int_t *) intptr, delta)
+# define int_load(intptr)        OPA_load_int  ((OPA_int_t *) intptr)
+# define int_incr(intptr)        OPA_incr_int  ((OPA_int_t *) intptr)
+# define int_decr(intptr)        OPA_decr_int  ((OPA_int_t *) intptr)
+# define int_next(intptr)        OPA_fetch_and_incr_int ((OPA_int_t *) intptr)
+# define int_cas(intptr,old,new) OPA_cas_int   ((OPA_int_t *) intptr, old, new)
+# define int_set(intptr,new)     OPA_store_int ((OPA_int_t *) intptr, new)
+# define cas_ptr(ptrptr,old,new) OPA_cas_ptr   ((OPA_ptr_t *) ptrptr, old, new)
+# define get_ptr(ptrptr)         OPA_load_ptr  ((OPA_ptr_t *) ptrptr)
+#else
+# define lock_take(lockptr)
+# define lock_free(lockptr)
+# define int_add(intptr,delta)   (*(intptr) += (delta))
+# define int_load(intptr)        (*(intptr))
+# define int_incr(intptr)        ((*(intptr))++)
+# define int_decr(intptr)        ((*(intptr))--)
+# define int_next(intptr)        ((*(intptr))++)
+# define int_cas(intptr,old,new) ((*(intptr) == (old)) ? ((*(intptr) = (new)), (old)) : *(intptr))
+# define int_set(intptr,new)     (*(intptr) = (new))
+# define cas_ptr(ptrptr,old,new) ((*(ptrptr) == (old)) ? ((*(ptrptr) = (new)), (old)) : *(ptrptr))
+# define get_ptr(ptrptr)         (*(ptrptr))
+#endif
 
 
 /* The following symbols are shared between the LillyDAP modules for their
@@ -37,6 +96,20 @@ lillydap_endpool lillymem_endpool_fun;
 lillydap_alloc   lillymem_alloc_fun;
 
 
+/* The following symbols are optional; they may be left NULL by the
+ * application when its memory pools cannot call cleanup routines, or
+ * when they have no better way of clearing memory than memset().
+ */
+lillydap_atend   lillymem_atend_fun;
+lillydap_alloc0  lillymem_alloc0_fun;
+
+
+/* Pools start with a LillyPoolHead when this is set by the application,
+ * so lillymem_alloc() can allocate from them without a function call.
+ */
+bool lillymem_poolhead_abi;
+
+
 /* Ensure having a memory pool.  When the pointer has a NULL value, it will be
  * allocated on the spot.  If that fails, errno will be set to ENOMEM and the
  * success-indicating return value is False.
@@ -56,6 +129,9 @@ bool lillymem_havepool (LillyPool *pool) {
 /* This is an extension to memory allocation which clears the memory.
  */
 void *lillymem_alloc0 (LillyPool pool, size_t szbytes) {
+	if (lillymem_alloc0_fun != NULL) {
+		return lillymem_alloc0_fun (pool, szbytes);
+	}
 	void *rv = lillymem_alloc (pool, szbytes);
 	if (rv != NULL) {
 		memset (rv, 0, szbytes);
@@ -64,6 +140,237 @@ void *lillymem_alloc0 (LillyPool pool, size_t szbytes) {
 }
 
 
+/* Memory accounting wraps the functions of the underlying allocator.  The
+ * accounting pool is allocated from the pool that it wraps.  It starts
+ * with a LillyPoolHead without room, so lillymem_alloc() always calls
+ * lillymem_account_alloc() to count the allocation.
+ *
+ * The process-wide kilobytes are updated when a pool passes a kilobyte
+ * boundary, so most allocations do not touch the shared counters.  The
+ * same goes for the cnxbytes of a cnxpool that a qpool charges to; many
+ * threads may charge it at once, so it is a size_t that is updated with
+ * a compare-and-swap, as if it were a pointer.
+ */
+struct LillyMemAccount {
+	struct LillyPoolHead head;
+	LillyPool inner;
+	struct LillyMemStats stats;
+	int kbytes;
+	struct LillyMemAccount *cnx;
+};
+
+static struct {
+	lillydap_newpool newpool;
+	lillydap_endpool endpool;
+	lillydap_alloc   alloc;
+	lillydap_alloc0  alloc0;
+	lillydap_atend   atend;
+	size_t quota;
+} account_inner;
+
+static struct LillyMemTotals account_totals;
+
+
+static LillyPool lillymem_account_newpool (void) {
+	LillyPool inner = account_inner.newpool ();
+	if (inner == NULL) {
+		return NULL;
+	}
+	struct LillyMemAccount *acct = account_inner.alloc (inner,
+					sizeof (struct LillyMemAccount));
+	if (acct == NULL) {
+		account_inner.endpool (inner);
+		errno = ENOMEM;
+		return NULL;
+	}
+	acct->head.alloc_ptr = (uint8_t *) (acct + 1);
+	acct->head.alloc_end = (uint8_t *) (acct + 1);
+	acct->inner = inner;
+	acct->stats.bytes = 0;
+	acct->stats.allocs = 0;
+	acct->stats.quota = account_inner.quota;
+	acct->stats.cnxbytes = 0;
+	acct->stats.cnxquota = 0;
+	acct->kbytes = 0;
+	acct->cnx = NULL;
+	int_incr (&account_totals.pools);
+	return acct;
+}
+
+
+/* Charge a change in the kilobytes of a qpool to its cnxpool, or refuse
+ * it when that would exceed the cnxquota.  Returning memory always works.
+ */
+static bool lillymem_account_cnxcharge (struct LillyMemAccount *cnx,
+				int kbytes) {
+	void **cnxbytes = (void **) &cnx->stats.cnxbytes;
+	void *old, *new;
+	do {
+		old = get_ptr (cnxbytes);
+		new = (void *) ((uintptr_t) old + (intptr_t) kbytes * 1024);
+		if ((kbytes > 0) && (cnx->stats.cnxquota > 0) &&
+				((size_t) (uintptr_t) new > cnx->stats.cnxquota)) {
+			return false;
+		}
+	} while (cas_ptr (cnxbytes, old, new) != old);
+	return true;
+}
+
+
+static void lillymem_account_endpool (LillyPool cango) {
+	struct LillyMemAccount *acct = cango;
+	if (acct == NULL) {
+		return;
+	}
+	if (acct->cnx != NULL) {
+		lillymem_account_cnxcharge (acct->cnx, - acct->kbytes);
+	}
+	int_add (&account_totals.kbytes, - acct->kbytes);
+	int_decr (&account_totals.pools);
+	account_inner.endpool (acct->inner);
+}
+
+
+/* Count an allocation against a pool, or refuse it when it would exceed
+ * the quota of the pool, or the cnxquota of the cnxpool it charges to.
+ */
+static bool lillymem_account_charge (struct LillyMemAccount *acct,
+				size_t szbytes) {
+	size_t bytes = acct->stats.bytes + szbytes;
+	if ((bytes < szbytes) || ((acct->stats.quota > 0) &&
+				(bytes > acct->stats.quota))) {
+		goto refuse;
+	}
+	int kbytes = (int) ((bytes + 1023) / 1024);
+	if (kbytes != acct->kbytes) {
+		if ((acct->cnx != NULL) && !lillymem_account_cnxcharge (
+					acct->cnx, kbytes - acct->kbytes)) {
+			goto refuse;
+		}
+		int_add (&account_totals.kbytes, kbytes - acct->kbytes);
+		acct->kbytes = kbytes;
+	}
+	acct->stats.bytes = bytes;
+	acct->stats.allocs++;
+	return true;
+refuse:
+	int_incr (&account_totals.refused);
+	errno = ENOMEM;
+	return false;
+}
+
+
+static void *lillymem_account_alloc (LillyPool pool, size_t szbytes) {
+	struct LillyMemAccount *acct = pool;
+	if (!lillymem_account_charge (acct, szbytes)) {
+		return NULL;
+	}
+	return account_inner.alloc (acct->inner, szbytes);
+}
+
+
+static void *lillymem_account_alloc0 (LillyPool pool, size_t szbytes) {
+	struct LillyMemAccount *acct = pool;
+	if (!lillymem_account_charge (acct, szbytes)) {
+		return NULL;
+	}
+	return account_inner.alloc0 (acct->inner, szbytes);
+}
+
+
+static bool lillymem_account_atend (LillyPool pool,
+				void (*cleanup) (void *cbdata),
+				void *cbdata) {
+	struct LillyMemAccount *acct = pool;
+	return account_inner.atend (acct->inner, cleanup, cbdata);
+}
+
+
+/* Enable memory accounting, with the given quota for new pools.
+ */
+void lillymem_accounting (size_t quota) {
+	account_inner.newpool = lillymem_newpool_fun;
+	account_inner.endpool = lillymem_endpool_fun;
+	account_inner.alloc   = lillymem_alloc_fun;
+	account_inner.alloc0  = lillymem_alloc0_fun;
+	account_inner.atend   = lillymem_atend_fun;
+	account_inner.quota   = quota;
+	lillymem_newpool_fun = lillymem_account_newpool;
+	lillymem_endpool_fun = lillymem_account_endpool;
+	lillymem_alloc_fun   = lillymem_account_alloc;
+	lillymem_alloc0_fun  = (account_inner.alloc0 != NULL) ? lillymem_account_alloc0 : NULL;
+	lillymem_atend_fun   = (account_inner.atend  != NULL) ? lillymem_account_atend  : NULL;
+}
+
+
+/* Set the quota for a pool.  Allocations already made are not undone.
+ * Returns false when memory accounting is not enabled.
+ */
+bool lillymem_setquota (LillyPool pool, size_t quota) {
+	if (lillymem_newpool_fun != lillymem_account_newpool) {
+		return false;
+	}
+	struct LillyMemAccount *acct = pool;
+	acct->stats.quota = quota;
+	return true;
+}
+
+
+/* Set the cnxquota of a cnxpool, which limits the memory of the qpools that
+ * charge to it together.  Allocations already made are not undone.  Returns
+ * false when memory accounting is not enabled.
+ */
+bool lillymem_setcnxquota (LillyPool cnxpool, size_t cnxquota) {
+	if (lillymem_newpool_fun != lillymem_account_newpool) {
+		return false;
+	}
+	struct LillyMemAccount *cnx = cnxpool;
+	cnx->stats.cnxquota = cnxquota;
+	return true;
+}
+
+
+/* Have a new qpool charge its memory to a cnxpool, if that has a cnxquota.
+ * Returns false when memory accounting is not enabled, or when the cnxpool
+ * has no cnxquota, in which case nothing is charged.
+ */
+bool lillymem_chargeto (LillyPool qpool, LillyPool cnxpool) {
+	if (lillymem_newpool_fun != lillymem_account_newpool) {
+		return false;
+	}
+	struct LillyMemAccount *acct = qpool;
+	struct LillyMemAccount *cnx = cnxpool;
+	if ((cnx == NULL) || (cnx->stats.cnxquota == 0)) {
+		return false;
+	}
+	acct->cnx = cnx;
+	return true;
+}
+
+
+/* Retrieve the accounting of a pool.  Returns false when memory accounting
+ * is not enabled.
+ */
+bool lillymem_poolstats (LillyPool pool, struct LillyMemStats *stats) {
+	if (lillymem_newpool_fun != lillymem_account_newpool) {
+		return false;
+	}
+	struct LillyMemAccount *acct = pool;
+	*stats = acct->stats;
+	stats->cnxbytes = (size_t) (uintptr_t) get_ptr ((void **) &acct->stats.cnxbytes);
+	return true;
+}
+
+
+/* Retrieve the process-wide totals of memory accounting.
+ */
+void lillymem_totals (struct LillyMemTotals *totals) {
+	totals->pools   = int_load (&account_totals.pools);
+	totals->kbytes  = int_load (&account_totals.kbytes);
+	totals->refused = int_load (&account_totals.refused);
+}
+
+
 /* Allocate connection-bound memory.  This will be removed when the
  * connection is properly closed.
  */
@@ -72,9 +379,51 @@ void *lillymem_alloc_cnx (LDAP *lil, size_t szbytes) {
 }
 
 
-/* This is a stupid implementation of test-and-set, not fit for concurrency.
+/* Install a new table for MessageID values, of twice the size of the
+ * current one, or of LILLYDAP_MSGID_TABLESIZE when there is none yet.
+ * When another thread installs one first, that is used instead.  Returns
+ * the current table, or NULL if none could be allocated.
+ *
+ * The table is allocated from the cnxpool, which may only be used by one
+ * thread at a time, so growth is serialised under lil->msgtab_lock.
  */
-#define testandset(var,old,new) (((var)==(old))? ((var)=(old),1): 0)
+static struct LillyMsgTable *lillymsg_grow (LDAP *lil, struct LillyMsgTable *tab) {
+	lock_take (&lil->msgtab_lock);
+	if (get_ptr (&lil->msgtab) == tab) {
+		uint32_t size = (tab != NULL) ? 2 * (tab->mask + 1) : LILLYDAP_MSGID_TABLESIZE;
+		struct LillyMsgTable *newtab = lillymem_alloc0 (lil->cnxpool,
+					sizeof (struct LillyMsgTable) +
+					size * sizeof (struct LillyMsgInfo));
+		if (newtab != NULL) {
+			newtab->older = tab;
+			newtab->mask = size - 1;
+			cas_ptr (&lil->msgtab, tab, newtab);
+		}
+	}
+	lock_free (&lil->msgtab_lock);
+	return get_ptr (&lil->msgtab);
+}
+
+
+/* Find the entry for a MessageID, or return NULL if it is not in use.
+ * Older tables without entries in use are skipped.  The table holding
+ * the entry is returned in *tabp.
+ */
+static struct LillyMsgInfo *lillymsg_find (LDAP *lil, LillyMsgId mid,
+				struct LillyMsgTable **tabp) {
+	struct LillyMsgTable *tab = get_ptr (&lil->msgtab);
+	while (tab != NULL) {
+		if (int_load (&tab->live) > 0) {
+			struct LillyMsgInfo *info = &tab->msgid_info [mid & tab->mask];
+			if ((LillyMsgId) int_load (&info->reqid) == mid) {
+				*tabp = tab;
+				return info;
+			}
+		}
+		tab = tab->older;
+	}
+	return NULL;
+}
 
 
 /* Allocate an unused MessageID value for the given LillyDAP connection.
@@ -84,100 +433,274 @@ void *lillymem_alloc_cnx (LDAP *lil, size_t szbytes) {
  * The value returned is an internal notation; in fact, the high bit will
  * be set to distinguish these outward initiatives (put Requests, get
  * Responses) from inward initiatives (get Requests, put Responses) and
- * still use one hash table with MessageID and LillyPool values.
+ * still use one table with MessageID and LillyPool values.
  *
  * When a pointer to a LillyPool is provided, it will be filled with the
  * newly created memory pool for the query.
  */
 LillyMsgId lillymsg_id_alloc (LDAP *lil, LillyPool *newpool) {
-	uint32_t rv;
-	uint16_t slot;
-	bool todo;
-already_taken:
-	rv |= 0x80000000;   // Mark as an internal initiative
-	todo = true;
-	// Insert as new hash entry, set todo = false when added
-	slot = rv & (LILLYDAP_MSGID_LAYERSIZE - 1);
-	struct LillyMsgLayer **layer = &lil->msghash;
+	return lillymsg_id_alloc_cb (lil, newpool, NULL, NULL);
+}
+
+
+/* Allocate a MessageID like lillymsg_id_alloc(), and register a callback
+ * for its responses with lillyget_correlate().
+ */
+LillyMsgId lillymsg_id_alloc_cb (LDAP *lil, LillyPool *newpool,
+				lillymsg_callback cb, void *cbdata) {
+	LillyPool pool = lillymem_newpool ();
+	if (newpool != NULL) {
+		*newpool = pool;
+	}
+	if (pool == NULL) {
+		errno = ENOMEM;
+		return 0;
+	}
+	lillymem_chargeto (pool, lil->cnxpool);
+	struct LillyMsgTable *tab = get_ptr (&lil->msgtab);
+	int probes = 0;
 	while (1) {
-		if (*layer == NULL) {
-			// Need to insert a layer (and have it set to 0)
-			struct LillyMsgLayer *newlayer = lillymem_alloc0 (
-						lil->cnxpool,
-						sizeof (struct LillyMsgLayer));
-			if (newlayer == NULL) {
-				return 0;
-			}
-			// Maybe someone else beat us to it; then add at end
-			struct LillyMsgLayer **layer2 = layer;
-			while (!testandset (*layer2, NULL, newlayer)) {
-				layer2 = &(*layer2)->next_layer;
+		if ((tab == NULL) || (probes >= LILLYDAP_MSGID_PROBES)) {
+			tab = lillymsg_grow (lil, tab);
+			if (tab == NULL) {
+				goto bail_out;
 			}
+			probes = 0;
 		}
-		// Now *layer is not NULL, and points to the next to test
-		if (testandset ((*layer)->msgid_info [slot].reqid, 0, rv)) {
-			// We dropped our rv, so we're settling
-			// we can add a pool now, safe since rv is unpublished
-			LillyPool pool = lillymem_newpool ();
-			if (newpool != NULL) {
-				*newpool = pool;
-			}
-			if (pool == NULL) {
-				// Failed to allocate, cleanup and fail
-				(*layer)->msgid_info [slot].reqid = 0;
-				return 0;
-			}
-			(*layer)->msgid_info [slot].reqpool = pool;
-			return rv;
-		} else {
-			if ((*layer)->msgid_info [slot].reqid == rv) {
-				// Force another cycle with another ID
-				goto already_taken;
+		LillyMsgId mid = ((LillyMsgId) int_next (&lil->msgid_next)) & 0x7fffffff;
+		if (mid == 0) {
+			// MessageID 0 is reserved for unsolicited notifications
+			continue;
+		}
+		mid |= 0x80000000;   // Mark as an internal initiative
+		struct LillyMsgInfo *info = &tab->msgid_info [mid & tab->mask];
+		if (int_cas (&info->reqid, 0, (int) mid) == 0) {
+			// We hold the entry, and can fill it before handing out mid
+			info->reqpool = pool;
+			info->reqcb = cb;
+			info->reqcbdata = cbdata;
+			int_incr (&tab->live);
+			if ((lil->msg_timers != NULL) && (lil->ld_timelimit > 0)) {
+				if (lillytimer_register (lil->msg_timers, lil, mid,
+						lil->ld_timelimit * 1000) == -1) {
+					lillymsg_id_free (lil, mid);
+					if (newpool != NULL) {
+						*newpool = NULL;
+					}
+					errno = ENOMEM;
+					return 0;
+				}
 			}
+			return mid;
 		}
+		probes++;
 	}
-	return rv;
+bail_out:
+	if (newpool != NULL) {
+		*newpool = NULL;
+	}
+	lillymem_endpool (pool);
+	errno = ENOMEM;
+	return 0;
+}
+
+
+/* Claim the entry of a MessageID, so that no other thread can end its
+ * qpool.  The reqid is swapped for LILLYMSG_BUSY, which no MessageID can
+ * match because 0 is never handed out.  Returns NULL when the entry was
+ * not found, or when another thread claimed it first.
+ */
+#define LILLYMSG_BUSY ((int) 0x80000000)
+static struct LillyMsgInfo *lillymsg_claim (LDAP *lil, LillyMsgId mid,
+				struct LillyMsgTable **tabp) {
+	struct LillyMsgInfo *info = lillymsg_find (lil, mid, tabp);
+	if (info == NULL) {
+		return NULL;
+	}
+	if (int_cas (&info->reqid, (int) mid, LILLYMSG_BUSY) != (int) mid) {
+		return NULL;
+	}
+	return info;
+}
+
+
+/* Release a claimed entry, ending its qpool.  The reqid is reset last,
+ * so the entry cannot be reclaimed before we're done.
+ */
+static void lillymsg_release (struct LillyMsgTable *tab,
+				struct LillyMsgInfo *info) {
+	lillymem_endpool (info->reqpool);
+	info->reqpool = NULL;
+	info->reqcb = NULL;
+	int_decr (&tab->live);
+	int_set (&info->reqid, 0);
 }
 
 
 /* Free a MessageID from the given LillyDAP connection.  This also clears
- * the related memory pool for the query.
+ * the related memory pool for the query.  When several threads free the
+ * same MessageID, only one of them gets to end the qpool.
  */
 void lillymsg_id_free (LDAP *lil, LillyMsgId cango) {
-	struct LillyMsgLayer *layer = lil->msghash;
-	uint16_t slot = cango & (LILLYDAP_MSGID_LAYERSIZE - 1);
-	while (layer) {
-		if (layer->msgid_info [slot].reqid == cango) {
-			// We can cleanup, but should free the reqid last,
-			// so the slot cannot be reclaimed before we're done
-			lillymem_endpool (layer->msgid_info [slot].reqpool);
-			layer->msgid_info [slot].reqpool = NULL;
-			layer->msgid_info [slot].reqid = 0;
-			// The reqid occurs only once, so we're done
-			return;
-		}
-		layer = layer->next_layer;
+	struct LillyMsgTable *tab;
+	struct LillyMsgInfo *info = lillymsg_claim (lil, cango, &tab);
+	if (info == NULL) {
+		// Already freed; we should never end up here otherwise
+		return;
 	}
-	// We should never end up here; maybe we're leaking memory
+	lillymsg_release (tab, info);
 }
 
 
 /* After lillymsg_id_alloc() and before lillymsg_id_free(), the query's
- * memory pool can be requested from the connection's hash pool.
+ * memory pool can be requested from the connection's table.
  */
 LillyPool lillymsg_id_qpool (LDAP *lil, LillyMsgId mid) {
-	//TODO// Much of this code is shared -- centralise it?
-	struct LillyMsgLayer *layer = lil->msghash;
-	uint16_t slot = mid & (LILLYDAP_MSGID_LAYERSIZE - 1);
-	while (layer) {
-		if (layer->msgid_info [slot].reqid == mid) {
-			// Jackpot!  This is the sought reqpool
-			return layer->msgid_info [slot].reqpool;
+	struct LillyMsgTable *tab;
+	struct LillyMsgInfo *info = lillymsg_find (lil, mid, &tab);
+	if (info == NULL) {
+		// We should never end up here; maybe we're confused
+		return NULL;
+	}
+	return info->reqpool;
+}
+
+
+/* Pass a response to the callback that was registered for its request.
+ * This is meant for the lillyget_response field.  The MessageID on the
+ * wire lacks the high bit of the internal notation, so it is set for the
+ * lookup.  Search results and intermediate responses are followed by more,
+ * but any other response is final, and frees the MessageID after the
+ * callback returns.
+ *
+ * Responses to requests without a callback, and unsolicited notifications
+ * with MessageID 0, are passed to lillyget_operation() instead.
+ */
+int lillyget_correlate (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor *data,
+				const dercursor controls) {
+	LillyMsgId mid = msgid | 0x80000000;
+	// Not a SearchResultEntry, SearchResultReference or
+	// IntermediateResponse, so this is the final response
+	bool final = (opcode != 4) && (opcode != 19) && (opcode != 25);
+	struct LillyMsgTable *tab;
+	struct LillyMsgInfo *info = NULL;
+	if (msgid != 0) {
+		info = final ? lillymsg_claim (lil, mid, &tab)
+		             : lillymsg_find  (lil, mid, &tab);
+	}
+	lillymsg_callback cb = (info != NULL) ? info->reqcb : NULL;
+	if (cb == NULL) {
+		if ((info != NULL) && final) {
+			lillymsg_release (tab, info);
+		}
+		if (lil->def->lillyget_operation == NULL) {
+			lillymem_endpool (qpool);
+			errno = ENOSYS;
+			return -1;
 		}
-		layer = layer->next_layer;
+		return lil->def->lillyget_operation (lil, qpool, msgid, opcode, data, controls);
 	}
-	// We should never end up here; maybe we're confused
-	return NULL;
+	int retval = cb (lil, qpool, mid, opcode, data, controls, info->reqcbdata);
+	if (final) {
+		lillymsg_release (tab, info);
+	}
+	return retval;
 }
 
 
+/* Send an AbandonRequest for an outstanding request.  The AbandonRequest
+ * has a MessageID of its own, which is never registered because no
+ * response will come.  Its content is the MessageID that was sent, so
+ * without the high bit, as a minimal INTEGER.
+ */
+static int lillymsg_abandon_send (LDAP *lil, LillyMsgId cango) {
+	int retval = -1;
+	LillyPool qpool = lillymem_newpool ();
+	if (qpool == NULL) {
+		errno = ENOMEM;
+		goto bail_out;
+	}
+	LillyMsgId abandonid;
+	do {
+		abandonid = ((LillyMsgId) int_next (&lil->msgid_next)) & 0x7fffffff;
+	} while (abandonid == 0);
+	uint8_t *intbuf = lillymem_alloc (qpool, 5);
+	if (intbuf == NULL) {
+		lillymem_endpool (qpool);
+		errno = ENOMEM;
+		goto bail_out;
+	}
+	uint32_t mid = cango & 0x7fffffff;
+	dercursor abandoned;
+	abandoned.derptr = intbuf + 5;
+	abandoned.derlen = 0;
+	do {
+		*--abandoned.derptr = (mid & 0xff);
+		abandoned.derlen++;
+		mid >>= 8;
+	} while (mid > 0);
+	if (*abandoned.derptr & 0x80) {
+		// Keep the INTEGER positive
+		*--abandoned.derptr = 0x00;
+		abandoned.derlen++;
+	}
+	dercursor nocontrols;
+	nocontrols.derptr = NULL;
+	nocontrols.derlen = 0;
+	if (lil->def->lillyput_operation == NULL) {
+		lillymem_endpool (qpool);
+		errno = ENOSYS;
+		goto bail_out;
+	}
+	if (lil->def->lillyput_operation (lil, qpool, abandonid, 16,
+				&abandoned, nocontrols) == -1) {
+		lillymem_endpool (qpool);
+		goto bail_out;
+	}
+	retval = 0;
+bail_out:
+	return retval;
+}
+
+
+/* Abandon an outstanding request.  The entry is claimed first, so that a
+ * response that arrives meanwhile cannot free it as well.  When the claim
+ * fails, the AbandonRequest is still sent, but freeing is left to whoever
+ * holds the entry; that may be lillymsg_id_expire() calling back.
+ */
+int lillymsg_abandon (LDAP *lil, LillyMsgId cango) {
+	struct LillyMsgTable *tab;
+	struct LillyMsgInfo *info = lillymsg_claim (lil, cango, &tab);
+	int retval = lillymsg_abandon_send (lil, cango);
+	if (info != NULL) {
+		lillymsg_release (tab, info);
+	}
+	return retval;
+}
+
+
+/* Expire a request that ran out of its time limit.  The entry is claimed
+ * before anything is done, so a response that arrives meanwhile is passed
+ * on as unsolicited, and the request does not expire after it was freed.
+ * The lillymsg_timeout callback or the AbandonRequest runs on the claimed
+ * entry, which is freed afterwards.
+ */
+bool lillymsg_id_expire (LDAP *lil, LillyMsgId mid) {
+	struct LillyMsgTable *tab;
+	struct LillyMsgInfo *info = lillymsg_claim (lil, mid, &tab);
+	if (info == NULL) {
+		return false;
+	}
+	if (lil->def->lillymsg_timeout != NULL) {
+		lil->def->lillymsg_timeout (lil, mid);
+	} else {
+		lillymsg_abandon_send (lil, mid);
+	}
+	lillymsg_release (tab, info);
+	return true;
+}
+
@@ -73,13 +73,21 @@ int lillyget_ldapmessage (LDAP *lil,
 	}
 	//
 	// If this is an ExtendedRequest or ExtendedResponse, process any OID
+	// The fields are unpacked in the qpool, so lillyget_opcode() can
+	// pick them up from the connection instead of unpacking them again
 	bool extreq  = (opcode == OPCODE_EXTENDED_REQ );
 	bool extresp = (opcode == OPCODE_EXTENDED_RESP);
-	dercursor extcrs [6];	// 2 in ExtendedRequest, 6 in ExtendedResponse
+	dercursor *extcrs = NULL;	// 2 in ExtendedRequest, 6 in ExtendedResponse
 	if (extreq || extresp) {
+		extcrs = lillymem_alloc (qpool, 6 * sizeof (dercursor));
+		if (extcrs == NULL) {
+			errno = ENOMEM;
+			goto bail_out;
+		}
 		//
 		// Apply the parser to the operation
-		if (der_unpack ((dercursor *) &op,
+		dercursor extop = op;
+		if (der_unpack (&extop,
 				opcode_table [opcode].pck_message,
 				extcrs, 1) == -1) {
 			goto bail_out;
@@ -102,7 +110,16 @@ int lillyget_ldapmessage (LDAP *lil,
 	}
 	//
 	// Call the desired backend, lillyget_operation() or lillyget_response()
-	return opcode_fun (lil, qpool, msgid, opcode, op, controls);
+	// Offer the Extended operation fields only during this call
+	if (extcrs == NULL) {
+		return opcode_fun (lil, qpool, msgid, opcode, op, controls);
+	}
+	lil->get_extcrs = extcrs;
+	lil->get_extop  = op.derptr;
+	int retval = opcode_fun (lil, qpool, msgid, opcode, op, controls);
+	lil->get_extcrs = NULL;
+	lil->get_extop  = NULL;
+	return retval;
 bail_out:
 	if (qpool != NULL) {
 		lillymem_endpool (qpool);
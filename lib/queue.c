@@ -4,13 +4,20 @@
  */
 
 
+#include <limits.h>
 #include <stdint.h>
 #include <string.h>
 
+#include <sched.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#ifdef __linux__
+#   include <linux/futex.h>
+#   include <sys/syscall.h>
+#endif
+
 #include <lillydap/api.h>
 #include <lillydap/queue.h>
 
@@ -65,13 +72,15 @@
  * and that's why it is so much fun :-D
  *
  * Are there any problems left?  Yes, maybe.  On a cooperatively
- * multitasking system, there may be so many threads willing to act
- * that they occupy the processor in spinlocks, and no cycles go to
- * the threads that actually advance the state of the queue to one
- * where others break out of their spinlocks.  This would call for
- * a yield after a number of spinlock loops (probably the number
- * of loops during which another thread can advance the state, were
- * it to run on the processor at the same time).
+ * multitasking system, or with more threads than processors, there may
+ * be so many threads willing to act that they occupy the processor in
+ * spinlocks, and no cycles go to the threads that actually advance the
+ * state of the queue to one where others break out of their spinlocks.
+ * This is why the waiting in lillyput_await() is adaptive; it spins for
+ * a short while, then yields the processor a few times and finally parks
+ * the thread on a futex, until the thread it waits for calls
+ * lillyput_wakeup().  How often each of these happened is counted in the
+ * connection, and can be retrieved with lillyput_contention().
  *
  * From: Rick van Rein <rick@openfortress.nl>
  */
@@ -94,6 +103,27 @@
                                  OPA_load_ptr  ((OPA_ptr_t *) ptrptr) )
 # define nil_ptr(ptrptr)         (NULL == get_ptr (ptrptr))
 
+/* Counters and futex words are plain int fields, accessed as OPA_int_t */
+# define int_incr(intptr)        OPA_incr_int  ((OPA_int_t *) intptr)
+# define int_decr(intptr)        OPA_decr_int  ((OPA_int_t *) intptr)
+# define int_load(intptr)        OPA_load_int  ((OPA_int_t *) intptr)
+# define int_cas(intptr,old,new) OPA_cas_int   ((OPA_int_t *) intptr, old, new)
+
+/* Byte counts may exceed an int, so they are size_t fields that OPA can
+ * only handle as pointers; additions retry a compare-and-swap.  Returns the
+ * new value.
+ */
+static inline size_t size_add (size_t *sizeptr, ssize_t delta) {
+	void *old, *new;
+	do {
+		old = OPA_load_ptr ((OPA_ptr_t *) sizeptr);
+		new = (void *) ((uintptr_t) old + delta);
+	} while (OPA_cas_ptr ((OPA_ptr_t *) sizeptr, old, new) != old);
+	return (size_t) (uintptr_t) new;
+}
+# define size_load(sizeptr)      ( (size_t) (uintptr_t) \
+                                 OPA_load_ptr  ((OPA_ptr_t *) sizeptr) )
+
 #else /* CONFIG_SINGLE_THREADED */
 
 
@@ -107,39 +137,246 @@ static void *_tmp;
 # define get_ptr(ptrptr)         (*ptrptr)
 # define nil_ptr(ptrptr)         (NULL == get_ptr (ptrptr))
 
+# define int_incr(intptr)        (++*(intptr))
+# define int_decr(intptr)        (--*(intptr))
+# define int_load(intptr)        (*(intptr))
+# define int_cas(intptr,old,new) ((*(intptr) == (old)) \
+                                 ? (*(intptr) = (new), (old)) \
+                                 : (*(intptr)))
+
+# define size_add(sizeptr,delta) (*(sizeptr) += (delta))
+# define size_load(sizeptr)      (*(sizeptr))
+
 #endif /* CONFIG_SINGLE_THREADED */
 
 
-/* Initialise the signaling routine that hints that lillyput_event() may work.
+/* The number of rounds that lillyput_await() spins and yields before it
+ * parks a thread.
+ */
+#ifndef LILLYPUT_SPINS
+#define LILLYPUT_SPINS 128
+#endif
+#ifndef LILLYPUT_YIELDS
+#define LILLYPUT_YIELDS 16
+#endif
+
+
+/* The largest number of iovec entries for LILLYCNX_PUT_GATHER, by default
+ * the system maximum for writev().
  */
-typedef void (*lillyput_signal_callback) (int fd);
-static lillyput_signal_callback *lillyput_signal_loop;
-void lillyput_init (lillyput_signal_callback *sigcb) {
-	lillyput_signal_loop = sigcb;
+#ifndef LILLYPUT_IOVMAX
+#  if defined (IOV_MAX)
+#    define LILLYPUT_IOVMAX IOV_MAX
+#  elif defined (UIO_MAXIOV)
+#    define LILLYPUT_IOVMAX UIO_MAXIOV
+#  else
+#    define LILLYPUT_IOVMAX 1024
+#  endif
+#endif
+
+
+#ifndef CONFIG_SINGLE_THREADED
+
+/* Relax the processor while spinning on a value */
+# if defined (__i386__) || defined (__x86_64__)
+#  define spin_pause()           __asm__ __volatile__ ("pause" ::: "memory")
+# else
+#  define spin_pause()           OPA_compiler_barrier ()
+# endif
+
+
+/* Park the calling thread until *word no longer holds the value seen,
+ * or wake up the threads parked on it.  Without futexes, parking is
+ * not possible and we keep yielding the processor.
+ */
+#ifdef __linux__
+static void futex_park (int *word, int seen) {
+	syscall (SYS_futex, word, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+}
+static void futex_wakeall (int *word) {
+	syscall (SYS_futex, word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+#else
+static void futex_park (int *word, int seen) {
+	sched_yield ();
 }
+static void futex_wakeall (int *word) {
+	;
+}
+#endif
 
 
-/* Append a addend:LillySend structure to the lil->head,lil->tail:LillySend**
+/* Wait for another thread to make *ptrptr NULL, when want_nil is set, or
+ * non-NULL otherwise, and return the value found.  Waiting starts with
+ * spinning, continues with yielding and finally parks the thread until
+ * lillyput_wakeup() is called for the connection.
+ *
+ * To avoid missed wakeups, a parking thread first announces itself in
+ * put_parked and samples put_wakeseq, and only then tests the value once
+ * more.  The thread that changes the value does so before it looks at
+ * put_parked, with a barrier in between; so either the parking thread
+ * sees the new value, or the waking thread sees the parked one and then
+ * changes put_wakeseq, so the futex will not sleep on its old value.
  */
-void lillyput_enqueue (LDAP *lil, LillySend *addend) {
-	addend->put_qnext = NULL;
-	// Let's swap addend->put_qnext for qtail
-	LillySend **qtail = xcg_ptr (&lil->put_qtail, &addend->put_qnext);
+static LillySend *lillyput_await (LDAP *lil, LillySend **ptrptr, bool want_nil) {
+	LillySend *val;
+	int round = 0;
+	while (((val = get_ptr (ptrptr)) == NULL) != want_nil) {
+		if (round < LILLYPUT_SPINS) {
+			spin_pause ();
+		} else if (round < LILLYPUT_SPINS + LILLYPUT_YIELDS) {
+			sched_yield ();
+		} else {
+			int_incr (&lil->put_parked);
+			int seen = int_load (&lil->put_wakeseq);
+			if (((get_ptr (ptrptr)) == NULL) != want_nil) {
+				futex_park (&lil->put_wakeseq, seen);
+			}
+			int_decr (&lil->put_parked);
+		}
+		round++;
+	}
+	//
+	// Count the way in which contention was resolved, if any
+	if (round == 0) {
+		;
+	} else if (round <= LILLYPUT_SPINS) {
+		int_incr (&lil->put_contention.spun);
+	} else if (round <= LILLYPUT_SPINS + LILLYPUT_YIELDS) {
+		int_incr (&lil->put_contention.yielded);
+	} else {
+		int_incr (&lil->put_contention.parked);
+	}
+	return val;
+}
+
+
+/* Wake up the threads that lillyput_await() parked for this connection,
+ * after a value that they may be waiting for was set.
+ */
+static void lillyput_wakeup (LDAP *lil) {
+	OPA_read_write_barrier ();
+	if (int_load (&lil->put_parked) > 0) {
+		int_incr (&lil->put_wakeseq);
+		futex_wakeall (&lil->put_wakeseq);
+	}
+}
+
+#else /* CONFIG_SINGLE_THREADED */
+
+/* With only one thread, nobody else could change what we wait for */
+# define lillyput_wakeup(lil)
+
+static LillySend *lillyput_await (LDAP *lil, LillySend **ptrptr, bool want_nil) {
+	return get_ptr (ptrptr);
+}
+
+#endif /* CONFIG_SINGLE_THREADED */
+
+
+/* Retrieve the counts of contended waits in the queue of a connection.
+ */
+void lillyput_contention (LDAP *lil, struct LillyPutContention *counts) {
+	counts->spun    = int_load (&lil->put_contention.spun   );
+	counts->yielded = int_load (&lil->put_contention.yielded);
+	counts->parked  = int_load (&lil->put_contention.parked );
+}
+
+
+/* Account for bytes entering (delta > 0) or leaving (delta < 0) the queue,
+ * and apply backpressure through the watermarks.  Accounting is only done
+ * when put_highwater is set, which should be done before the connection
+ * is first used.
+ *
+ * The put_throttled flag toggles with a compare-and-swap, so each crossing
+ * of a watermark leads to one callback, even when producers and consumer
+ * race.  A producer that raises the flag while the consumer has already
+ * drained the queue below the low watermark would leave it raised, so it
+ * checks once more after raising it.
+ */
+static void lillyput_account (LDAP *lil, ssize_t delta) {
+	if (lil->put_highwater == 0) {
+		return;
+	}
+	size_t qbytes = size_add (&lil->put_qbytes, delta);
+	if (qbytes >= lil->put_highwater) {
+		if (int_cas (&lil->put_throttled, 0, 1) != 0) {
+			return;
+		}
+		if (lil->def->lillyput_highwater != NULL) {
+			lil->def->lillyput_highwater (lil);
+		}
+		qbytes = size_load (&lil->put_qbytes);
+	}
+	if (qbytes <= lil->put_lowwater) {
+		if (int_cas (&lil->put_throttled, 1, 0) != 1) {
+			return;
+		}
+		if (lil->def->lillyput_lowwater != NULL) {
+			lil->def->lillyput_lowwater (lil);
+		}
+	}
+}
+
+
+/* Test if a producer may add to the queue without exceeding the high
+ * watermark.  After it was exceeded, this returns false until the queue
+ * has drained to the low watermark.
+ */
+bool lillyput_canqueue (LDAP *lil) {
+	return (int_load (&lil->put_throttled) == 0);
+}
+
+
+/* Append a chain of LillySend structures to the lil->head,lil->tail queue.
+ * The chain runs from first to last over their put_qnext pointers, and is
+ * appended as a whole, with a single swap of the tail.  The put_qnext of
+ * last is set to NULL here.
+ *
+ * The lillyput_signal() callback hints the event loop that lillyput_event()
+ * has work to do.  This is only needed when the queue was empty; otherwise
+ * the consumer is still busy and will find the new items.  We know that
+ * the queue was empty when the tail we swapped out points to put_qhead.
+ * A connection that is only used for its queue may lack a LillyStructural.
+ */
+void lillyput_enqueue_chain (LDAP *lil, LillySend *first, LillySend *last) {
+	last->put_qnext = NULL;
+	// Count the bytes, before the consumer can start on them
+	size_t qbytes = 0;
+	if (lil->put_highwater > 0) {
+		LillySend *item = first;
+		while (item != NULL) {
+			dercursor *crs;
+			for (crs = item->cursori; crs->derptr != NULL; crs++) {
+				qbytes += crs->derlen;
+			}
+			item = item->put_qnext;
+		}
+		lillyput_account (lil, qbytes);
+	}
+	// Let's swap last->put_qnext for qtail
+	LillySend **qtail = xcg_ptr (&lil->put_qtail, &last->put_qnext);
 	if (qtail == NULL) {
 		// Alias as a result of initialisation, set to actual value
 		qtail = &lil->put_qhead;
 	}
-	while (!nil_ptr (qtail)) {
-		//TODO// Under cooperative concurrency, yield() at some point
-		;
-	}
-	set_ptr (qtail, addend);
-	if (lillyput_signal_loop != NULL) {
-		(*lillyput_signal_loop) (lil->put_fd);
+	lillyput_await (lil, qtail, true);
+	set_ptr (qtail, first);
+	lillyput_wakeup (lil);
+	if ((qtail == &lil->put_qhead) && (lil->def != NULL) &&
+			(lil->def->lillyput_signal != NULL)) {
+		lil->def->lillyput_signal (lil);
 	}
 }
 
 
+/* Append a addend:LillySend structure to the lil->head,lil->tail:LillySend**
+ */
+void lillyput_enqueue (LDAP *lil, LillySend *addend) {
+	lillyput_enqueue_chain (lil, addend, addend);
+}
+
+
 /* Test if there is anything in the queue for LillyPut
  */
 bool lillyput_cansend (LDAP *lil) {
@@ -147,12 +384,93 @@ bool lillyput_cansend (LDAP *lil) {
 }
 
 
+/* Take an item that has been sent completely off the head of the queue,
+ * and end its qpool.  Only the consumer of the queue, which is the one
+ * running lillyput_event(), may do this.  Returns the item that is now
+ * at the head of the queue, or NULL if it is empty.
+ */
+static LillySend *lillyput_dequeue (LDAP *lil, LillySend *todo) {
+	//
+	// Now we clean up the qpool, after untangling it.
+	//
+	// First, sample our qnext pointer
+	LillySend *qnext = get_ptr (&todo->put_qnext);
+	if (qnext != NULL) {
+		//
+		// We can simply overwrite qhead with qnext
+		;
+	} else {
+		//
+		// Offer to take over the &NULL pointer
+		LillySend **qtail = cas_ptr (
+					&lil->put_qtail,
+					&todo->put_qnext,
+					&lil->put_qhead);
+		if (qtail != &todo->put_qnext) {
+			//
+			// Someone wants to overwrite qnext
+			qnext = lillyput_await (lil, &todo->put_qnext, false);
+		} else {
+			//
+			// Someone will be waiting for qhead
+			// to be set to NULL by us
+			// Already done: qnext = NULL;
+			;
+		}
+	}
+	//
+	// Now setup qhead with the next item to read
+	set_ptr (&lil->put_qhead, qnext);
+	if (qnext == NULL) {
+		lillyput_wakeup (lil);
+	}
+	//
+	// We are free -- nobody references todo anymore
+	//
+	// If a memory pool is to be cleared, clear it
+	if (todo->put_qpool != NULL) {
+		//TODO// Why not make more routines idempotent?
+		//TODO// lillymem_endpool(NULL) saves call-test
+		lillymem_endpool (todo->put_qpool);
+		// Now assume that todo is unreachable
+	}
+	return qnext;
+}
+
+
+/* The gathering variety of lillyput_event(), used under LILLYCNX_PUT_GATHER.
+ * This collects the bytes to send from the current and following queue
+ * items into an iovec, and sends them with one writev().  What has been
+ * written completely is taken off the queue in one go; a partial write
+ * continues in the middle of a dercursor on the next call.
+ */
+static int lillyput_event_gather (LDAP *lil) {
+	struct iovec iov [LILLYPUT_IOVMAX];
+	int iovcnt = lillyput_iovec (lil, iov, LILLYPUT_IOVMAX);
+	if (iovcnt == 0) {
+		//
+		// Drop items without bytes left, and wait for wakeup hints
+		lillyput_sent (lil, 0);
+		errno = EAGAIN;
+		return -1;
+	}
+	ssize_t sent = writev (lil->put_fd, iov, iovcnt);
+	if (sent > 0) {
+		lillyput_sent (lil, sent);
+	}
+	return sent;
+}
+
+
 /* The callback function for lillyput_event() takes elements off the queue,
  * which is why it is implemented as part of queue.c.  Its API returns -1
  * on error with errno set; where errno is EAGAIN to indicate that it has
  * nothing to send left.
  */
 int lillyput_event (LDAP *lil) {
+	if (lil->flags & LILLYCNX_PUT_GATHER) {
+		return lillyput_event_gather (lil);
+	}
 	//
 	// First test if the head actually points to an element
 	struct LillySend *todo;
@@ -170,52 +488,8 @@ restart:
 	while (crs->derlen == 0) {
 		if (crs->derptr == NULL) {
 			//
-			// Now we clean up the qpool, after untangling it.
-			//
-			// First, sample our qnext pointer
-			LillySend *qnext = get_ptr (&todo->put_qnext);
-			if (qnext != NULL) {
-				//
-				// We can simply overwrite qhead with qnext
-				;
-			} else {
-				//
-				// Offer to take over the &NULL pointer
-				LillySend **qtail = cas_ptr (
-							&lil->put_qtail,
-							&todo->put_qnext,
-							&lil->put_qhead);
-				if (qtail != &todo->put_qnext) {
-					//
-					// Someone wants to overwrite qnext
-					do {
-						qnext = get_ptr (
-							&todo->put_qnext);
-						//TODO// Cooperative multitask
-					} while (qnext == NULL);
-				} else {
-					//
-					// Someone will be waiting for qhead
-					// to be set to NULL by us
-					// Already done: qnext = NULL;
-					;
-				}
-			}
-			//
-			// Now setup qhead with the next item to read
-			set_ptr (&lil->put_qhead, qnext);
-			//
-			// We are free -- nobody references todo anymore
-			//
-			// If a memory pool is to be cleared, clear it
-			if (todo->put_qpool != NULL) {
-				//TODO// Why not make more routines idempotent?
-				//TODO// lillymem_endpool(NULL) saves call-test
-				lillymem_endpool (todo->put_qpool);
-				// Now assume that todo is unreachable
-			}
-			//
-			// Now sample for a new non-NULL value in lil->put_queue
+			// Take the item off the queue, and sample a new head
+			lillyput_dequeue (lil, todo);
 			goto restart;
 		}
 		crs++;
@@ -229,6 +503,7 @@ restart:
 	if (sent > 0) {
 		crs->derlen -= sent;
 		crs->derptr += sent;
+		lillyput_account (lil, -sent);
 	}
 	//
 	// Return the outcome of the send operation
@@ -236,6 +511,68 @@ restart:
 }
 
 
+/* Collect the bytes that are ready to be sent into at most iovcnt entries
+ * of iov, starting at the head of the queue and continuing into the items
+ * that follow it.  The queue itself is not changed; report the number of
+ * bytes actually sent with lillyput_sent().  Returns the number of entries
+ * filled, which is 0 when there is nothing to send.  Like lillyput_event(),
+ * this may only be called by the consumer of the queue.
+ */
+int lillyput_iovec (LDAP *lil, struct iovec *iov, int iovcnt) {
+	int iovi = 0;
+	LillySend *todo = get_ptr (&lil->put_qhead);
+	while (todo != NULL) {
+		dercursor *crs;
+		for (crs = todo->cursori; crs->derptr != NULL; crs++) {
+			if (crs->derlen == 0) {
+				continue;
+			}
+			if (iovi >= iovcnt) {
+				return iovi;
+			}
+			iov [iovi].iov_base = crs->derptr;
+			iov [iovi].iov_len  = crs->derlen;
+			iovi++;
+		}
+		//
+		// A NULL qnext may be on its way to being set; we stop here
+		todo = get_ptr (&todo->put_qnext);
+	}
+	return iovi;
+}
+
+
+/* Process the number of bytes sent from what lillyput_iovec() collected.
+ * The dercursors in the queue advance over what was sent, and all items
+ * that are now sent completely are taken off the queue, ending their
+ * qpools in bulk.  Like lillyput_event(), this may only be called by the
+ * consumer of the queue.
+ */
+void lillyput_sent (LDAP *lil, size_t sent) {
+	if (sent > 0) {
+		lillyput_account (lil, - (ssize_t) sent);
+	}
+	LillySend *todo = get_ptr (&lil->put_qhead);
+	while (todo != NULL) {
+		dercursor *crs = todo->cursori;
+		while ((crs->derptr != NULL) && (crs->derlen <= sent)) {
+			sent -= crs->derlen;
+			crs->derptr += crs->derlen;
+			crs->derlen = 0;
+			crs++;
+		}
+		if (crs->derptr != NULL) {
+			//
+			// Partially sent, so continue here next time
+			crs->derptr += sent;
+			crs->derlen -= sent;
+			return;
+		}
+		todo = lillyput_dequeue (lil, todo);
+	}
+}
+
+
 /* Enqueue a message in a single dercursor.  Normally, we supply a series of
  * dermessages, so this is just there to mirror properly; it may actually be
  * useful as a value for a lillyget_dercursor() pointer.
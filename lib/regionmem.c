@@ -0,0 +1,780 @@
+/* regionmem.c -- A region allocator for LillyDAP memory pools.
+ *
+ * A pool is a list of chunks, and memory is allocated by bumping a pointer
+ * through the current chunk.  The pool administration lives at the start
+ * of its first chunk, so creating a pool takes a single chunk and nothing
+ * else.  When the current chunk is full, a new one is added that is twice
+ * as large, up to REGIONMEM_MAXCHUNK; allocations that are too large for
+ * that get a chunk of their own, without becoming the current chunk.
+ *
+ * Ending a pool runs its cleanup routines and then retires its chunks to
+ * a freelist for their size.  New chunks are taken from those freelists
+ * when possible, so pools can come and go without calling the system.
+ * Chunks that come from the system are clear, because we get them with
+ * calloc(); we remember how much of the current chunk is still clear, so
+ * regionmem_alloc0() need not clear it once more.  Chunks taken from the
+ * freelists are not clear.
+ *
+ * The freelists are shared between threads and guarded by a spinlock per
+ * chunk size.  Pools themselves are not locked; like with any LillyPool,
+ * only one thread should allocate from a pool at a time.
+ *
+ * Most pools live for just one LDAPMessage, so creating and ending them
+ * should be cheap.  Ending a pool therefore resets it to its first chunk
+ * and pushes it onto a cache for the current thread, from where the next
+ * regionmem_newpool() pops it.  Only the other chunks go to the freelists.
+ * The cache holds at most REGIONMEM_CACHEBYTES; beyond that, pools are
+ * retired completely.
+ *
+ * Pools are often ended by another thread than the one that created them,
+ * for instance when a worker hands a qpool to the writer thread.  Such a
+ * pool is returned to the cache of the thread that created it, its owner,
+ * so that cache does not dry up while that of the ending thread overflows.
+ * The ending thread collects pools for the same owner in a small batch,
+ * and pushes the batch onto a lock-free stack in the owner's cache.  Many
+ * threads may push, but only the owner pops, and it takes the whole stack
+ * at once, when its own cache is empty.  The cache of a thread that exits
+ * is kept as an orphan, and adopted by the next new thread, because pools
+ * may still be on their way back to it.
+ *
+ * On Linux, regionmem_arenas() can have chunks carved from arenas of
+ * REGIONMEM_ARENASIZE, mapped to be backed by huge pages, so that many
+ * pools share few TLB entries.  Arenas are never returned to the system,
+ * and their chunks are always retained in the freelists.  With NUMA nodes,
+ * every node has its own arenas and freelists, and a thread takes chunks
+ * for the node it ran on when it first needed one.  Since pages are placed
+ * on the node that first touches them, this keeps memory local to event
+ * threads that are bound to a node.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#ifdef __linux__
+#   include <unistd.h>
+#   include <sys/mman.h>
+#   include <sys/syscall.h>
+#endif
+
+#include <lillydap/mem.h>
+#include <lillydap/regionmem.h>
+
+#ifndef CONFIG_SINGLE_THREADED
+#   include <pthread.h>
+#   include <sched.h>
+#   include "opa_primitives.h"
+#endif
+
+
+/* The freelists are locked with a simple spinlock, which only guards a
+ * push or pop of a single chunk.  Under ThreadSanitizer, the compiler's
+ * atomics replace OpenPA, so it can see how the threads synchronise.
+ */
+#if !defined (CONFIG_SINGLE_THREADED) && defined (__SANITIZE_THREAD__)
+# define lock_take(lockptr)      while (__atomic_exchange_n (lockptr, 1, __ATOMIC_ACQUIRE) != 0) { \
+                                         sched_yield (); \
+                                 }
+# define lock_free(lockptr)      __atomic_store_n (lockptr, 0, __ATOMIC_RELEASE)
+# define int_add(intptr,delta)   __atomic_add_fetch (intptr, delta, __ATOMIC_SEQ_CST)
+# define int_load(intptr)        __atomic_load_n (intptr, __ATOMIC_SEQ_CST)
+# define int_incr(intptr)        __atomic_add_fetch (intptr, 1, __ATOMIC_SEQ_CST)
+# define cas_ptr(ptrptr,old,new) ({ __typeof__ (*(ptrptr)) _old = (old); \
+                                    __atomic_compare_exchange_n (ptrptr, &_old, new, 0, \
+                                         __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+                                    _old; })
+# define xcg_ptr(ptrptr,new)     __atomic_exchange_n (ptrptr, new, __ATOMIC_SEQ_CST)
+# define get_ptr(ptrptr)         __atomic_load_n (ptrptr, __ATOMIC_SEQ_CST)
+# define set_ptr(ptrptr,new)     __atomic_store_n (ptrptr, new, __ATOMIC_SEQ_CST)
+# define THREADLOCAL             __thread
+#elif !defined (CONFIG_SINGLE_THREADED)
+# define lock_take(lockptr)      while (OPA_cas_int ((OPA_int_t *) lockptr, 0, 1) != 0) { \
+                                         OPA_busy_wait (); \
+                                 }
+# define lock_free(lockptr)      OPA_store_int ((OPA_int_t *) lockptr, 0)
+# define int_add(intptr,delta)   OPA_add_int   ((OPA_int_t *) intptr, delta)
+# define int_load(intptr)        OPA_load_int  ((OPA_int_t *) intptr)
+# define int_incr(intptr)        OPA_incr_int  ((OPA_int_t *) intptr)
+# define cas_ptr(ptrptr,old,new) OPA_cas_ptr   ((OPA_ptr_t *) ptrptr, old, new)
+# define xcg_ptr(ptrptr,new)     OPA_swap_ptr  ((OPA_ptr_t *) ptrptr, new)
+# define get_ptr(ptrptr)         OPA_load_ptr  ((OPA_ptr_t *) ptrptr)
+# define set_ptr(ptrptr,new)     OPA_store_ptr ((OPA_ptr_t *) ptrptr, new)
+# define THREADLOCAL             __thread
+#else
+# define lock_take(lockptr)
+# define lock_free(lockptr)
+# define int_add(intptr,delta)   (*(intptr) += (delta))
+# define int_load(intptr)        (*(intptr))
+# define int_incr(intptr)        ((*(intptr))++)
+# define get_ptr(ptrptr)         (*(ptrptr))
+# define set_ptr(ptrptr,new)     (*(ptrptr) = (new))
+# define THREADLOCAL
+#endif
+
+
+/* Round up to a multiple of a power of two.
+ */
+#define roundup(sz,align) (((sz) + (align) - 1) & ~ ((size_t) (align) - 1))
+
+
+/* The number of chunk sizes, from REGIONMEM_MINCHUNK to REGIONMEM_MAXCHUNK
+ * in powers of two.
+ */
+#define REGIONMEM_CLASSES (__builtin_ctzl (REGIONMEM_MAXCHUNK / REGIONMEM_MINCHUNK) + 1)
+
+
+struct regionmem_chunk {
+	struct regionmem_chunk *next;
+	size_t size;
+	int node;
+	bool arena;
+};
+
+#define CHUNKHEAD roundup (sizeof (struct regionmem_chunk), REGIONMEM_ALIGN)
+
+
+struct regionmem_atend {
+	struct regionmem_atend *next;
+	void (*cleanup) (void *cbdata);
+	void *cbdata;
+};
+
+
+/* The pool starts with a LillyPoolHead, so lillymem_alloc() can bump the
+ * alloc_ptr by itself, and only calls regionmem_alloc() for a new chunk.
+ * That does not change clean_ptr, which is fine, because memory beyond
+ * alloc_ptr is untouched anyway.
+ */
+struct regionmem_pool {
+	struct LillyPoolHead head;
+	uint8_t *clean_ptr;
+	struct regionmem_chunk *chunks;
+	size_t nextsize;
+	struct regionmem_atend *atend;
+	struct regionmem_cache *owner;
+	struct regionmem_pool *cachenext;
+};
+
+#define POOLHEAD roundup (sizeof (struct regionmem_pool), REGIONMEM_ALIGN)
+
+#define POOLCHUNK(rp) ((struct regionmem_chunk *) (((uint8_t *) (rp)) - CHUNKHEAD))
+
+
+/* The freelists of retired chunks, one per node and size class.  The
+ * retained bytes are counted in kilobytes, so they fit an int.
+ */
+static struct regionmem_freelist {
+	int lock;
+	struct regionmem_chunk *head;
+} freelist [REGIONMEM_NODES] [REGIONMEM_CLASSES];
+
+static int retained_kb = 0;
+
+
+/* The cache of pools that were created by a thread, ready for reuse.
+ * Only the owning thread uses pools and bytes.  Other threads push onto
+ * remote, after adding to remote_kb to stay within REGIONMEM_CACHEBYTES.
+ */
+struct regionmem_cache {
+	struct regionmem_pool *pools;
+	size_t bytes;
+#ifndef CONFIG_SINGLE_THREADED
+	struct regionmem_pool *remote;
+	int remote_kb;
+	struct regionmem_cache *orphannext;
+#endif
+};
+
+#ifdef CONFIG_SINGLE_THREADED
+static struct regionmem_cache poolcache;
+# define regionmem_mycache() (&poolcache)
+#else
+static THREADLOCAL struct regionmem_cache *mycache = NULL;
+
+
+/* The batch of pools that this thread has ended for another owner, and
+ * not yet pushed to it.
+ */
+static THREADLOCAL struct regionmem_batch {
+	struct regionmem_cache *owner;
+	struct regionmem_pool *first;
+	struct regionmem_pool *last;
+	int count;
+} remotebatch;
+
+
+/* The caches of threads that have exited, waiting to be adopted.
+ */
+static int orphans_lock = 0;
+static struct regionmem_cache *orphans = NULL;
+
+static pthread_key_t cachekey;
+static pthread_once_t cachekey_once = PTHREAD_ONCE_INIT;
+#endif
+
+
+/* The number of chunks taken from and returned to the system.
+ */
+static int sysallocs = 0;
+static int sysfrees = 0;
+
+
+/* The arenas that chunks are carved from, one current arena per node.
+ * Without REGIONMEM_ARENAS, chunks come from calloc() instead.
+ */
+#if REGIONMEM_MAXCHUNK > REGIONMEM_ARENASIZE
+#error "REGIONMEM_MAXCHUNK must not exceed REGIONMEM_ARENASIZE"
+#endif
+
+static unsigned arena_flags = 0;
+
+static struct regionmem_arena {
+	int lock;
+	uint8_t *ptr;
+	uint8_t *end;
+} arena [REGIONMEM_NODES];
+
+
+/* The NUMA node of this thread, or -1 when not yet known.
+ */
+static THREADLOCAL int mynode = -1;
+
+
+/* Find the size class for a chunk size, or -1 if it has none.
+ */
+static int regionmem_class (size_t size) {
+	if ((size < REGIONMEM_MINCHUNK) || (size > REGIONMEM_MAXCHUNK) ||
+			((size & (size - 1)) != 0)) {
+		return -1;
+	}
+	return __builtin_ctzl (size / REGIONMEM_MINCHUNK);
+}
+
+
+/* Find the NUMA node that this thread runs on.  It is looked up once, so
+ * event threads should be bound to a node before they allocate.
+ */
+static int regionmem_node (void) {
+	if (mynode < 0) {
+		mynode = 0;
+#ifdef __linux__
+		unsigned cpu, node;
+		if ((arena_flags & REGIONMEM_NUMANODES) &&
+				(syscall (SYS_getcpu, &cpu, &node, NULL) == 0)) {
+			mynode = node % REGIONMEM_NODES;
+		}
+#endif
+	}
+	return mynode;
+}
+
+
+/* Map a new arena, aligned to its size so huge pages can back it.  Either
+ * ask for explicit huge pages, or map twice the size and trim it to the
+ * alignment, and advise the kernel to use transparent huge pages.
+ */
+#ifdef __linux__
+static uint8_t *regionmem_maparena (void) {
+	uint8_t *mem;
+	if (arena_flags & REGIONMEM_HUGETLB) {
+		mem = mmap (NULL, REGIONMEM_ARENASIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mem != MAP_FAILED) {
+			return mem;
+		}
+	}
+	mem = mmap (NULL, 2 * REGIONMEM_ARENASIZE, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+	uint8_t *aligned = (uint8_t *) roundup ((uintptr_t) mem, REGIONMEM_ARENASIZE);
+	if (aligned > mem) {
+		munmap (mem, aligned - mem);
+	}
+	munmap (aligned + REGIONMEM_ARENASIZE, mem + REGIONMEM_ARENASIZE - aligned);
+#ifdef MADV_HUGEPAGE
+	if (arena_flags & REGIONMEM_HUGEPAGES) {
+		madvise (aligned, REGIONMEM_ARENASIZE, MADV_HUGEPAGE);
+	}
+#endif
+	return aligned;
+}
+#endif
+
+
+/* Retire a chunk to its freelist, or return it to the system.  Chunks
+ * from an arena are always retired.
+ */
+static void regionmem_putchunk (struct regionmem_chunk *chk) {
+	int cls = regionmem_class (chk->size);
+	if ((cls < 0) || ((!chk->arena) &&
+			(int_load (&retained_kb) + chk->size / 1024 >
+				REGIONMEM_KEEPBYTES / 1024))) {
+		int_incr (&sysfrees);
+		free (chk);
+		return;
+	}
+	int_add (&retained_kb, (int) (chk->size / 1024));
+	struct regionmem_freelist *fl = &freelist [chk->node] [cls];
+	lock_take (&fl->lock);
+	chk->next = fl->head;
+	set_ptr (&fl->head, chk);
+	lock_free (&fl->lock);
+}
+
+
+/* Carve a chunk from the current arena of a node.  What remains of a full
+ * arena is retired in chunks before a new arena is mapped.  Arena memory
+ * has not been touched before, so it is clean.
+ */
+static struct regionmem_chunk *regionmem_carve (int node, size_t size) {
+#ifdef __linux__
+	struct regionmem_arena *ar = &arena [node];
+	struct regionmem_chunk *chk;
+	lock_take (&ar->lock);
+	while (ar->ptr + size > ar->end) {
+		size_t left = ar->end - ar->ptr;
+		if (left >= REGIONMEM_MINCHUNK) {
+			size_t part = REGIONMEM_MINCHUNK;
+			while ((part << 1) <= left) {
+				part <<= 1;
+			}
+			chk = (struct regionmem_chunk *) (ar->end - part);
+			ar->end -= part;
+			chk->size = part;
+			chk->node = node;
+			chk->arena = true;
+			regionmem_putchunk (chk);
+			continue;
+		}
+		uint8_t *mem = regionmem_maparena ();
+		if (mem == NULL) {
+			lock_free (&ar->lock);
+			return NULL;
+		}
+		int_incr (&sysallocs);
+		ar->ptr = mem;
+		ar->end = mem + REGIONMEM_ARENASIZE;
+	}
+	chk = (struct regionmem_chunk *) ar->ptr;
+	ar->ptr += size;
+	lock_free (&ar->lock);
+	chk->arena = true;
+	return chk;
+#else
+	return NULL;
+#endif
+}
+
+
+/* Get a chunk of the given size, from a freelist or otherwise from the
+ * system.  Set *clean to tell whether it is filled with zeroes.
+ */
+static struct regionmem_chunk *regionmem_getchunk (size_t size, bool *clean) {
+	struct regionmem_chunk *chk = NULL;
+	int node = regionmem_node ();
+	int cls = regionmem_class (size);
+	struct regionmem_freelist *fl = &freelist [node] [(cls >= 0) ? cls : 0];
+	if ((cls >= 0) && (get_ptr (&fl->head) != NULL)) {
+		lock_take (&fl->lock);
+		chk = fl->head;
+		if (chk != NULL) {
+			set_ptr (&fl->head, chk->next);
+		}
+		lock_free (&fl->lock);
+	}
+	if (chk != NULL) {
+		int_add (&retained_kb, - (int) (size / 1024));
+		*clean = false;
+	} else {
+		if ((arena_flags != 0) && (cls >= 0)) {
+			chk = regionmem_carve (node, size);
+		} else {
+			chk = calloc (1, size);
+			if (chk != NULL) {
+				int_incr (&sysallocs);
+				chk->arena = false;
+			}
+		}
+		if (chk == NULL) {
+			return NULL;
+		}
+		chk->size = size;
+		chk->node = node;
+		*clean = true;
+	}
+	chk->next = NULL;
+	return chk;
+}
+
+
+/* Retire all chunks of a pool.
+ */
+static void regionmem_retire (struct regionmem_pool *rp) {
+	struct regionmem_chunk *chk = rp->chunks;
+	while (chk != NULL) {
+		struct regionmem_chunk *next = chk->next;
+		regionmem_putchunk (chk);
+		chk = next;
+	}
+}
+
+
+/* Reset a pool to its first chunk, and retire the others.  Its memory was
+ * used, so none of it is clean anymore.
+ */
+static void regionmem_reset (struct regionmem_pool *rp) {
+	struct regionmem_chunk *first = POOLCHUNK (rp);
+	struct regionmem_chunk *chk = rp->chunks;
+	while (chk != NULL) {
+		struct regionmem_chunk *next = chk->next;
+		if (chk != first) {
+			regionmem_putchunk (chk);
+		}
+		chk = next;
+	}
+	first->next = NULL;
+	rp->head.alloc_ptr = ((uint8_t *) rp) + POOLHEAD;
+	rp->head.alloc_end = ((uint8_t *) first) + REGIONMEM_MINCHUNK;
+	rp->clean_ptr = rp->head.alloc_end;
+	rp->chunks = first;
+	rp->nextsize = 2 * REGIONMEM_MINCHUNK;
+	rp->atend = NULL;
+}
+
+
+#ifndef CONFIG_SINGLE_THREADED
+
+/* When a thread exits, retire the pools in its cache, push out its batch
+ * for another owner, and leave its cache as an orphan.
+ */
+static void regionmem_orphan (void *cacheptr) {
+	struct regionmem_cache *cache = cacheptr;
+	regionmem_flush ();
+	struct regionmem_pool *rp = cache->pools;
+	while (rp != NULL) {
+		struct regionmem_pool *next = rp->cachenext;
+		regionmem_retire (rp);
+		rp = next;
+	}
+	cache->pools = NULL;
+	cache->bytes = 0;
+	mycache = NULL;
+	lock_take (&orphans_lock);
+	cache->orphannext = orphans;
+	orphans = cache;
+	lock_free (&orphans_lock);
+}
+
+
+static void regionmem_cachekey (void) {
+	pthread_key_create (&cachekey, regionmem_orphan);
+}
+
+
+/* Find the cache of the current thread.  A new thread adopts an orphan,
+ * or otherwise allocates a cache.  Returns NULL if that fails, in which
+ * case pools are not cached.
+ */
+static struct regionmem_cache *regionmem_mycache (void) {
+	if (mycache != NULL) {
+		return mycache;
+	}
+	pthread_once (&cachekey_once, regionmem_cachekey);
+	lock_take (&orphans_lock);
+	struct regionmem_cache *cache = orphans;
+	if (cache != NULL) {
+		orphans = cache->orphannext;
+	}
+	lock_free (&orphans_lock);
+	if (cache == NULL) {
+		cache = calloc (1, sizeof (struct regionmem_cache));
+		if (cache == NULL) {
+			return NULL;
+		}
+	}
+	pthread_setspecific (cachekey, cache);
+	mycache = cache;
+	return cache;
+}
+
+
+/* Take all pools that other threads returned to this cache.  This is only
+ * done when the cache is empty, so the total stays within bounds.
+ */
+static struct regionmem_pool *regionmem_drain (struct regionmem_cache *cache) {
+	if (get_ptr (&cache->remote) == NULL) {
+		return NULL;
+	}
+	struct regionmem_pool *pools = xcg_ptr (&cache->remote, NULL);
+	struct regionmem_pool *rp;
+	int kb = 0;
+	for (rp = pools; rp != NULL; rp = rp->cachenext) {
+		kb += REGIONMEM_MINCHUNK / 1024;
+	}
+	int_add (&cache->remote_kb, -kb);
+	cache->pools = pools;
+	cache->bytes = kb * 1024;
+	return pools;
+}
+
+
+/* Return a pool to its owner.  It is added to the batch for that owner,
+ * which is pushed when it is full or when a pool for another owner comes
+ * along.  When the owner has enough pools coming back, the pool is retired.
+ */
+static void regionmem_remote (struct regionmem_pool *rp) {
+	struct regionmem_cache *owner = rp->owner;
+	if ((owner == NULL) || (int_load (&owner->remote_kb) +
+			REGIONMEM_MINCHUNK / 1024 > REGIONMEM_CACHEBYTES / 1024)) {
+		regionmem_retire (rp);
+		return;
+	}
+	int_add (&owner->remote_kb, REGIONMEM_MINCHUNK / 1024);
+	regionmem_reset (rp);
+	if (remotebatch.owner != owner) {
+		regionmem_flush ();
+		remotebatch.owner = owner;
+		remotebatch.last = rp;
+	}
+	rp->cachenext = remotebatch.first;
+	remotebatch.first = rp;
+	if (++remotebatch.count >= REGIONMEM_REMOTEBATCH) {
+		regionmem_flush ();
+	}
+}
+
+#endif /* CONFIG_SINGLE_THREADED */
+
+
+/* Push the batch of pools for another owner.  Many threads may push onto
+ * the same stack, but the only pop takes it all, so there is no ABA.
+ */
+void regionmem_flush (void) {
+#ifndef CONFIG_SINGLE_THREADED
+	if (remotebatch.first == NULL) {
+		return;
+	}
+	struct regionmem_pool **stack = &remotebatch.owner->remote;
+	struct regionmem_pool *head;
+	do {
+		head = get_ptr (stack);
+		remotebatch.last->cachenext = head;
+	} while (cas_ptr (stack, head, remotebatch.first) != head);
+	remotebatch.owner = NULL;
+	remotebatch.first = NULL;
+	remotebatch.last = NULL;
+	remotebatch.count = 0;
+#endif
+}
+
+
+/* Create a new pool.  Take it from the cache when possible, or otherwise
+ * create it in a fresh chunk of the smallest size.
+ */
+LillyPool regionmem_newpool (void) {
+	struct regionmem_cache *cache = regionmem_mycache ();
+	struct regionmem_pool *rp = NULL;
+	if (cache != NULL) {
+		rp = cache->pools;
+#ifndef CONFIG_SINGLE_THREADED
+		if (rp == NULL) {
+			rp = regionmem_drain (cache);
+		}
+#endif
+	}
+	if (rp != NULL) {
+		cache->pools = rp->cachenext;
+		cache->bytes -= REGIONMEM_MINCHUNK;
+		return rp;
+	}
+	bool clean;
+	struct regionmem_chunk *chk = regionmem_getchunk (REGIONMEM_MINCHUNK,
+								&clean);
+	if (chk == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	rp = (void *) (((uint8_t *) chk) + CHUNKHEAD);
+	rp->head.alloc_ptr = ((uint8_t *) rp) + POOLHEAD;
+	rp->head.alloc_end = ((uint8_t *) chk) + REGIONMEM_MINCHUNK;
+	rp->clean_ptr = clean ? rp->head.alloc_ptr : rp->head.alloc_end;
+	rp->chunks = chk;
+	rp->nextsize = 2 * REGIONMEM_MINCHUNK;
+	rp->atend = NULL;
+	rp->owner = cache;
+	return rp;
+}
+
+
+/* End a pool.  Its cleanup routines run in reverse order of registration,
+ * then it is reset and cached, or returned to its owner, or retired.  The
+ * pool itself is in its first chunk, so we must not look at it after
+ * retiring that.
+ */
+void regionmem_endpool (LillyPool cango) {
+	struct regionmem_pool *rp = cango;
+	if (rp == NULL) {
+		return;
+	}
+	struct regionmem_atend *atend = rp->atend;
+	while (atend != NULL) {
+		atend->cleanup (atend->cbdata);
+		atend = atend->next;
+	}
+	struct regionmem_cache *cache = regionmem_mycache ();
+#ifndef CONFIG_SINGLE_THREADED
+	if (rp->owner != cache) {
+		regionmem_remote (rp);
+		return;
+	}
+#endif
+	if ((cache == NULL) ||
+			(cache->bytes + REGIONMEM_MINCHUNK > REGIONMEM_CACHEBYTES)) {
+		regionmem_retire (rp);
+		return;
+	}
+	regionmem_reset (rp);
+	rp->cachenext = cache->pools;
+	cache->pools = rp;
+	cache->bytes += REGIONMEM_MINCHUNK;
+}
+
+
+/* Allocate from a new chunk, because the current one has no room left.
+ * Large allocations get a chunk of their own, which is not made current.
+ */
+static void *regionmem_grow (struct regionmem_pool *rp,
+				size_t szbytes, size_t align, bool zero) {
+	if (szbytes > SIZE_MAX - CHUNKHEAD - REGIONMEM_ALIGN - align) {
+		// No chunk can hold this with its header and alignment
+		errno = ENOMEM;
+		return NULL;
+	}
+	size_t need = CHUNKHEAD + roundup (szbytes, REGIONMEM_ALIGN) +
+			(align > REGIONMEM_ALIGN ? align : 0);
+	size_t size = rp->nextsize;
+	while ((size < need) && (size < REGIONMEM_MAXCHUNK)) {
+		size <<= 1;
+	}
+	bool own = (size < need);
+	if (own) {
+		size = need;
+	}
+	bool clean;
+	struct regionmem_chunk *chk = regionmem_getchunk (size, &clean);
+	if (chk == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	uint8_t *mem = (uint8_t *) roundup (
+			(uintptr_t) (((uint8_t *) chk) + CHUNKHEAD), align);
+	if (zero && !clean) {
+		memset (mem, 0, szbytes);
+	}
+	if (own) {
+		// Keep the current chunk in front, for further allocations
+		chk->next = rp->chunks->next;
+		rp->chunks->next = chk;
+		return mem;
+	}
+	chk->next = rp->chunks;
+	rp->chunks = chk;
+	rp->head.alloc_ptr = mem + roundup (szbytes, REGIONMEM_ALIGN);
+	rp->head.alloc_end = ((uint8_t *) chk) + size;
+	rp->clean_ptr = clean ? rp->head.alloc_ptr : rp->head.alloc_end;
+	rp->nextsize = (size < REGIONMEM_MAXCHUNK) ? (size << 1) : size;
+	return mem;
+}
+
+
+/* Allocate by bumping the pointer in the current chunk, and clear the
+ * memory if so desired and it is not known to be clear.
+ */
+static inline void *regionmem_bump (struct regionmem_pool *rp,
+				size_t szbytes, size_t align, bool zero) {
+	uint8_t *mem = (uint8_t *) roundup ((uintptr_t) rp->head.alloc_ptr, align);
+	size_t need = roundup (szbytes, REGIONMEM_ALIGN);
+	uint8_t *end = mem + need;
+	if ((end > rp->head.alloc_end) || (end < mem) || (need < szbytes)) {
+		return regionmem_grow (rp, szbytes, align, zero);
+	}
+	if (zero && (mem < rp->clean_ptr)) {
+		size_t dirty = rp->clean_ptr - mem;
+		memset (mem, 0, (dirty < szbytes) ? dirty : szbytes);
+	}
+	rp->head.alloc_ptr = end;
+	return mem;
+}
+
+
+void *regionmem_alloc (LillyPool pool, size_t szbytes) {
+	return regionmem_bump (pool, szbytes, REGIONMEM_ALIGN, false);
+}
+
+
+void *regionmem_alloc0 (LillyPool pool, size_t szbytes) {
+	return regionmem_bump (pool, szbytes, REGIONMEM_ALIGN, true);
+}
+
+
+void *regionmem_alloc_aligned (LillyPool pool, size_t szbytes, size_t align) {
+	if ((align & (align - 1)) != 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (align < REGIONMEM_ALIGN) {
+		align = REGIONMEM_ALIGN;
+	}
+	return regionmem_bump (pool, szbytes, align, false);
+}
+
+
+bool regionmem_atend (LillyPool pool, void (*cleanup) (void *), void *cbdata) {
+	struct regionmem_pool *rp = pool;
+	struct regionmem_atend *new;
+	new = regionmem_alloc (pool, sizeof (struct regionmem_atend));
+	if (new == NULL) {
+		return false;
+	}
+	new->cleanup = cleanup;
+	new->cbdata = cbdata;
+	new->next = rp->atend;
+	rp->atend = new;
+	return true;
+}
+
+
+void regionmem_stats (struct regionmem_stats *stats) {
+	stats->sysallocs = int_load (&sysallocs);
+	stats->sysfrees = int_load (&sysfrees);
+	stats->retained_kb = int_load (&retained_kb);
+#ifdef CONFIG_SINGLE_THREADED
+	stats->cached_kb = poolcache.bytes / 1024;
+#else
+	stats->cached_kb = (mycache != NULL) ? (mycache->bytes / 1024) : 0;
+#endif
+}
+
+
+void regionmem_arenas (unsigned flags) {
+#ifdef __linux__
+	arena_flags = flags | REGIONMEM_ARENAS;
+#endif
+}
+
+
+void regionmem_setup (void) {
+	lillymem_newpool_fun = regionmem_newpool;
+	lillymem_endpool_fun = regionmem_endpool;
+	lillymem_alloc_fun   = regionmem_alloc;
+	lillymem_alloc0_fun  = regionmem_alloc0;
+	lillymem_atend_fun   = regionmem_atend;
+	lillymem_poolhead_abi = true;
+}
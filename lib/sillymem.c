@@ -24,17 +24,32 @@
  * silly!) and start with a pointer to the next region, or NULL.  The pool
  * is just a memory holding the first pointer and nothing else.  Again, I
  * told you so.  Now go and use your own allocator, it'll be much better.
+ *
+ * Well, nothing else... the pool also holds a list of cleanup routines
+ * that are registered with sillymem_atend().
  */
 struct sillymem_pre {
 	struct sillymem_pre *next;
 };
 
+struct sillymem_atend {
+	struct sillymem_atend *next;
+	void (*cleanup) (void *cbdata);
+	void *cbdata;
+};
+
+struct sillymem_pool {
+	struct sillymem_pre pre;
+	struct sillymem_atend *atend;
+};
+
 
 LillyPool sillymem_newpool (void) {
-	struct sillymem_pre *pool;
-	pool = malloc (sizeof (struct sillymem_pre));
+	struct sillymem_pool *pool;
+	pool = malloc (sizeof (struct sillymem_pool));
 	if (pool != NULL) {
-		pool->next = NULL;
+		pool->pre.next = NULL;
+		pool->atend = NULL;
 	}
 	return pool;
 }
@@ -42,7 +57,15 @@ LillyPool sillymem_newpool (void) {
 
 void sillymem_endpool (LillyPool cango) {
 	struct sillymem_pre *next, *here;
+	struct sillymem_atend *atend;
 	here = cango;
+	if (cango != NULL) {
+		atend = ((struct sillymem_pool *) cango)->atend;
+		while (atend != NULL) {
+			atend->cleanup (atend->cbdata);
+			atend = atend->next;
+		}
+	}
 	while (cango != NULL) {
 		next = ((struct sillymem_pre *) cango)->next;
 		free (cango);
@@ -61,5 +84,20 @@ void *sillymem_alloc (LillyPool pool, size_t szbytes) {
 }
 
 
+bool sillymem_atend (LillyPool pool, void (*cleanup) (void *), void *cbdata) {
+	struct sillymem_pool *start = pool;
+	struct sillymem_atend *new;
+	new = sillymem_alloc (pool, sizeof (struct sillymem_atend));
+	if (new == NULL) {
+		return false;
+	}
+	new->cleanup = cleanup;
+	new->cbdata = cbdata;
+	new->next = start->atend;
+	start->atend = new;
+	return true;
+}
+
+
 #endif /* USE_SILLYMEM */
 
@@ -0,0 +1,283 @@
+/* timer.c -- Timeouts for outstanding requests, in a hierarchical wheel.
+ *
+ * The wheel has LILLYTIMER_LEVELS levels of 2^LILLYTIMER_BITS slots.  A
+ * timeout goes into the lowest level whose range covers it, in the slot
+ * for its expiry.  When the slot index of a level wraps around, the next
+ * slot of the level above is cascaded into the lower levels.  All this is
+ * a constant amount of work per timeout and per tick.
+ *
+ * Timeouts are never removed when their request is freed.  At expiry, the
+ * MessageID is claimed with lillymsg_id_expire(), and when it is no longer
+ * outstanding, the timeout is simply recycled.  MessageID values are not
+ * reused soon, so a request that was freed is not confused with a newer
+ * one.
+ *
+ * Registration may come from any thread.  It takes a timeout from the
+ * freelist, under a spinlock, and pushes it onto the inbox, which is a
+ * lock-free stack that the event thread takes as a whole.  Only the event
+ * thread touches the wheel itself.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+#include <lillydap/timer.h>
+
+#ifndef CONFIG_SINGLE_THREADED
+#   include "opa_primitives.h"
+#endif
+
+
+#ifndef CONFIG_SINGLE_THREADED
+# define lock_take(lockptr)      while (OPA_cas_int ((OPA_int_t *) lockptr, 0, 1) != 0) { \
+                                         OPA_busy_wait (); \
+                                 }
+# define lock_free(lockptr)      OPA_store_int ((OPA_int_t *) lockptr, 0)
+# define cas_ptr(ptrptr,old,new) OPA_cas_ptr   ((OPA_ptr_t *) ptrptr, old, new)
+# define xcg_ptr(ptrptr,new)     OPA_swap_ptr  ((OPA_ptr_t *) ptrptr, new)
+# define get_ptr(ptrptr)         OPA_load_ptr  ((OPA_ptr_t *) ptrptr)
+#else
+# define lock_take(lockptr)
+# define lock_free(lockptr)
+# define cas_ptr(ptrptr,old,new) ((*(ptrptr) == (old)) ? ((*(ptrptr) = (new)), (old)) : *(ptrptr))
+# define xcg_ptr(ptrptr,new)     lillytimer_xcg ((void **) (ptrptr), new)
+# define get_ptr(ptrptr)         (*(ptrptr))
+static inline void *lillytimer_xcg (void **ptrptr, void *new) {
+	void *old = *ptrptr;
+	*ptrptr = new;
+	return old;
+}
+#endif
+
+
+#define LILLYTIMER_SLOTS (1U << LILLYTIMER_BITS)
+#define LILLYTIMER_MASK  (LILLYTIMER_SLOTS - 1)
+
+
+/* A timeout for a MessageID on a connection.  In the inbox, the expiry is
+ * the number of ticks to wait; in the wheel, it is the tick to expire on.
+ */
+struct LillyTimeout {
+	struct LillyTimeout *next;
+	LDAP *lil;
+	LillyMsgId mid;
+	uint32_t expiry;
+};
+
+
+struct LillyTimers {
+	LillyPool pool;
+	unsigned tickms;
+	uint64_t basems;
+	uint32_t now;
+	struct LillyTimeout *inbox;
+	int freelock;
+	struct LillyTimeout *freelist;
+	struct LillyTimeout *wheel [LILLYTIMER_LEVELS] [LILLYTIMER_SLOTS];
+};
+
+
+/* The monotonic time in milliseconds.
+ */
+static uint64_t lillytimer_ms (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Put a timeout in the wheel, in the lowest level whose range covers it.
+ * Beyond the highest level, it goes around that level once more.
+ */
+static void lillytimer_insert (LillyTimers *tmr, struct LillyTimeout *to) {
+	uint32_t delta = to->expiry - tmr->now;
+	int level = 0;
+	while ((level < LILLYTIMER_LEVELS - 1) &&
+			(delta >= (1U << (LILLYTIMER_BITS * (level + 1))))) {
+		level++;
+	}
+	struct LillyTimeout **slot = &tmr->wheel [level]
+			[(to->expiry >> (LILLYTIMER_BITS * level)) & LILLYTIMER_MASK];
+	to->next = *slot;
+	*slot = to;
+}
+
+
+/* Return a list of timeouts to the freelist.
+ */
+static void lillytimer_recycle (LillyTimers *tmr,
+				struct LillyTimeout *first,
+				struct LillyTimeout *last) {
+	lock_take (&tmr->freelock);
+	last->next = tmr->freelist;
+	tmr->freelist = first;
+	lock_free (&tmr->freelock);
+}
+
+
+/* Move registrations from the inbox into the wheel.
+ */
+static void lillytimer_drain (LillyTimers *tmr) {
+	if (get_ptr (&tmr->inbox) == NULL) {
+		return;
+	}
+	struct LillyTimeout *to = xcg_ptr (&tmr->inbox, NULL);
+	while (to != NULL) {
+		struct LillyTimeout *next = to->next;
+		to->expiry += tmr->now;
+		lillytimer_insert (tmr, to);
+		to = next;
+	}
+}
+
+
+/* Run a single tick.  First cascade the higher levels whose lower slots
+ * have wrapped around, then expire the current slot of the lowest level.
+ */
+static int lillytimer_tick (LillyTimers *tmr) {
+	int expired = 0;
+	uint32_t now = ++tmr->now;
+	int level;
+	for (level = 1; level < LILLYTIMER_LEVELS; level++) {
+		if ((now & ((1U << (LILLYTIMER_BITS * level)) - 1)) != 0) {
+			break;
+		}
+		struct LillyTimeout **slot = &tmr->wheel [level]
+				[(now >> (LILLYTIMER_BITS * level)) & LILLYTIMER_MASK];
+		struct LillyTimeout *to = *slot;
+		*slot = NULL;
+		while (to != NULL) {
+			struct LillyTimeout *next = to->next;
+			lillytimer_insert (tmr, to);
+			to = next;
+		}
+	}
+	struct LillyTimeout **slot = &tmr->wheel [0] [now & LILLYTIMER_MASK];
+	struct LillyTimeout *to = *slot;
+	struct LillyTimeout *done = NULL, *donelast = NULL;
+	*slot = NULL;
+	while (to != NULL) {
+		struct LillyTimeout *next = to->next;
+		if (to->expiry != now) {
+			// Went around the highest level, still waiting
+			lillytimer_insert (tmr, to);
+		} else {
+			if (lillymsg_id_expire (to->lil, to->mid)) {
+				expired++;
+			}
+			to->next = done;
+			done = to;
+			if (donelast == NULL) {
+				donelast = to;
+			}
+		}
+		to = next;
+	}
+	if (done != NULL) {
+		lillytimer_recycle (tmr, done, donelast);
+	}
+	return expired;
+}
+
+
+/* Open a LillyTimers with ticks of the given number of milliseconds.
+ */
+LillyTimers *lillytimer_open (LillyPool pool, unsigned tickms) {
+	if (tickms == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	LillyTimers *tmr = lillymem_alloc0 (pool, sizeof (LillyTimers));
+	if (tmr == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	tmr->pool = pool;
+	tmr->tickms = tickms;
+	tmr->basems = lillytimer_ms ();
+	return tmr;
+}
+
+
+void lillytimer_attach (LillyTimers *tmr, LDAP *lil) {
+	lil->msg_timers = tmr;
+}
+
+
+/* Detach a connection, and recycle all its timeouts.
+ */
+void lillytimer_detach (LillyTimers *tmr, LDAP *lil) {
+	lillytimer_drain (tmr);
+	int level;
+	unsigned slotnr;
+	for (level = 0; level < LILLYTIMER_LEVELS; level++) {
+		for (slotnr = 0; slotnr < LILLYTIMER_SLOTS; slotnr++) {
+			struct LillyTimeout **prev = &tmr->wheel [level] [slotnr];
+			while (*prev != NULL) {
+				struct LillyTimeout *to = *prev;
+				if (to->lil == lil) {
+					*prev = to->next;
+					lillytimer_recycle (tmr, to, to);
+				} else {
+					prev = &to->next;
+				}
+			}
+		}
+	}
+	lil->msg_timers = NULL;
+}
+
+
+/* Register a MessageID to time out.  The timeout comes from the freelist,
+ * or otherwise from the pool, which is guarded by the same lock.
+ */
+int lillytimer_register (LillyTimers *tmr, LDAP *lil, LillyMsgId mid,
+				unsigned ms) {
+	struct LillyTimeout *to;
+	lock_take (&tmr->freelock);
+	to = tmr->freelist;
+	if (to != NULL) {
+		tmr->freelist = to->next;
+	} else {
+		to = lillymem_alloc (tmr->pool, sizeof (struct LillyTimeout));
+	}
+	lock_free (&tmr->freelock);
+	if (to == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+	to->lil = lil;
+	to->mid = mid;
+	to->expiry = (ms + tmr->tickms - 1) / tmr->tickms;
+	if (to->expiry == 0) {
+		to->expiry = 1;
+	}
+	struct LillyTimeout *head;
+	do {
+		head = get_ptr (&tmr->inbox);
+		to->next = head;
+	} while (cas_ptr (&tmr->inbox, head, to) != head);
+	return 0;
+}
+
+
+/* Run the ticks that have passed since the last call.
+ */
+int lillytimer_run (LillyTimers *tmr) {
+	uint32_t target = (uint32_t) ((lillytimer_ms () - tmr->basems) / tmr->tickms);
+	int expired = 0;
+	while (tmr->now != target) {
+		expired += lillytimer_tick (tmr);
+	}
+	// Registrations count from now, so they may be late but never early
+	lillytimer_drain (tmr);
+	return expired;
+}
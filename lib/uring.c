@@ -0,0 +1,342 @@
+/* uring.c -- An io_uring event engine for LillyDAP connections.
+ *
+ * This drives get_fd and put_fd of any number of connections through one
+ * io_uring per event thread.  Receiving is done with a multishot recv()
+ * that picks buffers from a ring of buffers registered with the kernel;
+ * the bytes are handed to lillyget_netbytes() and the buffer returns to
+ * the kernel right away.  Sending takes the bytes from the LillySend
+ * queue with lillyput_iovec() and submits them as a chain of linked
+ * writes; their completion is reported back with lillyput_sent().
+ *
+ * Operations are identified in the user_data of the ring by the address
+ * of the connection, with the kind of operation in its lowest bits.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <errno.h>
+#include <stdint.h>
+
+#include <sys/uio.h>
+
+#include <liburing.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+#include <lillydap/queue.h>
+#include <lillydap/uring.h>
+
+
+/* The buffer group for receive buffers; there is one per ring.
+ */
+#define LILLYRING_BGID 0
+
+#if (LILLYRING_BUFCOUNT & (LILLYRING_BUFCOUNT - 1)) != 0
+#error "LILLYRING_BUFCOUNT must be a power of 2"
+#endif
+
+
+/* The operations encoded in the user_data of the ring.
+ */
+#define RINGOP_RECV   1
+#define RINGOP_WRITE  2
+#define RINGOP_CANCEL 3
+#define RINGOP_MASK   3
+
+#define ring_tag(lil,op) ( ((uint64_t) (uintptr_t) (lil)) | (op) )
+#define ring_lil(tag)    ( (LDAP *) (uintptr_t) ((tag) & ~ (uint64_t) RINGOP_MASK) )
+#define ring_op(tag)     ( (tag) & RINGOP_MASK )
+
+
+/* The receiving states of a connection, in lil->get_ringstate.
+ */
+#define RINGRECV_IDLE     0
+#define RINGRECV_ARMED    1
+#define RINGRECV_STOPPING 2
+
+
+struct LillyRing {
+	struct io_uring uring;
+	struct io_uring_buf_ring *bufring;
+	uint8_t *bufmem;
+	lillyring_done cnxdone;
+};
+
+
+/* Obtain a submission queue entry, flushing the queue when it is full.
+ * Returns NULL with errno set when no entry can be had.
+ */
+static struct io_uring_sqe *lillyring_sqe (LillyRing *ring) {
+	struct io_uring_sqe *sqe = io_uring_get_sqe (&ring->uring);
+	if (sqe == NULL) {
+		io_uring_submit (&ring->uring);
+		sqe = io_uring_get_sqe (&ring->uring);
+		if (sqe == NULL) {
+			errno = EBUSY;
+		}
+	}
+	return sqe;
+}
+
+
+/* Return a receive buffer to the kernel.
+ */
+static void lillyring_recycle (LillyRing *ring, unsigned bid) {
+	io_uring_buf_ring_add (ring->bufring,
+			ring->bufmem + bid * LILLYRING_BUFSIZE,
+			LILLYRING_BUFSIZE,
+			bid,
+			io_uring_buf_ring_mask (LILLYRING_BUFCOUNT),
+			0);
+	io_uring_buf_ring_advance (ring->bufring, 1);
+}
+
+
+/* Arm a multishot receive on the get_fd of a connection.
+ */
+static int lillyring_recv (LillyRing *ring, LDAP *lil) {
+	struct io_uring_sqe *sqe = lillyring_sqe (ring);
+	if (sqe == NULL) {
+		return -1;
+	}
+	io_uring_prep_recv_multishot (sqe, lil->get_fd, NULL, 0, 0);
+	sqe->flags |= IOSQE_BUFFER_SELECT;
+	sqe->buf_group = LILLYRING_BGID;
+	io_uring_sqe_set_data64 (sqe, ring_tag (lil, RINGOP_RECV));
+	lil->get_ringstate = RINGRECV_ARMED;
+	return 0;
+}
+
+
+/* Cancel the multishot receive of a connection, and record why.  Later
+ * receive completions are dropped, up to the final one.
+ */
+static int lillyring_stop (LillyRing *ring, LDAP *lil, int error) {
+	if (lil->get_ringstate != RINGRECV_ARMED) {
+		return 0;
+	}
+	struct io_uring_sqe *sqe = lillyring_sqe (ring);
+	if (sqe == NULL) {
+		return -1;
+	}
+	io_uring_prep_cancel64 (sqe, ring_tag (lil, RINGOP_RECV), 0);
+	io_uring_sqe_set_data64 (sqe, ring_tag (lil, RINGOP_CANCEL));
+	lil->get_ringstate = RINGRECV_STOPPING;
+	lil->get_ringerror = error;
+	return 0;
+}
+
+
+/* Report a connection as done once it neither receives nor writes.
+ */
+static void lillyring_finish (LillyRing *ring, LDAP *lil) {
+	if ((lil->get_ringstate == RINGRECV_IDLE) &&
+			(lil->put_ringwrites == 0)) {
+		ring->cnxdone (lil, lil->get_ringerror);
+	}
+}
+
+
+/* Process the completion of a receive.  The multishot receive stays
+ * armed while the kernel sets IORING_CQE_F_MORE.
+ */
+static void lillyring_recvdone (LillyRing *ring, LDAP *lil,
+				struct io_uring_cqe *cqe) {
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		if ((cqe->res > 0) &&
+				(lil->get_ringstate == RINGRECV_ARMED)) {
+			if (lillyget_netbytes (lil,
+					ring->bufmem + bid * LILLYRING_BUFSIZE,
+					cqe->res) == -1) {
+				lillyring_stop (ring, lil, errno);
+			} else if (lillyput_cansend (lil)) {
+				lillyring_send (ring, lil);
+			}
+		}
+		lillyring_recycle (ring, bid);
+	}
+	if (cqe->flags & IORING_CQE_F_MORE) {
+		return;
+	}
+	//
+	// The multishot receive has ended; rearm it if that is all it takes
+	if (lil->get_ringstate == RINGRECV_ARMED) {
+		if ((cqe->res > 0) || (cqe->res == -ENOBUFS)) {
+			if (lillyring_recv (ring, lil) == 0) {
+				return;
+			}
+			lil->get_ringerror = errno;
+		} else if (cqe->res < 0) {
+			lil->get_ringerror = -cqe->res;
+		} else {
+			lil->get_ringerror = 0;
+		}
+	}
+	lil->get_ringstate = RINGRECV_IDLE;
+	lillyring_finish (ring, lil);
+}
+
+
+/* Process the completion of a linked write.  When the chain is done and
+ * more has been queued in the meantime, a new chain is submitted.
+ */
+static void lillyring_writedone (LillyRing *ring, LDAP *lil,
+				struct io_uring_cqe *cqe) {
+	lil->put_ringwrites--;
+	if (cqe->res > 0) {
+		lillyput_sent (lil, cqe->res);
+	} else if ((cqe->res < 0) && (cqe->res != -ECANCELED)) {
+		lillyring_stop (ring, lil, -cqe->res);
+	}
+	if (lil->put_ringwrites > 0) {
+		return;
+	}
+	if (lil->get_ringstate == RINGRECV_ARMED) {
+		if (lillyput_cansend (lil)) {
+			lillyring_send (ring, lil);
+		}
+	} else {
+		lillyring_finish (ring, lil);
+	}
+}
+
+
+/* Open a LillyRing with the given number of submission queue entries.
+ */
+LillyRing *lillyring_open (LillyPool pool, unsigned entries,
+				lillyring_done cnxdone) {
+	LillyRing *ring = lillymem_alloc (pool, sizeof (LillyRing));
+	uint8_t *bufmem = lillymem_alloc (pool,
+				LILLYRING_BUFCOUNT * LILLYRING_BUFSIZE);
+	if ((ring == NULL) || (bufmem == NULL)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	int err = io_uring_queue_init (entries, &ring->uring, 0);
+	if (err < 0) {
+		errno = -err;
+		return NULL;
+	}
+	ring->bufring = io_uring_setup_buf_ring (&ring->uring,
+				LILLYRING_BUFCOUNT, LILLYRING_BGID, 0, &err);
+	if (ring->bufring == NULL) {
+		io_uring_queue_exit (&ring->uring);
+		errno = -err;
+		return NULL;
+	}
+	ring->bufmem = bufmem;
+	ring->cnxdone = cnxdone;
+	unsigned bid;
+	for (bid = 0; bid < LILLYRING_BUFCOUNT; bid++) {
+		io_uring_buf_ring_add (ring->bufring,
+				bufmem + bid * LILLYRING_BUFSIZE,
+				LILLYRING_BUFSIZE,
+				bid,
+				io_uring_buf_ring_mask (LILLYRING_BUFCOUNT),
+				bid);
+	}
+	io_uring_buf_ring_advance (ring->bufring, LILLYRING_BUFCOUNT);
+	return ring;
+}
+
+
+/* Close a LillyRing.
+ */
+void lillyring_close (LillyRing *ring) {
+	io_uring_free_buf_ring (&ring->uring, ring->bufring,
+				LILLYRING_BUFCOUNT, LILLYRING_BGID);
+	io_uring_queue_exit (&ring->uring);
+}
+
+
+/* Attach a connection to a LillyRing, and start receiving on its get_fd.
+ */
+int lillyring_attach (LillyRing *ring, LDAP *lil) {
+	lil->get_ringerror = 0;
+	lil->put_ringwrites = 0;
+	return lillyring_recv (ring, lil);
+}
+
+
+/* Stop receiving on a connection.
+ */
+int lillyring_detach (LillyRing *ring, LDAP *lil) {
+	return lillyring_stop (ring, lil, ECANCELED);
+}
+
+
+/* Send what is in the queue of a connection as a chain of linked writes.
+ * The chain must be submitted as a whole, so it is never longer than the
+ * room left in the submission queue.
+ */
+int lillyring_send (LillyRing *ring, LDAP *lil) {
+	if (lil->put_ringwrites > 0) {
+		// The completion of the current chain continues with the queue
+		return 0;
+	}
+	unsigned space = io_uring_sq_space_left (&ring->uring);
+	if (space < LILLYRING_MAXWRITES) {
+		io_uring_submit (&ring->uring);
+		space = io_uring_sq_space_left (&ring->uring);
+		if (space == 0) {
+			errno = EBUSY;
+			return -1;
+		}
+	}
+	if (space > LILLYRING_MAXWRITES) {
+		space = LILLYRING_MAXWRITES;
+	}
+	struct iovec iov [LILLYRING_MAXWRITES];
+	int iovcnt = lillyput_iovec (lil, iov, space);
+	int iovi;
+	for (iovi = 0; iovi < iovcnt; iovi++) {
+		struct io_uring_sqe *sqe = io_uring_get_sqe (&ring->uring);
+		io_uring_prep_write (sqe, lil->put_fd,
+				iov [iovi].iov_base, iov [iovi].iov_len,
+				(uint64_t) -1);
+		if (iovi + 1 < iovcnt) {
+			sqe->flags |= IOSQE_IO_LINK;
+		}
+		io_uring_sqe_set_data64 (sqe, ring_tag (lil, RINGOP_WRITE));
+	}
+	lil->put_ringwrites = iovcnt;
+	return 0;
+}
+
+
+/* Submit the work prepared for the ring, and process all completions.
+ */
+int lillyring_run (LillyRing *ring, bool wait) {
+	int rv;
+	if (wait) {
+		rv = io_uring_submit_and_wait (&ring->uring, 1);
+	} else {
+		rv = io_uring_submit (&ring->uring);
+	}
+	if ((rv < 0) && (rv != -EINTR)) {
+		errno = -rv;
+		return -1;
+	}
+	struct io_uring_cqe *cqe;
+	unsigned head;
+	unsigned done = 0;
+	io_uring_for_each_cqe (&ring->uring, head, cqe) {
+		uint64_t tag = io_uring_cqe_get_data64 (cqe);
+		switch (ring_op (tag)) {
+		case RINGOP_RECV:
+			lillyring_recvdone (ring, ring_lil (tag), cqe);
+			break;
+		case RINGOP_WRITE:
+			lillyring_writedone (ring, ring_lil (tag), cqe);
+			break;
+		default:
+			// Completion of a cancel request, nothing to do
+			break;
+		}
+		done++;
+	}
+	io_uring_cq_advance (&ring->uring, done);
+	return done;
+}
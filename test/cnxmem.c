@@ -0,0 +1,138 @@
+/* cnxmem.c -- Check that connection memory does not grow per message.
+ *
+ * A connection lives much longer than its messages, so the memory in its
+ * cnxpool should not grow with the number of messages handled.  This test
+ * passes many SearchRequests over one connection; they are parsed down to
+ * their operation and packed again, then written to /dev/null.  It counts
+ * the bytes allocated from the cnxpool, and fails if any are added after
+ * the first message.
+ *
+ * Usage: cnxmem.test [count] searchrequest.bin
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+#include <lillydap/regionmem.h>
+
+#include <quick-der/api.h>
+
+
+static LillyPool counted_pool = NULL;
+static size_t counted_bytes = 0;
+
+/* Allocate with regionmem, and count what comes from counted_pool.
+ */
+static void *counting_alloc (LillyPool pool, size_t szbytes) {
+	if (pool == counted_pool) {
+		counted_bytes += szbytes;
+	}
+	return regionmem_alloc (pool, szbytes);
+}
+
+
+static void fail (char *progname, char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	char *progname = argv [0];
+	long count = 1000000;
+	if (argc == 3) {
+		count = atol (argv [1]);
+		argv++;
+		argc--;
+	}
+	if ((argc != 2) || (count <= 1)) {
+		fprintf (stderr, "Usage: %s [count] searchrequest.bin\n", progname);
+		exit (1);
+	}
+	//
+	// Use regionmem, but without inline allocation, so we see it all
+	regionmem_setup ();
+	lillymem_alloc_fun = counting_alloc;
+	lillymem_alloc0_fun = NULL;
+	lillymem_poolhead_abi = false;
+	LillyPool lipo = lillymem_newpool ();
+	if (lipo == NULL) {
+		fail (progname, "Failed to allocate a memory pool");
+	}
+	//
+	// Load the SearchRequest
+	uint8_t msg [4096];
+	int fd = open (argv [1], O_RDONLY);
+	if (fd < 0) {
+		fail (progname, "Failed to open the SearchRequest");
+	}
+	ssize_t msglen = read (fd, msg, sizeof (msg));
+	close (fd);
+	if (msglen <= 0) {
+		fail (progname, "Failed to read the SearchRequest");
+	}
+	//
+	// Parse down to the operation, and pass it back for output
+	LDAP *lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	lil->def = &lillydap;
+	lil->def->lillyget_dercursor   = lillyget_dercursor;
+	lil->def->lillyput_dercursor   = lillyput_dercursor;
+	lil->def->lillyget_ldapmessage = lillyget_ldapmessage;
+	lil->def->lillyput_ldapmessage = lillyput_ldapmessage;
+	lil->def->lillyget_opcode      = lillyget_opcode;
+	lil->def->lillyput_opcode      = lillyput_opcode;
+	lil->def->lillyget_operation   =
+	lil->def->lillyput_operation   = lillyput_operation;
+	lil->cnxpool = lillymem_newpool ();
+	if (lil->cnxpool == NULL) {
+		fail (progname, "Failed to allocate connection memory pool");
+	}
+	counted_pool = lil->cnxpool;
+	lil->get_fd = -1;
+	lil->put_fd = open ("/dev/null", O_WRONLY);
+	if (lil->put_fd < 0) {
+		fail (progname, "Failed to open /dev/null");
+	}
+	//
+	// Send the SearchRequests, and note connection memory after the first
+	size_t first_bytes = 0;
+	long i;
+	for (i = 0; i < count; i++) {
+		if (lillyget_netbytes (lil, msg, msglen) == -1) {
+			fail (progname, "Failed to process the SearchRequest");
+		}
+		while (lillyput_event (lil) != -1) {
+			;
+		}
+		if (errno != EAGAIN) {
+			fail (progname, "Failed to write the SearchRequest");
+		}
+		if (i == 0) {
+			first_bytes = counted_bytes;
+		}
+	}
+	printf ("%ld messages, %zu connection bytes after the first, %zu after the last\n",
+			count, first_bytes, counted_bytes);
+	//
+	// Cleanup and exit
+	close (lil->put_fd);
+	lillymem_endpool (lil->cnxpool);
+	lillymem_endpool (lipo);
+	if (counted_bytes != first_bytes) {
+		fail (progname, "Connection memory grows with the number of messages");
+	}
+	exit (0);
+}
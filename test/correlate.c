@@ -0,0 +1,162 @@
+/* correlate.c -- Test the correlation of responses with their requests.
+ *
+ * Many requests are outstanding on one connection, each with a callback
+ * for its responses.  Search results arrive in reverse order of the
+ * requests, each with a SearchResultEntry before its SearchResultDone.
+ * Every callback must see its own responses only, and the final response
+ * must free its MessageID.  A response that arrives after that goes to
+ * lillyget_operation() instead.  MessageIDs beyond 127 need a leading
+ * zero byte on the wire.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+
+
+#define NUM_REQUESTS 300
+
+
+static char *progname;
+
+struct request {
+	LillyMsgId mid;
+	int entries;
+	int done;
+};
+
+static int strays = 0;
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+static int count_response (LDAP *lil, LillyPool qpool,
+				const LillyMsgId msgid, const uint8_t opcode,
+				const dercursor *data, const dercursor controls,
+				void *cbdata) {
+	struct request *req = cbdata;
+	if (msgid != req->mid) {
+		fail ("Response was passed to the wrong callback");
+	}
+	if (req->done > 0) {
+		fail ("Response arrived after the final response");
+	}
+	if (opcode == 4) {
+		req->entries++;
+	} else if (opcode == 5) {
+		req->done++;
+	} else {
+		fail ("Unexpected response opcode");
+	}
+	lillymem_endpool (qpool);
+	return 0;
+}
+
+
+static int count_stray (LDAP *lil, LillyPool qpool,
+				const LillyMsgId msgid, const uint8_t opcode,
+				const dercursor *data, const dercursor controls) {
+	strays++;
+	lillymem_endpool (qpool);
+	return 0;
+}
+
+
+/* Pass an LDAPMessage with the given MessageID and operation.
+ */
+static void respond (LDAP *lil, LillyMsgId mid,
+				const uint8_t *op, size_t oplen) {
+	uint8_t msg [32];
+	uint32_t wiremid = mid & 0x7fffffff;
+	uint8_t midlen = 1;
+	while ((midlen < 4) && (wiremid >= (0x80UL << (8 * (midlen - 1))))) {
+		midlen++;
+	}
+	msg [0] = 0x30;
+	msg [1] = 2 + midlen + oplen;
+	msg [2] = 0x02;
+	msg [3] = midlen;
+	int i;
+	for (i = midlen - 1; i >= 0; i--) {
+		msg [4 + i] = wiremid & 0xff;
+		wiremid >>= 8;
+	}
+	memcpy (msg + 4 + midlen, op, oplen);
+	if (lillyget_netbytes (lil, msg, 4 + midlen + oplen) == -1) {
+		fail ("Failed to process a response");
+	}
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	static const uint8_t entry [] = { 0x64, 0x04, 0x04, 0x00, 0x30, 0x00 };
+	static const uint8_t done [] = { 0x65, 0x07, 0x0a, 0x01, 0x00,
+				0x04, 0x00, 0x04, 0x00 };
+	progname = argv [0];
+	lillymem_newpool_fun = sillymem_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc;
+	LillyPool cnxpool = lillymem_newpool ();
+	LDAP *lil = lillymem_alloc0 (cnxpool, sizeof (LDAP));
+	struct request *reqs = lillymem_alloc0 (cnxpool,
+				NUM_REQUESTS * sizeof (struct request));
+	if ((lil == NULL) || (reqs == NULL)) {
+		fail ("Failed to allocate memory");
+	}
+	lil->def = &lillydap;
+	lil->def->lillyget_dercursor   = lillyget_dercursor;
+	lil->def->lillyget_ldapmessage = lillyget_ldapmessage;
+	lil->def->lillyget_opcode      = lillyget_opcode;
+	lil->def->lillyget_response    = lillyget_correlate;
+	lil->def->lillyget_operation   = count_stray;
+	lil->cnxpool = cnxpool;
+	lil->get_fd = lil->put_fd = -1;
+	//
+	// Send the requests, as far as the table is concerned
+	int i;
+	for (i = 0; i < NUM_REQUESTS; i++) {
+		reqs [i].mid = lillymsg_id_alloc_cb (lil, NULL,
+					count_response, &reqs [i]);
+		if (reqs [i].mid == 0) {
+			fail ("Failed to allocate a MessageID");
+		}
+	}
+	//
+	// Respond in reverse order, and check that all were freed
+	for (i = NUM_REQUESTS - 1; i >= 0; i--) {
+		respond (lil, reqs [i].mid, entry, sizeof (entry));
+		respond (lil, reqs [i].mid, done, sizeof (done));
+	}
+	for (i = 0; i < NUM_REQUESTS; i++) {
+		if ((reqs [i].entries != 1) || (reqs [i].done != 1)) {
+			fail ("Callback did not see all its responses");
+		}
+		if (lillymsg_id_qpool (lil, reqs [i].mid) != NULL) {
+			fail ("Final response did not free the MessageID");
+		}
+	}
+	if (strays != 0) {
+		fail ("Correlated responses were passed to lillyget_operation");
+	}
+	//
+	// A response after the final one is a stray
+	respond (lil, reqs [0].mid, done, sizeof (done));
+	if (strays != 1) {
+		fail ("Uncorrelated response was not passed to lillyget_operation");
+	}
+	lillymem_endpool (cnxpool);
+	exit (0);
+}
@@ -0,0 +1,218 @@
+/* derbench.c -- Compare generated and interpreted unpacking of operations.
+ *
+ * The operations in the given LDAPMessage files are unpacked and packed
+ * over and over, once with the Quick DER interpreter and once with the
+ * code that derwalk2c generated.  Both must produce the same dercursor
+ * values and the same bytes, or the test fails.  The generated code must
+ * exist and succeed for every operation, or the interpreter would be
+ * compared with itself; only operations in INTERPRETED_PACK are packed by
+ * the interpreter, because derwalk2c leaves their CHOICE to it.  The time
+ * per operation is reported for both.
+ *
+ * Usage: derbench.test [rounds] ldapmsg.bin...
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+#include <lillydap/regionmem.h>
+
+#include <quick-der/api.h>
+
+
+#define MAX_OPS 1024
+#define MAX_FIELDS 64
+#define MAX_PACKED 65536
+
+// BindRequest holds a CHOICE, for which derwalk2c generates no packer
+#define INTERPRETED_PACK (1UL << 0)
+
+
+static char *progname;
+static int numops = 0;
+static uint8_t opcodes [MAX_OPS];
+static dercursor ops [MAX_OPS];
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+/* Collect the operations, with the opcode from their tag.  Operations
+ * that LillyDAP does not unpack by opcode are skipped.
+ */
+static int collect_op (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const dercursor op,
+				const dercursor controls) {
+	uint8_t opcode = (*op.derptr & ~ 0x20) - DER_TAG_APPLICATION(0);
+	dercursor data [MAX_FIELDS];
+	if ((numops < MAX_OPS) &&
+			(lillyop_unpack (opcode, op, data, true) == 0)) {
+		opcodes [numops] = opcode;
+		ops [numops] = op;
+		numops++;
+	} else {
+		lillymem_endpool (qpool);
+	}
+	return 0;
+}
+
+
+/* Load a file into memory allocated from the given pool.
+ */
+static uint8_t *load (LillyPool pool, char *filename, size_t *len) {
+	int fd = open (filename, O_RDONLY);
+	if (fd < 0) {
+		fail ("Failed to open an LDAPMessage file");
+	}
+	off_t size = lseek (fd, 0, SEEK_END);
+	uint8_t *buf = lillymem_alloc (pool, size);
+	if ((size < 0) || (buf == NULL) ||
+			(pread (fd, buf, size, 0) != size)) {
+		fail ("Failed to load an LDAPMessage file");
+	}
+	close (fd);
+	*len = size;
+	return buf;
+}
+
+
+/* Unpack and pack all operations for the given number of rounds, and
+ * return the time taken in nanoseconds.
+ */
+static double run (int rounds, bool interpret) {
+	static uint8_t packed [MAX_PACKED];
+	dercursor data [MAX_FIELDS];
+	struct timespec t0, t1;
+	int r, i;
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < numops; i++) {
+			if (lillyop_unpack (opcodes [i], ops [i], data, interpret) == -1) {
+				fail ("Failed to unpack an operation");
+			}
+			size_t len = lillyop_pack (opcodes [i], data, NULL, interpret);
+			if ((len == 0) || (len > MAX_PACKED)) {
+				fail ("Failed to pack an operation");
+			}
+			lillyop_pack (opcodes [i], data, packed + MAX_PACKED, interpret);
+		}
+	}
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+}
+
+
+/* Check that both ways of unpacking and packing give the same results.
+ * The generated code is called directly, so it cannot fall back on the
+ * interpreter.
+ */
+static void compare (void) {
+	static uint8_t packed1 [MAX_PACKED], packed2 [MAX_PACKED];
+	dercursor data1 [MAX_FIELDS], data2 [MAX_FIELDS];
+	int i;
+	for (i = 0; i < numops; i++) {
+		memset (data1, 0, sizeof (data1));
+		memset (data2, 0, sizeof (data2));
+		if (lillyop_unpack (opcodes [i], ops [i], data1, true) == -1) {
+			fail ("Failed to unpack an operation");
+		}
+		if (lillyop_unpack_generated (opcodes [i], ops [i], data2) == -1) {
+			fail ("Generated code does not unpack an operation");
+		}
+		if (memcmp (data1, data2, sizeof (data1)) != 0) {
+			fail ("Generated code unpacks differently");
+		}
+		size_t len1 = lillyop_pack (opcodes [i], data1, NULL, true);
+		if ((len1 == 0) || (len1 > MAX_PACKED)) {
+			fail ("Failed to pack an operation");
+		}
+		if ((INTERPRETED_PACK & (1UL << opcodes [i])) != 0) {
+			if ((lillyop_pack_generated (opcodes [i], data2, NULL) != 0) ||
+					(errno != ENOSYS)) {
+				fail ("Generated code packs an operation in INTERPRETED_PACK");
+			}
+			continue;
+		}
+		size_t len2 = lillyop_pack_generated (opcodes [i], data2, NULL);
+		if (len2 == 0) {
+			fail ("Generated code does not pack an operation");
+		}
+		if (len1 != len2) {
+			fail ("Generated code packs to another length");
+		}
+		lillyop_pack (opcodes [i], data1, packed1 + MAX_PACKED, true);
+		lillyop_pack_generated (opcodes [i], data2, packed2 + MAX_PACKED);
+		if (memcmp (packed1 + MAX_PACKED - len1,
+				packed2 + MAX_PACKED - len2, len1) != 0) {
+			fail ("Generated code packs different bytes");
+		}
+	}
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	int rounds = 10000;
+	if ((argc > 1) && (strspn (argv [1], "0123456789") == strlen (argv [1]))) {
+		rounds = atoi (argv [1]);
+		argv++;
+		argc--;
+	}
+	if ((argc < 2) || (rounds <= 0)) {
+		fprintf (stderr, "Usage: %s [rounds] ldapmsg.bin...\n", progname);
+		exit (1);
+	}
+	regionmem_setup ();
+	LillyPool lipo = lillymem_newpool ();
+	if (lipo == NULL) {
+		fail ("Failed to allocate a memory pool");
+	}
+	//
+	// Collect the operations from the files
+	LDAP *lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	lil->def = &lillydap;
+	lil->def->lillyget_dercursor   = lillyget_dercursor;
+	lil->def->lillyget_ldapmessage = collect_op;
+	lil->cnxpool = lipo;
+	lil->get_fd = lil->put_fd = -1;
+	int i;
+	for (i = 1; i < argc; i++) {
+		size_t len;
+		uint8_t *buf = load (lipo, argv [i], &len);
+		if (lillyget_netbytes (lil, buf, len) == -1) {
+			fail ("Failed to process an LDAPMessage");
+		}
+	}
+	if (numops == 0) {
+		fail ("No operations were found");
+	}
+	//
+	// Compare results, then measure both ways
+	compare ();
+	double nsint = run (rounds, true);
+	double nsgen = run (rounds, false);
+	unsigned long count = ((unsigned long) rounds) * numops;
+	printf ("%d operations, %.1f ns interpreted, %.1f ns generated per unpack and pack\n",
+			numops, nsint / count, nsgen / count);
+	lillymem_endpool (lipo);
+	exit (0);
+}
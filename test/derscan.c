@@ -0,0 +1,208 @@
+/* derscan.c -- Compare ways of indexing the elements of a collection.
+ *
+ * A wide attribute list, as in a SearchResultEntry, and a list of small
+ * attribute values are built, with now and then a large element that has
+ * a long length.  Their elements are indexed with der_skip() and with the
+ * scan in lib/derscan.c, which must both find the same elements.  The
+ * time per element is reported for each.
+ *
+ * Usage: derscan.test [rounds]
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "../lib/derscan.c"
+
+
+#define NUM_ELEMS 4096
+#define MAX_LIST (NUM_ELEMS * 320)
+
+
+static char *progname;
+static uint8_t list [MAX_LIST];
+static size_t listlen = 0;
+static dercursor want [NUM_ELEMS];
+static dercursor found [NUM_ELEMS];
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+/* Append a header to the list, with a long length when needed.
+ */
+static void add_header (uint8_t tag, size_t len) {
+	list [listlen++] = tag;
+	if (len < 0x80) {
+		list [listlen++] = len;
+	} else if (len < 0x100) {
+		list [listlen++] = 0x81;
+		list [listlen++] = len;
+	} else {
+		list [listlen++] = 0x82;
+		list [listlen++] = len >> 8;
+		list [listlen++] = len & 0xff;
+	}
+}
+
+
+/* Return the size of a header for a given length.
+ */
+static size_t header_size (size_t len) {
+	return (len < 0x80) ? 2 : (len < 0x100) ? 3 : 4;
+}
+
+
+/* Append a PartialAttribute with a type and one value to the list.
+ */
+static void add_attribute (size_t typelen, size_t vallen) {
+	size_t valslen = vallen + header_size (vallen);
+	size_t attrlen = typelen + 2 + valslen + header_size (valslen);
+	add_header (DER_TAG_SEQUENCE | 0x20, attrlen);
+	add_header (DER_TAG_OCTETSTRING, typelen);
+	memset (list + listlen, 'a', typelen);
+	listlen += typelen;
+	add_header (DER_TAG_SET | 0x20, valslen);
+	add_header (DER_TAG_OCTETSTRING, vallen);
+	memset (list + listlen, 'v', vallen);
+	listlen += vallen;
+}
+
+
+/* Build a list of wide attributes, or of small values, and record where
+ * its elements are.  Now and then, an element has a long length.
+ */
+static void build (bool wide) {
+	int i;
+	srandom (4511);
+	listlen = 0;
+	for (i = 0; i < NUM_ELEMS; i++) {
+		want [i].derptr = list + listlen;
+		if ((i % 13) == 12) {
+			add_attribute (12, 150 + random () % 100);
+		} else if (wide) {
+			add_attribute (4 + random () % 12, random () % 40);
+		} else {
+			size_t vallen = random () % 12;
+			add_header (DER_TAG_OCTETSTRING, vallen);
+			memset (list + listlen, 'v', vallen);
+			listlen += vallen;
+		}
+		want [i].derlen = list + listlen - want [i].derptr;
+	}
+}
+
+
+typedef int scan_fun (dercursor *crs, dercursor *elems_opt, size_t *count);
+
+/* Index the elements with der_skip(), as a baseline.
+ */
+static int scan_skip (dercursor *crs, dercursor *elems_opt, size_t *count) {
+	size_t n = 0;
+	while ((n < *count) && (crs->derlen > 0)) {
+		dercursor elem = *crs;
+		if (der_skip (crs) == -1) {
+			return -1;
+		}
+		if (elems_opt != NULL) {
+			elems_opt [n].derptr = elem.derptr;
+			elems_opt [n].derlen = elem.derlen - crs->derlen;
+		}
+		n++;
+	}
+	*count = n;
+	return 0;
+}
+
+
+/* Check that a scan finds the elements of the list, also when it is
+ * stopped after a number of elements.
+ */
+static void check (scan_fun *scan) {
+	dercursor crs = { .derptr = list, .derlen = listlen };
+	size_t count = NUM_ELEMS + 1;
+	memset (found, 0, sizeof (found));
+	if ((scan (&crs, found, &count) == -1) ||
+			(count != NUM_ELEMS) || (crs.derlen != 0)) {
+		fail ("Scan did not find all elements");
+	}
+	if (memcmp (found, want, sizeof (want)) != 0) {
+		fail ("Scan found other elements");
+	}
+	crs.derptr = list;
+	crs.derlen = listlen;
+	size_t done = 0;
+	while (done < NUM_ELEMS) {
+		count = 37;
+		if ((scan (&crs, found + done, &count) == -1) || (count == 0)) {
+			fail ("Scan in steps did not find all elements");
+		}
+		if (crs.derptr != want [done + count - 1].derptr +
+					want [done + count - 1].derlen) {
+			fail ("Scan in steps stopped in the wrong place");
+		}
+		done += count;
+	}
+	//
+	// A truncated list fails
+	crs.derptr = list;
+	crs.derlen = listlen - 1;
+	count = NUM_ELEMS;
+	if (scan (&crs, NULL, &count) != -1) {
+		fail ("Scan accepted a truncated list");
+	}
+}
+
+
+/* Run a scan for the given number of rounds, and return the time taken
+ * per element in nanoseconds.
+ */
+static double run (scan_fun *scan, int rounds) {
+	struct timespec t0, t1;
+	int r;
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	for (r = 0; r < rounds; r++) {
+		dercursor crs = { .derptr = list, .derlen = listlen };
+		size_t count = NUM_ELEMS;
+		if (scan (&crs, found, &count) == -1) {
+			fail ("Failed to scan the list");
+		}
+	}
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	return ns / (((double) rounds) * NUM_ELEMS);
+}
+
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	int rounds = 1000;
+	if (argc > 1) {
+		rounds = atoi (argv [1]);
+	}
+	if ((argc > 2) || (rounds <= 0)) {
+		fprintf (stderr, "Usage: %s [rounds]\n", progname);
+		exit (1);
+	}
+	int wide;
+	for (wide = 1; wide >= 0; wide--) {
+		build (wide);
+		check (scan_skip);
+		check (qder2b_scan);
+		printf ("%d %s in %zu bytes\n", NUM_ELEMS,
+				wide ? "attributes" : "values", listlen);
+		printf ("%6.2f ns per element with der_skip()\n", run (scan_skip, rounds));
+		printf ("%6.2f ns per element with qder2b_scan()\n", run (qder2b_scan, rounds));
+	}
+	exit (0);
+}
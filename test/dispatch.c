@@ -0,0 +1,210 @@
+/* dispatch.c -- Check that a compiled plan drops refused operations early.
+ *
+ * The LDAPMessages from the given files are passed through LillyDAP with
+ * an opregistry that only handles SearchResultEntry and SearchResultDone,
+ * and with SearchResultDone set in reject_ops.  After lillydap_compile(),
+ * only the SearchResultEntry messages should be delivered, and all others
+ * should be dropped without a qpool being created for them.  BindRequests
+ * with a messageID of 0 or 2^31 should not be dropped, but refused.
+ *
+ * Usage: dispatch.test ldapmsg.bin...
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+
+#include <quick-der/api.h>
+
+
+static char *progname;
+
+
+/* BindRequests whose messageID is out of range.
+ */
+static uint8_t bind_msgid_zero [] = {
+	0x30, 0x0c, 0x02, 0x01, 0x00,
+	0x60, 0x07, 0x02, 0x01, 0x03, 0x04, 0x00, 0x80, 0x00,
+};
+
+static uint8_t bind_msgid_high [] = {
+	0x30, 0x10, 0x02, 0x05, 0x00, 0x80, 0x00, 0x00, 0x00,
+	0x60, 0x07, 0x02, 0x01, 0x03, 0x04, 0x00, 0x80, 0x00,
+};
+static int delivered = 0;
+static int expected = 0;
+static int newpools = 0;
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+/* Count the pools that are created, to see that dropped messages have
+ * none of their own.
+ */
+static LillyPool count_newpool (void) {
+	newpools++;
+	return sillymem_newpool ();
+}
+
+
+static int got_entry (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const LillyPack_SearchResultEntry *data,
+				const dercursor controls) {
+	delivered++;
+	lillymem_endpool (qpool);
+	return 0;
+}
+
+
+static int got_done (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const LillyPack_SearchResultDone *data,
+				const dercursor controls) {
+	fail ("A rejected SearchResultDone was delivered");
+	return -1;
+}
+
+
+/* Count the messages in a buffer, and the SearchResultEntry among them.
+ */
+static int count_msgs (uint8_t *buf, size_t len) {
+	dercursor all = { .derptr = buf, .derlen = len };
+	int count = 0;
+	while (all.derlen > 0) {
+		dercursor msg = all;
+		uint8_t tag;
+		uint8_t hlen;
+		size_t mlen;
+		if ((der_skip (&all) == -1) ||
+				(der_header (&msg, &tag, &mlen, &hlen) == -1) ||
+				(der_header (&msg, &tag, &mlen, &hlen) == -1)) {
+			fail ("Failed to parse an LDAPMessage");
+		}
+		if ((msg.derptr [mlen] & ~ 0x20) == DER_TAG_APPLICATION (4)) {
+			expected++;
+		}
+		count++;
+	}
+	return count;
+}
+
+
+/* Load a file into memory allocated from the given pool.
+ */
+static uint8_t *load (LillyPool pool, char *filename, size_t *len) {
+	int fd = open (filename, O_RDONLY);
+	if (fd < 0) {
+		fail ("Failed to open an LDAPMessage file");
+	}
+	off_t size = lseek (fd, 0, SEEK_END);
+	uint8_t *buf = lillymem_alloc (pool, size);
+	if ((size < 0) || (buf == NULL) ||
+			(pread (fd, buf, size, 0) != size)) {
+		fail ("Failed to load an LDAPMessage file");
+	}
+	close (fd);
+	*len = size;
+	return buf;
+}
+
+
+static const LillyOpRegistry opregistry = {
+	.by_name = {
+		.SearchResultEntry = got_entry,
+		.SearchResultDone = got_done,
+	}
+};
+
+static LillyDAP lillydap = {
+	.reject_ops = { LILLYGETR_SEARCHRESULT_DONE, 0 },
+	.lillyget_dercursor   = lillyget_dercursor,
+	.lillyget_ldapmessage = lillyget_ldapmessage,
+	.lillyget_opcode      = lillyget_opcode,
+	.lillyget_operation   = lillyget_operation,
+	.opregistry = &opregistry,
+};
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	if (argc < 2) {
+		fprintf (stderr, "Usage: %s ldapmsg.bin...\n", progname);
+		exit (1);
+	}
+	lillymem_newpool_fun = count_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc;
+	LillyPool lipo = lillymem_newpool ();
+	if (lipo == NULL) {
+		fail ("Failed to allocate a memory pool");
+	}
+	lillydap_compile (&lillydap);
+	if (lillydap.plan.drop [0] & (1UL << 4)) {
+		fail ("SearchResultEntry is dropped by the plan");
+	}
+	if ((lillydap.plan.drop [0] & (1UL << 5)) == 0) {
+		fail ("Rejected SearchResultDone is not dropped by the plan");
+	}
+	if ((lillydap.plan.drop [0] & (1UL << 0)) == 0) {
+		fail ("Unregistered BindRequest is not dropped by the plan");
+	}
+	LDAP *lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	lil->def = &lillydap;
+	lil->cnxpool = lipo;
+	lil->get_fd = lil->put_fd = -1;
+	int i;
+	int total = 0;
+	for (i = 1; i < argc; i++) {
+		size_t len;
+		uint8_t *buf = load (lipo, argv [i], &len);
+		total += count_msgs (buf, len);
+		newpools = 0;
+		int before = delivered;
+		if (lillyget_netbytes (lil, buf, len) == -1) {
+			fail ("Failed to process an LDAPMessage");
+		}
+		if (newpools != delivered - before) {
+			fail ("A qpool was created for a dropped message");
+		}
+	}
+	if (delivered != expected) {
+		fail ("Not all SearchResultEntry messages were delivered");
+	}
+	if (lil->get_dropped != total - delivered) {
+		fail ("Not all other messages were dropped");
+	}
+	dercursor bad [2] = {
+		{ bind_msgid_zero, sizeof (bind_msgid_zero) },
+		{ bind_msgid_high, sizeof (bind_msgid_high) },
+	};
+	for (i = 0; i < 2; i++) {
+		if (lillyget_dropped (lil, bad [i]) ||
+				(lillyget_dercursor (lil, NULL, bad [i]) != -1)) {
+			fail ("A message with a bad messageID was dropped");
+		}
+	}
+	if (lil->get_dropped != total - delivered) {
+		fail ("A message with a bad messageID was counted as dropped");
+	}
+	printf ("Delivered %d and dropped %llu messages\n",
+			delivered, (unsigned long long) lil->get_dropped);
+	lillymem_endpool (lipo);
+	exit (0);
+}
@@ -0,0 +1,192 @@
+/* eventfd.c -- Test the eventfd that signals output to the event loop.
+ *
+ * The eventfd may only be signaled when the output queue goes from empty
+ * to non-empty, so a burst of messages leads to one wakeup.  Before it is
+ * opened, put_sigfd is -1 and signals are ignored.  The messages are
+ * larger than the pipe that put_fd writes to, so lillyput_event() reports
+ * EAGAIN while the queue is not empty yet.  The event loop as documented
+ * waits for put_fd to be writable in that case, and it must not stall.
+ * Output that is queued after the queue drained is signaled again.
+ *
+ * Usage: eventfd.test [gather]
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+#include <lillydap/queue.h>
+
+
+#define NUM_MESSAGES 3
+#define MSG_SIZE 3000
+
+
+static char *progname;
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+/* Read the counter of the eventfd, which tells how often it was signaled
+ * since it was last read.
+ */
+static uint64_t signals (LDAP *lil) {
+	uint64_t count;
+	if (read (lil->put_sigfd, &count, sizeof (count)) < 0) {
+		if (errno != EAGAIN) {
+			fail ("Failed to read the eventfd");
+		}
+		return 0;
+	}
+	return count;
+}
+
+
+/* Queue a message of MSG_SIZE bytes in its own qpool.
+ */
+static void queue_message (LDAP *lil) {
+	LillyPool qpool = lillymem_newpool ();
+	dercursor msg;
+	msg.derptr = lillymem_alloc (qpool, MSG_SIZE);
+	msg.derlen = MSG_SIZE;
+	if (msg.derptr == NULL) {
+		fail ("Failed to allocate a message");
+	}
+	memset (msg.derptr, 0x5a, MSG_SIZE);
+	if (lillyput_dercursor (lil, qpool, msg) == -1) {
+		fail ("Failed to queue a message");
+	}
+}
+
+
+/* Run the event loop that USAGE.MD describes, and read from the other end
+ * of the pipe until the expected number of bytes arrived.  Every wait for
+ * the loop is bounded, so a stall is reported as a failure.
+ */
+static void event_loop (LDAP *lil, int rdfd, size_t expected) {
+	uint8_t buf [1024];
+	size_t received = 0;
+	struct pollfd pfd [3];
+	pfd [0].fd = lil->put_sigfd;
+	pfd [0].events = POLLIN;
+	pfd [1].fd = lil->put_fd;
+	pfd [2].fd = rdfd;
+	pfd [2].events = POLLIN;
+	while ((received < expected) || lillyput_cansend (lil)) {
+		pfd [1].events = lillyput_cansend (lil) ? POLLOUT : 0;
+		int ready = poll (pfd, 3, 1000);
+		if (ready < 0) {
+			fail ("Failed to poll");
+		}
+		if (ready == 0) {
+			fail ("Event loop stalled with output in the queue");
+		}
+		if (pfd [0].revents & POLLIN) {
+			if (lillyput_eventfd_drain (lil) == -1) {
+				fail ("Failed to drain the eventfd");
+			}
+		}
+		while (lillyput_event (lil) >= 0) {
+			;
+		}
+		if (errno != EAGAIN) {
+			fail ("Failed to send from the queue");
+		}
+		if (pfd [2].revents & POLLIN) {
+			ssize_t got = read (rdfd, buf, sizeof (buf));
+			if (got < 0) {
+				fail ("Failed to read from the pipe");
+			}
+			received += got;
+		}
+	}
+	if (received != expected) {
+		fail ("Received more than was sent");
+	}
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	lillymem_newpool_fun = sillymem_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc;
+	LillyPool cnxpool = lillymem_newpool ();
+	LDAP *lil = lillymem_alloc0 (cnxpool, sizeof (LDAP));
+	if (lil == NULL) {
+		fail ("Failed to allocate memory");
+	}
+	lillydap.lillyput_signal = lillyput_eventfd_signal;
+	lil->def = &lillydap;
+	lil->cnxpool = cnxpool;
+	lil->get_fd = lil->put_fd = -1;
+	lil->put_sigfd = -1;
+	if ((argc > 1) && (strcmp (argv [1], "gather") == 0)) {
+		lil->flags |= LILLYCNX_PUT_GATHER;
+	}
+	//
+	// Without an eventfd, signals are ignored and draining is refused
+	lillyput_eventfd_signal (lil);
+	if ((lillyput_eventfd_drain (lil) != -1) || (errno != EBADF)) {
+		fail ("Draining without an eventfd did not fail with EBADF");
+	}
+	if (lillyput_eventfd_open (lil) == -1) {
+		fail ("Failed to open the eventfd");
+	}
+	int pipefd [2];
+	if (pipe2 (pipefd, O_NONBLOCK) == -1) {
+		fail ("Failed to open a pipe");
+	}
+	// Keep the pipe smaller than the messages; the minimum is a page
+	fcntl (pipefd [1], F_SETPIPE_SZ, 4096);
+	lil->put_fd = pipefd [1];
+	//
+	// A burst of output is signaled once, and more output is not
+	int i;
+	for (i = 0; i < NUM_MESSAGES; i++) {
+		queue_message (lil);
+	}
+	if (signals (lil) != 1) {
+		fail ("A burst of output was not signaled exactly once");
+	}
+	queue_message (lil);
+	if (signals (lil) != 0) {
+		fail ("Output to a non-empty queue was signaled");
+	}
+	// Restore the signal that was read, for the event loop
+	lillyput_eventfd_signal (lil);
+	event_loop (lil, pipefd [0], (NUM_MESSAGES + 1) * MSG_SIZE);
+	//
+	// After the queue drained, new output is signaled again
+	signals (lil);
+	queue_message (lil);
+	if (signals (lil) != 1) {
+		fail ("Output to a drained queue was not signaled");
+	}
+	lillyput_eventfd_signal (lil);
+	event_loop (lil, pipefd [0], MSG_SIZE);
+	close (pipefd [0]);
+	close (pipefd [1]);
+	close (lil->put_sigfd);
+	lillymem_endpool (cnxpool);
+	exit (0);
+}
@@ -0,0 +1,264 @@
+/* extop.c -- Check that Extended operations are unpacked only once.
+ *
+ * A WhoAmI request, a PasswdModify request and an ExtendedResponse are
+ * passed through lillyget_dercursor().  The fields that lillyget_ldapmessage()
+ * unpacks to find the OID should be passed on by lillyget_opcode(), or the
+ * requestValue inside them should be unpacked by the opcode.  The fields
+ * that lillyget_operation() receives are checked against the messages.
+ * The PasswdModify request is packed again by lillyput_operation(), which
+ * must reproduce the message.  A PasswdModify response value cannot be
+ * sent by itself, as it lacks an LDAPResult.  It is packed with
+ * lillyop_pack() into an ExtendedResponse with a failure result instead,
+ * and its fields must come back when that is received.  Finally, a
+ * PasswdModify request that needs long length headers makes the same
+ * round trip.
+ *
+ * Usage: extop.test
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+
+#include <quick-der/api.h>
+
+
+/* Opcodes from lib/msgop.gperf
+ */
+#define OPCODE_EXTENDED_RESP 24
+#define OPCODE_PASSWDMODIFY_REQ 34
+#define OPCODE_PASSWDMODIFY_RESP 35
+#define OPCODE_WHOAMI_REQ 36
+
+
+static uint8_t whoami_req [] = {
+	0x30, 0x1e, 0x02, 0x01, 0x05,
+	0x77, 0x19,
+	0x80, 0x17, '1','.','3','.','6','.','1','.','4','.','1','.',
+		    '4','2','0','3','.','1','.','1','1','.','3',
+};
+
+static uint8_t passwdmodify_req [] = {
+	0x30, 0x31, 0x02, 0x01, 0x06,
+	0x77, 0x2c,
+	0x80, 0x17, '1','.','3','.','6','.','1','.','4','.','1','.',
+		    '4','2','0','3','.','1','.','1','1','.','1',
+	0x81, 0x11,
+	0x30, 0x0f,
+	0x80, 0x05, 'u','i','d','=','x',
+	0x82, 0x06, 's','e','c','r','e','t',
+};
+
+static uint8_t extended_resp [] = {
+	0x30, 0x14, 0x02, 0x01, 0x05,
+	0x78, 0x0f,
+	0x0a, 0x01, 0x00,
+	0x04, 0x00,
+	0x04, 0x00,
+	0x8b, 0x06, 'd','n',':','x','=','y',
+};
+
+
+static char *progname;
+static int checked = 0;
+
+static uint8_t sent [512];
+
+static char longpasswd [201];
+static size_t sentlen = 0;
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+/* Check that a field holds the given string.
+ */
+static void check_field (dercursor crs, char *str) {
+	if (str == NULL) {
+		if (crs.derptr != NULL) {
+			fail ("Field should be absent");
+		}
+	} else if ((crs.derptr == NULL) ||
+			(crs.derlen != strlen (str)) ||
+			(memcmp (crs.derptr, str, crs.derlen) != 0)) {
+		fail ("Field has another value");
+	}
+}
+
+
+/* Stand in for lillyput_dercursor(), and keep a copy of the message.
+ */
+static int capture_dercursor (LDAP *lil, LillyPool qpool, dercursor dermsg) {
+	if (dermsg.derlen > sizeof (sent)) {
+		fail ("Packed message is too long");
+	}
+	memcpy (sent, dermsg.derptr, dermsg.derlen);
+	sentlen = dermsg.derlen;
+	return 0;
+}
+
+
+static int check_operation (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor *data,
+				const dercursor controls) {
+	if (lil->get_extcrs != NULL) {
+		fail ("Extended operation fields were not taken");
+	}
+	switch (opcode) {
+	case OPCODE_WHOAMI_REQ:
+		check_field (data [0], "1.3.6.1.4.1.4203.1.11.3");
+		check_field (data [1], NULL);
+		break;
+	case OPCODE_PASSWDMODIFY_REQ:
+		if (msgid == 8) {
+			// The long request that was packed in main()
+			check_field (data [0], "uid=x");
+			check_field (data [2], longpasswd);
+			break;
+		}
+		check_field (data [0], "uid=x");
+		check_field (data [1], NULL);
+		check_field (data [2], "secret");
+		if (lillyput_operation (lil, qpool, msgid, opcode, data,
+					(dercursor) { NULL, 0 }) == -1) {
+			fail ("Failed to pack a PasswdModify request");
+		}
+		if ((sentlen != sizeof (passwdmodify_req)) ||
+				(memcmp (sent, passwdmodify_req, sentlen) != 0)) {
+			fail ("PasswdModify request was packed differently");
+		}
+		break;
+	case OPCODE_PASSWDMODIFY_RESP:
+		check_field (data [0], "new");
+		break;
+	case OPCODE_EXTENDED_RESP:
+		check_field (data [4], NULL);
+		check_field (data [5], "dn:x=y");
+		break;
+	default:
+		fail ("Unexpected opcode");
+	}
+	checked++;
+	lillymem_endpool (qpool);
+	return 0;
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	if (argc != 1) {
+		fprintf (stderr, "Usage: %s\n", progname);
+		exit (1);
+	}
+	lillymem_newpool_fun = sillymem_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc;
+	LillyPool lipo = lillymem_newpool ();
+	if (lipo == NULL) {
+		fail ("Failed to allocate a memory pool");
+	}
+	LDAP *lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	lil->def = &lillydap;
+	lil->def->lillyget_dercursor   = lillyget_dercursor;
+	lil->def->lillyget_ldapmessage = lillyget_ldapmessage;
+	lil->def->lillyget_opcode      = lillyget_opcode;
+	lil->def->lillyget_operation   = check_operation;
+	lil->def->lillyput_dercursor   = capture_dercursor;
+	lil->cnxpool = lipo;
+	lil->get_fd = lil->put_fd = -1;
+	dercursor msgs [3] = {
+		{ whoami_req,       sizeof (whoami_req)       },
+		{ passwdmodify_req, sizeof (passwdmodify_req) },
+		{ extended_resp,    sizeof (extended_resp)    },
+	};
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (lillyget_dercursor (lil, NULL, msgs [i]) == -1) {
+			fail ("Failed to process an Extended operation");
+		}
+		if ((lil->get_extcrs != NULL) || (lil->get_extop != NULL)) {
+			fail ("Extended operation fields were left behind");
+		}
+	}
+	//
+	// Refuse a PasswdModify response value, for lack of an LDAPResult
+	LillyPool qpool = lillymem_newpool ();
+	if (qpool == NULL) {
+		fail ("Failed to allocate a memory pool");
+	}
+	dercursor genpasswd = { (uint8_t *) "new", 3 };
+	if ((lillyput_operation (lil, qpool, 7, OPCODE_PASSWDMODIFY_RESP,
+				&genpasswd, (dercursor) { NULL, 0 }) != -1) ||
+			(errno != ENOSYS)) {
+		fail ("PasswdModify response was packed without an LDAPResult");
+	}
+	//
+	// Send it in an ExtendedResponse instead, and receive it back
+	uint8_t value [16];
+	size_t valuelen = lillyop_pack (OPCODE_PASSWDMODIFY_RESP, &genpasswd,
+				value + sizeof (value), false);
+	if ((valuelen == 0) || (valuelen > sizeof (value))) {
+		fail ("Failed to pack a PasswdModify response value");
+	}
+	dercursor extresp [6] = {
+		{ (uint8_t *) "\x35", 1 },	// unwillingToPerform
+		{ (uint8_t *) "", 0 },
+		{ (uint8_t *) "weak", 4 },
+		{ NULL, 0 },
+		{ (uint8_t *) "1.3.6.1.4.1.4203.1.11.1", 23 },
+		{ value + sizeof (value) - valuelen, valuelen },
+	};
+	if (lillyput_operation (lil, qpool, 7, OPCODE_EXTENDED_RESP,
+				extresp, (dercursor) { NULL, 0 }) == -1) {
+		fail ("Failed to pack a PasswdModify response");
+	}
+	lillymem_endpool (qpool);
+	dercursor resp = { sent, sentlen };
+	if (lillyget_dercursor (lil, NULL, resp) == -1) {
+		fail ("Failed to process a packed PasswdModify response");
+	}
+	//
+	// Send a PasswdModify request with long length headers, and back
+	qpool = lillymem_newpool ();
+	if (qpool == NULL) {
+		fail ("Failed to allocate a memory pool");
+	}
+	memset (longpasswd, 'x', sizeof (longpasswd) - 1);
+	dercursor longreq [3] = {
+		{ (uint8_t *) "uid=x", 5 },
+		{ NULL, 0 },
+		{ (uint8_t *) longpasswd, sizeof (longpasswd) - 1 },
+	};
+	if (lillyput_operation (lil, qpool, 8, OPCODE_PASSWDMODIFY_REQ,
+				longreq, (dercursor) { NULL, 0 }) == -1) {
+		fail ("Failed to pack a long PasswdModify request");
+	}
+	lillymem_endpool (qpool);
+	dercursor req = { sent, sentlen };
+	if (lillyget_dercursor (lil, NULL, req) == -1) {
+		fail ("Failed to process a long PasswdModify request");
+	}
+	if (checked != 5) {
+		fail ("Not all Extended operations were checked");
+	}
+	printf ("Checked %d Extended operations\n", checked);
+	lillymem_endpool (lipo);
+	exit (0);
+}
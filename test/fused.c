@@ -0,0 +1,273 @@
+/* fused.c -- Check that the fused path matches the layered path.
+ *
+ * A BindRequest and a SearchRequest that carry controls are passed through
+ * lillyget_dercursor() twice.  The first time, the library defaults are
+ * used, so they are unpacked with their LDAPMessage in a single pass.  The
+ * second time, lillyget_opcode() is wrapped, so the layers in between are
+ * used.  Both must pass the same msgid, operation fields and controls to
+ * lillyget_operation(), and the controls must hold what the message has
+ * inside its [0] tag.  The operation and controls are then packed again
+ * by lillyput_ldapmessage(), which must reproduce the message, and that
+ * is passed through both paths once more.
+ *
+ * Usage: fused.test
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <errno.h>
+#include <unistd.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+
+#include <quick-der/api.h>
+
+
+static uint8_t bind_req [] = {
+	0x30, 0x24, 0x02, 0x01, 0x01,
+	0x60, 0x0d,
+	0x02, 0x01, 0x03,
+	0x04, 0x04, 'c','n','=','x',
+	0x80, 0x02, 'p','w',
+	0xa0, 0x10,
+	0x30, 0x0e,
+	0x04, 0x05, '1','.','2','.','3',
+	0x01, 0x01, 0xff,
+	0x04, 0x02, 'a','b',
+};
+
+static uint8_t search_req [] = {
+	0x30, 0x4a, 0x02, 0x01, 0x02,
+	0x63, 0x20,
+	0x04, 0x00,
+	0x0a, 0x01, 0x00,
+	0x0a, 0x01, 0x00,
+	0x02, 0x01, 0x00,
+	0x02, 0x01, 0x00,
+	0x01, 0x01, 0x00,
+	0x87, 0x0b, 'o','b','j','e','c','t','C','l','a','s','s',
+	0x30, 0x00,
+	0xa0, 0x23,
+	0x30, 0x21,
+	0x04, 0x16, '1','.','2','.','8','4','0','.','1','1','3','5','5','6',
+		    '.','1','.','4','.','3','1','9',
+	0x04, 0x07,
+	0x30, 0x05, 0x02, 0x01, 0x64, 0x04, 0x00,
+};
+
+/* Where the [0] tag around the controls starts inside the messages.
+ */
+#define BIND_CONTROLS   20
+#define SEARCH_CONTROLS 39
+
+
+static char *progname;
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+/* The arguments that lillyget_operation() received last.
+ */
+struct seen_op {
+	int calls;
+	LillyMsgId msgid;
+	uint8_t opcode;
+	dercursor data [8];
+	dercursor controls;
+};
+
+static struct seen_op seen;
+
+static int layered = 0;
+
+
+static int record_operation (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor *data,
+				const dercursor controls) {
+	size_t fields = (opcode == 0)
+			? sizeof (LillyPack_BindRequest)   / sizeof (dercursor)
+			: sizeof (LillyPack_SearchRequest) / sizeof (dercursor);
+	if (fields > 8) {
+		fail ("Too many operation fields to record");
+	}
+	seen.calls++;
+	seen.msgid = msgid;
+	seen.opcode = opcode;
+	memset (seen.data, 0, sizeof (seen.data));
+	memcpy (seen.data, data, fields * sizeof (dercursor));
+	seen.controls = controls;
+	//
+	// The message buffers are static, so the cursors remain valid
+	lillymem_endpool (qpool);
+	return 0;
+}
+
+
+/* Stand in for lillyget_opcode(), which keeps the fused path away.
+ */
+static int layered_opcode (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor operation,
+				const dercursor controls) {
+	layered++;
+	return lillyget_opcode (lil, qpool, msgid, opcode, operation, controls);
+}
+
+
+static LillyDAP fused_def = {
+	.lillyget_dercursor   = lillyget_dercursor,
+	.lillyget_ldapmessage = lillyget_ldapmessage,
+	.lillyget_opcode      = lillyget_opcode,
+	.lillyget_operation   = record_operation,
+};
+
+static LillyDAP layered_def = {
+	.lillyget_dercursor   = lillyget_dercursor,
+	.lillyget_ldapmessage = lillyget_ldapmessage,
+	.lillyget_opcode      = layered_opcode,
+	.lillyget_operation   = record_operation,
+};
+
+
+/* Compare two cursors by their contents.
+ */
+static bool same_cursor (dercursor a, dercursor b) {
+	if ((a.derptr == NULL) || (b.derptr == NULL)) {
+		return (a.derptr == NULL) && (b.derptr == NULL);
+	}
+	return (a.derlen == b.derlen) &&
+			(memcmp (a.derptr, b.derptr, a.derlen) == 0);
+}
+
+
+/* Pass a message through both paths, and compare what comes out.
+ */
+static void check_message (LDAP *lil, uint8_t *msg, size_t msglen,
+				size_t ctlofs, LillyMsgId msgid) {
+	dercursor crs = { .derptr = msg, .derlen = msglen };
+	lil->def = &fused_def;
+	seen.calls = 0;
+	if (lillyget_dercursor (lil, NULL, crs) == -1) {
+		fail ("Failed to process a message on the fused path");
+	}
+	if ((seen.calls != 1) || (layered != 0)) {
+		fail ("The fused path did not deliver the operation");
+	}
+	struct seen_op fused = seen;
+	lil->def = &layered_def;
+	seen.calls = 0;
+	if (lillyget_dercursor (lil, NULL, crs) == -1) {
+		fail ("Failed to process a message on the layered path");
+	}
+	if ((seen.calls != 1) || (layered != 1)) {
+		fail ("The layered path did not deliver the operation");
+	}
+	layered = 0;
+	if ((fused.msgid != msgid) || (seen.msgid != msgid)) {
+		fail ("The msgid differs from the message");
+	}
+	if (fused.opcode != seen.opcode) {
+		fail ("The opcode differs between the paths");
+	}
+	int i;
+	for (i = 0; i < 8; i++) {
+		if (!same_cursor (fused.data [i], seen.data [i])) {
+			fail ("An operation field differs between the paths");
+		}
+	}
+	if (!same_cursor (fused.controls, seen.controls)) {
+		fail ("The controls differ between the paths");
+	}
+	dercursor expected = {
+		.derptr = msg + ctlofs + 2,
+		.derlen = msglen - ctlofs - 2,
+	};
+	if ((msg [ctlofs] != 0xa0) || !same_cursor (seen.controls, expected)) {
+		fail ("The controls are not the contents of the [0] tag");
+	}
+}
+
+
+/* Pack the operation and the controls that were received into a new
+ * LDAPMessage, and check that it is the original one.  The message is
+ * sent through a pipe and read back into repacked.
+ */
+static void repack_message (LDAP *lil, uint8_t *msg, size_t msglen,
+				size_t ctlofs, LillyMsgId msgid,
+				uint8_t *repacked) {
+	int pfd [2];
+	if (pipe (pfd) == -1) {
+		fail ("Failed to open a pipe");
+	}
+	lil->put_fd = pfd [1];
+	LillyPool qpool = lillymem_newpool ();
+	if (qpool == NULL) {
+		fail ("Failed to allocate a memory pool");
+	}
+	dercursor operation = { .derptr = msg + 5, .derlen = ctlofs - 5 };
+	if (lillyput_ldapmessage (lil, qpool, msgid,
+				operation, seen.controls) == -1) {
+		fail ("Failed to pack an LDAPMessage with controls");
+	}
+	while (lillyput_event (lil) > 0) {
+		;
+	}
+	if (read (pfd [0], repacked, msglen + 1) != msglen) {
+		fail ("The repacked message has another length");
+	}
+	if (memcmp (repacked, msg, msglen) != 0) {
+		fail ("The repacked message differs from the original");
+	}
+	close (pfd [0]);
+	close (pfd [1]);
+	lil->put_fd = -1;
+}
+
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	if (argc != 1) {
+		fprintf (stderr, "Usage: %s\n", progname);
+		exit (1);
+	}
+	lillymem_newpool_fun = sillymem_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc;
+	LillyPool lipo = lillymem_newpool ();
+	if (lipo == NULL) {
+		fail ("Failed to allocate a memory pool");
+	}
+	LDAP *lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	lil->cnxpool = lipo;
+	lil->get_fd = lil->put_fd = -1;
+	uint8_t repacked [sizeof (search_req) + 1];
+	check_message (lil, bind_req,   sizeof (bind_req),   BIND_CONTROLS,   1);
+	repack_message (lil, bind_req,  sizeof (bind_req),   BIND_CONTROLS,   1,
+				repacked);
+	check_message (lil, repacked,   sizeof (bind_req),   BIND_CONTROLS,   1);
+	check_message (lil, search_req, sizeof (search_req), SEARCH_CONTROLS, 2);
+	repack_message (lil, search_req, sizeof (search_req), SEARCH_CONTROLS, 2,
+				repacked);
+	check_message (lil, repacked,   sizeof (search_req), SEARCH_CONTROLS, 2);
+	printf ("Fused and layered paths agree on 2 messages with controls, "
+			"also when packed again\n");
+	lillymem_endpool (lipo);
+	exit (0);
+}
@@ -0,0 +1,177 @@
+/* lazyop.c -- Check that lazy decoding finds the same fields as unpacking.
+ *
+ * The LDAPMessages from the given files are passed through LillyDAP with
+ * a lazy callback for every opcode.  The callback requests the fields of
+ * the operation back to front, so the parts before them are skipped, and
+ * compares them to the fields that lillyop_unpack() finds.  The children
+ * of attribute lists are iterated and must cover the list exactly.
+ *
+ * Usage: lazyop.test ldapmsg.bin...
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+
+#include <quick-der/api.h>
+
+
+#define MAX_FIELDS 64
+
+
+static char *progname;
+static int checked = 0;
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+/* Iterate the children of a field, and check that they cover it.
+ */
+static void check_children (LillyLazy *lazy, unsigned field) {
+	const dercursor *seq = lillylazy_field (lazy, field);
+	if (seq == NULL) {
+		fail ("Failed to decode an attribute list");
+	}
+	size_t total = 0;
+	unsigned i;
+	dercursor child;
+	for (i = 0; ; i++) {
+		if (lillylazy_child (lazy, field, i, &child) == -1) {
+			fail ("Failed to iterate an attribute list");
+		}
+		if (child.derptr == NULL) {
+			break;
+		}
+		if (child.derptr != seq->derptr + total) {
+			fail ("Children of an attribute list are not adjacent");
+		}
+		total += child.derlen;
+	}
+	if (total != seq->derlen) {
+		fail ("Children do not cover their attribute list");
+	}
+	//
+	// Going back restarts the iteration
+	if ((i > 0) && ((lillylazy_child (lazy, field, 0, &child) == -1) ||
+			(child.derptr != seq->derptr))) {
+		fail ("Failed to restart iterating an attribute list");
+	}
+}
+
+
+/* Compare lazily decoded fields with those from lillyop_unpack().
+ */
+static int check_lazy (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				LillyLazy *lazy,
+				const dercursor controls) {
+	dercursor data [MAX_FIELDS];
+	int field;
+	if ((lazy->fields > MAX_FIELDS) ||
+			(lillyop_unpack (lazy->opcode, lazy->op, data, true) == -1)) {
+		fail ("Failed to unpack an operation");
+	}
+	for (field = lazy->fields - 1; field >= 0; field--) {
+		const dercursor *crs = lillylazy_field (lazy, field);
+		if (crs == NULL) {
+			fail ("Failed to decode a field lazily");
+		}
+		if ((crs->derptr != data [field].derptr) ||
+				(crs->derlen != data [field].derlen)) {
+			fail ("Lazy decoding found another field");
+		}
+	}
+	const dercursor *all = lillylazy_data (lazy);
+	if ((all == NULL) ||
+			(memcmp (all, data, lazy->fields * sizeof (dercursor)) != 0)) {
+		fail ("Lazy decoding found other data");
+	}
+	if (lazy->opcode == 3) {
+		check_children (lazy, LILLYLAZY_FIELD (SearchRequest, attributes));
+	} else if (lazy->opcode == 4) {
+		check_children (lazy, LILLYLAZY_FIELD (SearchResultEntry, attributes));
+	}
+	checked++;
+	lillymem_endpool (qpool);
+	return 0;
+}
+
+
+/* Load a file into memory allocated from the given pool.
+ */
+static uint8_t *load (LillyPool pool, char *filename, size_t *len) {
+	int fd = open (filename, O_RDONLY);
+	if (fd < 0) {
+		fail ("Failed to open an LDAPMessage file");
+	}
+	off_t size = lseek (fd, 0, SEEK_END);
+	uint8_t *buf = lillymem_alloc (pool, size);
+	if ((size < 0) || (buf == NULL) ||
+			(pread (fd, buf, size, 0) != size)) {
+		fail ("Failed to load an LDAPMessage file");
+	}
+	close (fd);
+	*len = size;
+	return buf;
+}
+
+
+static LillyLazyOpcode lazyregistry [31];
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	if (argc < 2) {
+		fprintf (stderr, "Usage: %s ldapmsg.bin...\n", progname);
+		exit (1);
+	}
+	lillymem_newpool_fun = sillymem_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc;
+	LillyPool lipo = lillymem_newpool ();
+	if (lipo == NULL) {
+		fail ("Failed to allocate a memory pool");
+	}
+	int i;
+	for (i = 0; i < 31; i++) {
+		lazyregistry [i] = check_lazy;
+	}
+	LDAP *lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	lil->def = &lillydap;
+	lil->def->lillyget_dercursor   = lillyget_dercursor;
+	lil->def->lillyget_ldapmessage = lillyget_ldapmessage;
+	lil->def->lillyget_opcode      = lillyget_opcode;
+	lil->def->lazyregistry         = lazyregistry;
+	lil->cnxpool = lipo;
+	lil->get_fd = lil->put_fd = -1;
+	for (i = 1; i < argc; i++) {
+		size_t len;
+		uint8_t *buf = load (lipo, argv [i], &len);
+		if (lillyget_netbytes (lil, buf, len) == -1) {
+			fail ("Failed to process an LDAPMessage");
+		}
+	}
+	if (checked == 0) {
+		fail ("No operations were checked");
+	}
+	printf ("Lazily decoded %d operations\n", checked);
+	lillymem_endpool (lipo);
+	exit (0);
+}
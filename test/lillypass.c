@@ -15,6 +15,14 @@
  *
  * TODO: level 4 has not been implemented yet.
  *
+ * The level may be preceded by flags that select connection modes:
+ *
+ *  -b. Read with LILLYCNX_GET_BUFFERED, so many messages per read()
+ *  -z. Read with LILLYCNX_GET_ZEROCOPY, so messages are not copied
+ *  -g. Write with LILLYCNX_PUT_GATHER, so many messages per writev()
+ *  -s. Split the input into reads of SPLIT_BYTES through a pipe, and
+ *      check that the output is the same as the input
+ *
  * Reading / writing is highly structured, so it can be used for testing.
  * For this reason, query IDs and times will not be randomly generated.
  * Note that some operations may not be supported -- which is then reported.
@@ -26,6 +34,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <errno.h>
 #include <fcntl.h>
@@ -37,6 +46,14 @@
 #include <quick-der/api.h>
 
 
+/* The number of bytes per read() under the -s flag, which is less than a
+ * header of 6 bytes, and cuts the short messages in the test data.
+ */
+#define SPLIT_BYTES 3
+
+static bool split = false;
+
+
 int lillypass_BindRequest (LDAP *lil,
 				LillyPool qpool,
 				const LillyMsgId msgid,
@@ -137,10 +154,72 @@ void process (LDAP *lil, char *progname, char *derfilename) {
 }
 
 
+/* Process the contents of a file that arrives SPLIT_BYTES at a time, with
+ * the reader run after every piece.  The output is collected in a pipe of
+ * its own, and must be the same as the input.
+ */
+void process_split (LDAP *lil, char *progname, char *derfilename) {
+	uint8_t input [4096];
+	uint8_t output [sizeof (input) + 1];
+	int fd = open (derfilename, O_RDONLY);
+	if (fd < 0) {
+		fprintf (stderr, "%s: Failed to open \"%s\"\n", progname, derfilename);
+		exit (1);
+	}
+	ssize_t inlen = read (fd, input, sizeof (input));
+	close (fd);
+	if (inlen <= 0) {
+		fprintf (stderr, "%s: Failed to read \"%s\"\n", progname, derfilename);
+		exit (1);
+	}
+	int inpipe [2], outpipe [2];
+	if ((pipe (inpipe) == -1) || (pipe (outpipe) == -1) ||
+			(fcntl (inpipe  [0], F_SETFL, O_NONBLOCK) == -1) ||
+			(fcntl (outpipe [0], F_SETFL, O_NONBLOCK) == -1) ||
+			(fcntl (outpipe [1], F_SETFL, O_NONBLOCK) == -1)) {
+		fprintf (stderr, "%s: Failed to setup pipes\n", progname);
+		exit (1);
+	}
+	lil->get_fd = inpipe [0];
+	lil->put_fd = outpipe [1];
+	//
+	// Feed the pieces, and process each before the next one comes
+	ssize_t ofs;
+	for (ofs = 0; ofs < inlen; ofs += SPLIT_BYTES) {
+		size_t piece = inlen - ofs;
+		if (piece > SPLIT_BYTES) {
+			piece = SPLIT_BYTES;
+		}
+		if (write (inpipe [1], input + ofs, piece) != piece) {
+			fprintf (stderr, "%s: Failed to feed the pipe\n", progname);
+			exit (1);
+		}
+		while (lillyget_event (lil) > 0) {
+			;
+		}
+		while (lillyput_event (lil) > 0) {
+			;
+		}
+	}
+	//
+	// Compare the output with the input
+	ssize_t outlen = read (outpipe [0], output, sizeof (output));
+	if ((outlen != inlen) || (memcmp (output, input, inlen) != 0)) {
+		fprintf (stderr, "%s: Output differs from \"%s\"\n", progname, derfilename);
+		exit (1);
+	}
+	close (inpipe [0]);
+	close (inpipe [1]);
+	close (outpipe [0]);
+	close (outpipe [1]);
+}
+
+
 void setup (void) {
 	lillymem_newpool_fun = sillymem_newpool;
 	lillymem_endpool_fun = sillymem_endpool;
 	lillymem_alloc_fun   = sillymem_alloc;
+	lillymem_atend_fun   = sillymem_atend;
 }
 
 
@@ -162,8 +241,25 @@ int main (int argc, char *argv []) {
 	//
 	// Check arguments
 	char *progname = argv [0];
+	uint16_t cnxflags = 0;
+	while ((argc > 1) && (argv [1] [0] == '-')) {
+		if (strcmp (argv [1], "-b") == 0) {
+			cnxflags |= LILLYCNX_GET_BUFFERED;
+		} else if (strcmp (argv [1], "-z") == 0) {
+			cnxflags |= LILLYCNX_GET_ZEROCOPY;
+		} else if (strcmp (argv [1], "-g") == 0) {
+			cnxflags |= LILLYCNX_PUT_GATHER;
+		} else if (strcmp (argv [1], "-s") == 0) {
+			split = true;
+		} else {
+			fprintf (stderr, "%s: Unknown flag %s\n", progname, argv [1]);
+			exit (1);
+		}
+		argv++;
+		argc--;
+	}
 	if (argc < 3) {
-		fprintf (stderr, "Usage: %s level ldapmsg.der...\nThe level is a value from 0 to 4, with increasing code being used\n", progname);
+		fprintf (stderr, "Usage: %s [-b|-z] [-g] [-s] level ldapmsg.der...\nThe level is a value from 0 to 4, with increasing code being used\n", progname);
 		exit (1);
 	}
 	//
@@ -181,6 +277,7 @@ int main (int argc, char *argv []) {
 	LDAP *lil;
 	lil = lillymem_alloc0 (lipo, sizeof (LDAP));
 	lil->def = &lillydap;
+	lil->flags = cnxflags;
 	//
 	// We first setup all operations to pass over to output directly...
 	lil->def->lillyget_dercursor   =
@@ -200,11 +297,11 @@ int main (int argc, char *argv []) {
 	switch (level) {
 	default:
 		fprintf (stderr, "%s: Invalid level '%s'\n",
-					argv [0], argv [1]);
+					progname, argv [1]);
 		exit (1);
 	case '4':
 		fprintf (stderr, "%s: Level 4 is not yet implemented\n",
-					argv [0]);
+					progname);
 		//TODO// Replace opregistry with control-unpackers-repackers
 		// and fallthrough...
 	case '3':
@@ -232,7 +329,11 @@ int main (int argc, char *argv []) {
 	// Iterate over the LDAP binary files in argv [1..]
 	int argi = 2;
 	while (argi < argc) {
-		process (lil, progname, argv [argi]);
+		if (split) {
+			process_split (lil, progname, argv [argi]);
+		} else {
+			process (lil, progname, argv [argi]);
+		}
 		argi++;
 	}
 
@@ -0,0 +1,160 @@
+/* memquota.c -- Test memory accounting and pool quotas.
+ *
+ * This enables memory accounting over sillymem, and checks that pools count
+ * their bytes and allocations, that the process-wide totals follow, and that
+ * allocations beyond a quota fail with ENOMEM.  It also checks that a
+ * message announcing a length beyond the quota is refused by the reader.
+ * Finally, messages that are held on to by the application charge to the
+ * cnxpool, and the reader refuses them beyond its cnxquota, until one is
+ * released.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+
+
+#define QUOTA 4096
+#define CNXQUOTA (7 * 1024)
+#define MSG_SIZE 2000
+#define NUM_HELD 4
+
+
+static void fail (char *progname, char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+static LillyPool held [NUM_HELD];
+static int numheld = 0;
+
+
+/* Hold on to received messages, as if the application were still busy
+ * with them.
+ */
+static int hold_message (LDAP *lil, LillyPool qpool, dercursor msg) {
+	if (numheld >= NUM_HELD) {
+		lillymem_endpool (qpool);
+		errno = EINVAL;
+		return -1;
+	}
+	held [numheld++] = qpool;
+	return 0;
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	char *progname = argv [0];
+	struct LillyMemStats stats;
+	struct LillyMemTotals totals;
+	lillymem_newpool_fun = sillymem_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc;
+	lillymem_atend_fun   = sillymem_atend;
+	lillymem_accounting (QUOTA);
+	//
+	// Allocate within and beyond the quota
+	LillyPool pool = lillymem_newpool ();
+	if (pool == NULL) {
+		fail (progname, "Failed to allocate a pool");
+	}
+	if ((lillymem_alloc (pool, 1000) == NULL) ||
+			(lillymem_alloc0 (pool, 2000) == NULL)) {
+		fail (progname, "Failed to allocate within the quota");
+	}
+	errno = 0;
+	if ((lillymem_alloc (pool, QUOTA) != NULL) || (errno != ENOMEM)) {
+		fail (progname, "Allocation beyond the quota should fail with ENOMEM");
+	}
+	if (!lillymem_poolstats (pool, &stats)) {
+		fail (progname, "Failed to retrieve pool statistics");
+	}
+	if ((stats.bytes != 3000) || (stats.allocs != 2) || (stats.quota != QUOTA)) {
+		fail (progname, "Pool statistics are wrong");
+	}
+	//
+	// Lift the quota
+	if (!lillymem_setquota (pool, 0) ||
+			(lillymem_alloc (pool, 100000) == NULL)) {
+		fail (progname, "Allocation without a quota should succeed");
+	}
+	lillymem_totals (&totals);
+	if ((totals.pools != 1) || (totals.kbytes != 101) || (totals.refused != 1)) {
+		fail (progname, "Process totals are wrong");
+	}
+	lillymem_endpool (pool);
+	lillymem_totals (&totals);
+	if ((totals.pools != 0) || (totals.kbytes != 0)) {
+		fail (progname, "Process totals should be empty after the pool ends");
+	}
+	//
+	// Refuse a message that is larger than the quota
+	LillyPool cnxpool = lillymem_newpool ();
+	LDAP *lil = lillymem_alloc0 (cnxpool, sizeof (LDAP));
+	lil->def = &lillydap;
+	lil->cnxpool = cnxpool;
+	lil->get_fd = lil->put_fd = -1;
+	static const uint8_t hugemsg [] = { 0x30, 0x83, 0x01, 0x00, 0x00, 0x02 };
+	errno = 0;
+	if ((lillyget_netbytes (lil, hugemsg, sizeof (hugemsg)) != -1) ||
+			(errno != ENOMEM)) {
+		fail (progname, "A message beyond the quota should fail with ENOMEM");
+	}
+	lillymem_endpool (cnxpool);
+	//
+	// Refuse messages beyond the cnxquota, while others are held on to
+	static uint8_t msg [4 + MSG_SIZE] = { 0x30, 0x82,
+				MSG_SIZE >> 8, MSG_SIZE & 0xff };
+	cnxpool = lillymem_newpool ();
+	lil = lillymem_alloc0 (cnxpool, sizeof (LDAP));
+	if ((lil == NULL) || !lillymem_setquota (cnxpool, 0) ||
+			!lillymem_setcnxquota (cnxpool, CNXQUOTA)) {
+		fail (progname, "Failed to setup a connection with a cnxquota");
+	}
+	lillydap.lillyget_dercursor = hold_message;
+	lil->def = &lillydap;
+	lil->cnxpool = cnxpool;
+	lil->get_fd = lil->put_fd = -1;
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (lillyget_netbytes (lil, msg, sizeof (msg)) == -1) {
+			fail (progname, "Failed to receive a message within the cnxquota");
+		}
+	}
+	if (!lillymem_poolstats (cnxpool, &stats) || (stats.cnxbytes != 3 * 2048) ||
+			(stats.cnxquota != CNXQUOTA)) {
+		fail (progname, "Connection statistics are wrong");
+	}
+	errno = 0;
+	if ((lillyget_netbytes (lil, msg, sizeof (msg)) != -1) ||
+			(errno != ENOMEM)) {
+		fail (progname, "A message beyond the cnxquota should fail with ENOMEM");
+	}
+	lillymem_endpool (held [--numheld]);
+	if (!lillymem_poolstats (cnxpool, &stats) || (stats.cnxbytes != 2 * 2048)) {
+		fail (progname, "Connection statistics did not drop with a message");
+	}
+	if (lillyget_netbytes (lil, msg, sizeof (msg)) == -1) {
+		fail (progname, "Failed to receive a message after one was released");
+	}
+	while (numheld > 0) {
+		lillymem_endpool (held [--numheld]);
+	}
+	if (!lillymem_poolstats (cnxpool, &stats) || (stats.cnxbytes != 0)) {
+		fail (progname, "Connection statistics should be empty after all messages");
+	}
+	lillymem_endpool (cnxpool);
+	exit (0);
+}
@@ -0,0 +1,245 @@
+/* msgalloc.c -- Count system allocations per LDAPMessage in steady state.
+ *
+ * This passes the LDAPMessages from the given files through LillyDAP over
+ * and over, using regionmem for all pools.  Messages are parsed down to
+ * their opcode and packed again, so every message has a qpool on the way
+ * in and another on the way out, and is written to /dev/null.
+ *
+ * After a warmup round, the pools should all come from the thread's pool
+ * cache and the chunks from the freelists, so that the number of chunks
+ * taken from the system per message is zero.  This is reported, along
+ * with the time per message, and anything but zero is a failure.
+ *
+ * With -a, chunks are carved from arenas that are backed by huge pages,
+ * with arenas per NUMA node.  On Linux, the data TLB misses per message
+ * are reported too, when the kernel permits counting them, to show the
+ * difference that this makes.
+ *
+ * Usage: msgalloc.test [-a] [rounds] ldapmsg.bin...
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#   include <sys/ioctl.h>
+#   include <sys/syscall.h>
+#   include <linux/perf_event.h>
+#endif
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+#include <lillydap/regionmem.h>
+
+#include <quick-der/api.h>
+
+
+#define WARMUP_ROUNDS 10
+
+
+static unsigned long messages = 0;
+
+static int count_dercursor (LDAP *lil, LillyPool qpool, dercursor dermsg) {
+	messages++;
+	return lillyget_dercursor (lil, qpool, dermsg);
+}
+
+
+static void fail (char *progname, char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+/* Start counting data TLB misses for this thread.  Returns the file
+ * descriptor of the counter, or -1 if it is not available.
+ */
+static int tlb_start (void) {
+#ifdef __linux__
+	struct perf_event_attr pea;
+	memset (&pea, 0, sizeof (pea));
+	pea.type = PERF_TYPE_HW_CACHE;
+	pea.size = sizeof (pea);
+	pea.config = PERF_COUNT_HW_CACHE_DTLB |
+			(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+			(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	pea.disabled = 1;
+	pea.exclude_kernel = 1;
+	pea.exclude_hv = 1;
+	int fd = syscall (SYS_perf_event_open, &pea, 0, -1, -1, 0);
+	if (fd >= 0) {
+		ioctl (fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl (fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+
+/* Stop counting data TLB misses, and return the count.
+ */
+static long long tlb_stop (int fd) {
+	long long count = -1;
+#ifdef __linux__
+	ioctl (fd, PERF_EVENT_IOC_DISABLE, 0);
+	if (read (fd, &count, sizeof (count)) != sizeof (count)) {
+		count = -1;
+	}
+	close (fd);
+#endif
+	return count;
+}
+
+
+/* Load a file into memory allocated from the given pool.
+ */
+static uint8_t *load (LillyPool pool, char *progname, char *filename, size_t *len) {
+	int fd = open (filename, O_RDONLY);
+	if (fd < 0) {
+		fail (progname, "Failed to open an LDAPMessage file");
+	}
+	off_t size = lseek (fd, 0, SEEK_END);
+	uint8_t *buf = lillymem_alloc (pool, size);
+	if ((size < 0) || (buf == NULL) ||
+			(pread (fd, buf, size, 0) != size)) {
+		fail (progname, "Failed to load an LDAPMessage file");
+	}
+	close (fd);
+	*len = size;
+	return buf;
+}
+
+
+/* Pass all files once through LillyDAP, and write out the result.
+ */
+static void round_trip (LDAP *lil, char *progname,
+				int filec, uint8_t **files, size_t *lens) {
+	int i;
+	for (i = 0; i < filec; i++) {
+		if (lillyget_netbytes (lil, files [i], lens [i]) == -1) {
+			fail (progname, "Failed to process an LDAPMessage");
+		}
+		while (lillyput_event (lil) != -1) {
+			;
+		}
+		if (errno != EAGAIN) {
+			fail (progname, "Failed to write an LDAPMessage");
+		}
+	}
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	char *progname = argv [0];
+	int rounds = 10000;
+	bool arenas = false;
+	if ((argc > 1) && (strcmp (argv [1], "-a") == 0)) {
+		arenas = true;
+		argv++;
+		argc--;
+	}
+	if ((argc > 1) && (strspn (argv [1], "0123456789") == strlen (argv [1]))) {
+		rounds = atoi (argv [1]);
+		argv++;
+		argc--;
+	}
+	if ((argc < 2) || (rounds <= 0)) {
+		fprintf (stderr, "Usage: %s [-a] [rounds] ldapmsg.bin...\n", progname);
+		exit (1);
+	}
+	if (arenas) {
+		regionmem_arenas (REGIONMEM_HUGEPAGES | REGIONMEM_NUMANODES);
+	}
+	regionmem_setup ();
+	LillyPool lipo = lillymem_newpool ();
+	if (lipo == NULL) {
+		fail (progname, "Failed to allocate a memory pool");
+	}
+	//
+	// Load the files into memory
+	int filec = argc - 1;
+	uint8_t **files = lillymem_alloc (lipo, filec * sizeof (uint8_t *));
+	size_t *lens = lillymem_alloc (lipo, filec * sizeof (size_t));
+	int i;
+	for (i = 0; i < filec; i++) {
+		files [i] = load (lipo, progname, argv [1 + i], &lens [i]);
+	}
+	//
+	// Setup the connection to parse down to the opcode and pass back
+	LDAP *lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	lil->def = &lillydap;
+	lil->def->lillyget_dercursor   = count_dercursor;
+	lil->def->lillyput_dercursor   = lillyput_dercursor;
+	lil->def->lillyget_ldapmessage = lillyget_ldapmessage;
+	lil->def->lillyput_ldapmessage = lillyput_ldapmessage;
+	lil->def->lillyget_opcode      =
+	lil->def->lillyput_opcode      = lillyput_opcode;
+	lil->def->lillyget_operation   =
+	lil->def->lillyput_operation   = lillyput_operation;
+	lil->cnxpool = lillymem_newpool ();
+	if (lil->cnxpool == NULL) {
+		fail (progname, "Failed to allocate connection memory pool");
+	}
+	lil->get_fd = -1;
+	lil->put_fd = open ("/dev/null", O_WRONLY);
+	if (lil->put_fd < 0) {
+		fail (progname, "Failed to open /dev/null");
+	}
+	//
+	// Warm up the pool cache and freelists
+	for (i = 0; i < WARMUP_ROUNDS; i++) {
+		round_trip (lil, progname, filec, files, lens);
+	}
+	//
+	// Measure the steady state
+	struct regionmem_stats before, after;
+	struct timespec t0, t1;
+	regionmem_stats (&before);
+	unsigned long msgs0 = messages;
+	int tlbfd = tlb_start ();
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < rounds; i++) {
+		round_trip (lil, progname, filec, files, lens);
+	}
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	long long tlbmisses = (tlbfd >= 0) ? tlb_stop (tlbfd) : -1;
+	regionmem_stats (&after);
+	unsigned long msgs = messages - msgs0;
+	if (msgs == 0) {
+		fail (progname, "No LDAPMessages were processed");
+	}
+	double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+	int sysallocs = after.sysallocs - before.sysallocs;
+	printf ("%lu messages, %.1f ns per message, %.6f system allocations per message\n",
+			msgs, ns / msgs, ((double) sysallocs) / msgs);
+	if (tlbmisses >= 0) {
+		printf ("%.3f data TLB misses per message, %s\n",
+			((double) tlbmisses) / msgs,
+			arenas ? "with huge page arenas" : "without arenas");
+	} else {
+		printf ("Data TLB misses cannot be counted here\n");
+	}
+	//
+	// Cleanup and exit
+	close (lil->put_fd);
+	lillymem_endpool (lil->cnxpool);
+	lillymem_endpool (lipo);
+	if (sysallocs != 0) {
+		fail (progname, "Steady state should not allocate from the system");
+	}
+	exit (0);
+}
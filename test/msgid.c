@@ -0,0 +1,274 @@
+/* msgid.c -- Test the MessageID table under concurrent use.
+ *
+ * A number of threads allocate many MessageID values on one connection,
+ * so the table has to grow while they are at it.  Every thread checks that
+ * its values are marked as internal, that their qpools can be found, and
+ * then frees them in an order of its own, checking that they are gone.
+ * The values of all threads must be unique.  Then, all threads free
+ * the same MessageID values at once, and each qpool must end only once.
+ * Finally, half the threads expire shared MessageID values while the
+ * other half deliver their final responses, and each request must end
+ * up with either a timeout or a response, never both.
+ *
+ * Usage: msgid.test [threads [outstanding]]
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+#include <lillydap/regionmem.h>
+
+#ifndef CONFIG_SINGLE_THREADED
+#   include <pthread.h>
+#endif
+
+
+static char *progname;
+static LDAP *lil;
+static int outstanding = 5000;
+static LillyMsgId *allids;
+static LillyMsgId *sharedids;
+static lillydap_endpool endpool_inner;
+static int endpools = 0;
+static int responses = 0;
+static int timeouts = 0;
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+static void *worker (void *threadnr) {
+	int nr = (int) (intptr_t) threadnr;
+	LillyMsgId *ids = &allids [nr * outstanding];
+	LillyPool *pools = calloc (outstanding, sizeof (LillyPool));
+	int i;
+	if (pools == NULL) {
+		fail ("Out of memory");
+	}
+	for (i = 0; i < outstanding; i++) {
+		ids [i] = lillymsg_id_alloc (lil, &pools [i]);
+		if ((ids [i] == 0) || (pools [i] == NULL)) {
+			fail ("Failed to allocate a MessageID");
+		}
+		if ((ids [i] & 0x80000000) == 0) {
+			fail ("MessageID is not marked as internal");
+		}
+	}
+	for (i = 0; i < outstanding; i++) {
+		if (lillymsg_id_qpool (lil, ids [i]) != pools [i]) {
+			fail ("MessageID does not find its qpool");
+		}
+	}
+	// Free every other one first, then the rest
+	for (i = nr & 1; i < outstanding; i += 2) {
+		lillymsg_id_free (lil, ids [i]);
+	}
+	for (i = 1 - (nr & 1); i < outstanding; i += 2) {
+		if (lillymsg_id_qpool (lil, ids [i]) != pools [i]) {
+			fail ("MessageID lost its qpool when others were freed");
+		}
+		lillymsg_id_free (lil, ids [i]);
+	}
+	for (i = 0; i < outstanding; i++) {
+		if (lillymsg_id_qpool (lil, ids [i]) != NULL) {
+			fail ("MessageID is still found after it was freed");
+		}
+	}
+	free (pools);
+	return NULL;
+}
+
+
+/* Count the pools that are ended, to see that none ends twice.
+ */
+static void count_endpool (LillyPool pool) {
+	__sync_fetch_and_add (&endpools, 1);
+	endpool_inner (pool);
+}
+
+
+/* Free all the shared MessageID values, in competition with the other
+ * threads that do the same.
+ */
+static void *racer (void *threadnr) {
+	int i;
+	for (i = 0; i < outstanding; i++) {
+		lillymsg_id_free (lil, sharedids [i]);
+	}
+	return NULL;
+}
+
+
+/* Count final responses, and those that found no request to go with.
+ */
+static int count_response (LDAP *lil, LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor *data,
+				const dercursor controls,
+				void *cbdata) {
+	__sync_fetch_and_add (&responses, 1);
+	lillymem_endpool (qpool);
+	return 0;
+}
+
+static int count_stray (LDAP *lil, LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor *data,
+				const dercursor controls) {
+	lillymem_endpool (qpool);
+	return 0;
+}
+
+static void count_timeout (LDAP *lil, LillyMsgId mid) {
+	__sync_fetch_and_add (&timeouts, 1);
+}
+
+
+/* Expire the shared MessageID values, or deliver their final responses,
+ * in competition with the other threads.
+ */
+static void *expirer (void *threadnr) {
+	int nr = (int) (intptr_t) threadnr;
+	dercursor nocontrols = { .derptr = NULL, .derlen = 0 };
+	int i;
+	for (i = 0; i < outstanding; i++) {
+		if (nr & 1) {
+			lillyget_correlate (lil, lillymem_newpool (),
+					sharedids [i] & 0x7fffffff,
+					1, NULL, nocontrols);
+		} else {
+			lillymsg_id_expire (lil, sharedids [i]);
+		}
+	}
+	return NULL;
+}
+
+
+static int cmpids (const void *a, const void *b) {
+	LillyMsgId ida = * (const LillyMsgId *) a;
+	LillyMsgId idb = * (const LillyMsgId *) b;
+	return (ida > idb) - (ida < idb);
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	int threads = 8;
+	if (argc > 1) {
+		threads = atoi (argv [1]);
+	}
+	if (argc > 2) {
+		outstanding = atoi (argv [2]);
+	}
+	if ((threads < 1) || (outstanding < 1)) {
+		fprintf (stderr, "Usage: %s [threads [outstanding]]\n", progname);
+		exit (1);
+	}
+#ifdef CONFIG_SINGLE_THREADED
+	threads = 1;
+#endif
+	regionmem_setup ();
+	LillyPool lipo = lillymem_newpool ();
+	lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	allids = lillymem_alloc (lipo, threads * outstanding * sizeof (LillyMsgId));
+	if ((lil == NULL) || (allids == NULL)) {
+		fail ("Failed to allocate memory");
+	}
+	lil->def = &lillydap;
+	lil->cnxpool = lillymem_newpool ();
+	int t;
+#ifdef CONFIG_SINGLE_THREADED
+	worker ((void *) 0);
+#else
+	pthread_t thr [threads];
+	for (t = 0; t < threads; t++) {
+		if (pthread_create (&thr [t], NULL, worker, (void *) (intptr_t) t) != 0) {
+			fail ("Failed to start a thread");
+		}
+	}
+	for (t = 0; t < threads; t++) {
+		pthread_join (thr [t], NULL);
+	}
+#endif
+	qsort (allids, threads * outstanding, sizeof (LillyMsgId), cmpids);
+	for (t = 1; t < threads * outstanding; t++) {
+		if (allids [t] == allids [t - 1]) {
+			fail ("MessageID was handed out twice");
+		}
+	}
+	//
+	// Have all threads free the same MessageID values at once
+	sharedids = allids;
+	int i;
+	for (i = 0; i < outstanding; i++) {
+		sharedids [i] = lillymsg_id_alloc (lil, NULL);
+		if (sharedids [i] == 0) {
+			fail ("Failed to allocate a shared MessageID");
+		}
+	}
+	endpool_inner = lillymem_endpool_fun;
+	lillymem_endpool_fun = count_endpool;
+#ifdef CONFIG_SINGLE_THREADED
+	racer ((void *) 0);
+	racer ((void *) 1);
+#else
+	for (t = 0; t < threads; t++) {
+		if (pthread_create (&thr [t], NULL, racer, (void *) (intptr_t) t) != 0) {
+			fail ("Failed to start a thread");
+		}
+	}
+	for (t = 0; t < threads; t++) {
+		pthread_join (thr [t], NULL);
+	}
+#endif
+	lillymem_endpool_fun = endpool_inner;
+	if (endpools != outstanding) {
+		fail ("A shared MessageID did not end its qpool exactly once");
+	}
+	//
+	// Have threads race to expire or answer the same MessageID values
+	lillydap.lillyget_operation = count_stray;
+	lillydap.lillymsg_timeout = count_timeout;
+	for (i = 0; i < outstanding; i++) {
+		sharedids [i] = lillymsg_id_alloc_cb (lil, NULL, count_response, NULL);
+		if (sharedids [i] == 0) {
+			fail ("Failed to allocate a shared MessageID");
+		}
+	}
+#ifdef CONFIG_SINGLE_THREADED
+	expirer ((void *) 0);
+	expirer ((void *) 1);
+#else
+	for (t = 0; t < threads; t++) {
+		if (pthread_create (&thr [t], NULL, expirer, (void *) (intptr_t) t) != 0) {
+			fail ("Failed to start a thread");
+		}
+	}
+	if (threads == 1) {
+		expirer ((void *) 1);
+	}
+	for (t = 0; t < threads; t++) {
+		pthread_join (thr [t], NULL);
+	}
+#endif
+	if (responses + timeouts != outstanding) {
+		fail ("A shared MessageID did not get one timeout or one response");
+	}
+	lillymem_endpool (lil->cnxpool);
+	lillymem_endpool (lipo);
+	exit (0);
+}
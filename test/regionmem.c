@@ -0,0 +1,217 @@
+/* regionmem.c -- Test the region allocator for LillyDAP pools.
+ *
+ * This allocates a variety of sizes and alignments from many pools, and
+ * checks that allocations are aligned, do not overlap, that zeroed memory
+ * really is zero (also in chunks that were recycled dirty), and that
+ * cleanup routines run in reverse order when a pool ends.
+ *
+ * With the argument "arenas", chunks are carved from arenas backed by huge
+ * pages, with arenas per NUMA node.
+ *
+ * With threads, it also checks that pools ended by another thread go back
+ * to the thread that created them, so it can reuse them without asking the
+ * system for more memory.
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <lillydap/mem.h>
+#include <lillydap/regionmem.h>
+
+#ifndef CONFIG_SINGLE_THREADED
+#   include <pthread.h>
+#endif
+
+
+#define NUM_POOLS 100
+#define NUM_ALLOCS 500
+
+
+static int cleanup_order [3];
+static int cleanup_count = 0;
+
+static void cleanup (void *cbdata) {
+	cleanup_order [cleanup_count++] = (int) (intptr_t) cbdata;
+}
+
+
+static void fail (char *progname, char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+#ifndef CONFIG_SINGLE_THREADED
+
+/* The creator thread makes pools and hands them to the main thread, which
+ * ends them.  The creator then makes as many pools once more, and these
+ * should be the same pools.
+ */
+#define NUM_REMOTE 200
+
+static LillyPool remote_pools [NUM_REMOTE];
+static pthread_barrier_t remote_barrier;
+static int remote_reused;
+
+static void *creator (void *progname) {
+	LillyPool earlier [NUM_REMOTE];
+	int round, p, q;
+	for (round = 0; round < 2; round++) {
+		remote_reused = 0;
+		for (p = 0; p < NUM_REMOTE; p++) {
+			remote_pools [p] = lillymem_newpool ();
+			if ((remote_pools [p] == NULL) ||
+			    (lillymem_alloc (remote_pools [p], 100) == NULL)) {
+				fail (progname, "Failed to allocate in a creator thread");
+			}
+			for (q = 0; (round > 0) && (q < NUM_REMOTE); q++) {
+				if (remote_pools [p] == earlier [q]) {
+					remote_reused++;
+					break;
+				}
+			}
+		}
+		memcpy (earlier, remote_pools, sizeof (earlier));
+		pthread_barrier_wait (&remote_barrier);
+		pthread_barrier_wait (&remote_barrier);
+	}
+	return NULL;
+}
+
+static void remote_return (char *progname) {
+	pthread_t thr;
+	int round, p;
+	pthread_barrier_init (&remote_barrier, NULL, 2);
+	if (pthread_create (&thr, NULL, creator, progname) != 0) {
+		fail (progname, "Failed to start a creator thread");
+	}
+	for (round = 0; round < 2; round++) {
+		pthread_barrier_wait (&remote_barrier);
+		if ((round == 1) && (remote_reused != NUM_REMOTE)) {
+			fail (progname, "Pools ended by another thread were not reused");
+		}
+		for (p = 0; p < NUM_REMOTE; p++) {
+			lillymem_endpool (remote_pools [p]);
+		}
+		regionmem_flush ();
+		pthread_barrier_wait (&remote_barrier);
+	}
+	pthread_join (thr, NULL);
+	pthread_barrier_destroy (&remote_barrier);
+}
+
+#endif
+
+
+int main (int argc, char *argv []) {
+	char *progname = argv [0];
+	int round, p, i;
+	if ((argc > 1) && (strcmp (argv [1], "arenas") == 0)) {
+		regionmem_arenas (REGIONMEM_HUGEPAGES | REGIONMEM_NUMANODES);
+	}
+	regionmem_setup ();
+	if (!lillymem_poolhead_abi) {
+		fail (progname, "Pools should allow inline allocation");
+	}
+	srandom (1);
+	for (round = 0; round < 3; round++) {
+		LillyPool pools [NUM_POOLS];
+		for (p = 0; p < NUM_POOLS; p++) {
+			pools [p] = lillymem_newpool ();
+			if (pools [p] == NULL) {
+				fail (progname, "Failed to allocate a pool");
+			}
+			uint8_t *mems [NUM_ALLOCS];
+			size_t szs [NUM_ALLOCS];
+			for (i = 0; i < NUM_ALLOCS; i++) {
+				size_t sz = random () % ((i % 50 == 0) ? 300000 : 200);
+				uint8_t *mem;
+				if (i % 7 == 0) {
+					size_t align = 1 << (random () % 13);
+					mem = regionmem_alloc_aligned (pools [p], sz, align);
+					if (((uintptr_t) mem) & (align - 1)) {
+						fail (progname, "Misaligned allocation");
+					}
+				} else if (i % 3 == 0) {
+					mem = lillymem_alloc0 (pools [p], sz);
+					size_t j;
+					for (j = 0; j < sz; j++) {
+						if (mem [j] != 0x00) {
+							fail (progname, "Zeroed memory is not zero");
+						}
+					}
+				} else {
+					mem = lillymem_alloc (pools [p], sz);
+				}
+				if (mem == NULL) {
+					fail (progname, "Failed to allocate memory");
+				}
+				if (((uintptr_t) mem) & (REGIONMEM_ALIGN - 1)) {
+					fail (progname, "Allocation not aligned");
+				}
+				// Dirty the memory, so recycled chunks are not clear
+				memset (mem, 0x80 | i, sz);
+				mems [i] = mem;
+				szs  [i] = sz;
+			}
+			for (i = 0; i < NUM_ALLOCS; i++) {
+				size_t j;
+				for (j = 0; j < szs [i]; j++) {
+					if (mems [i] [j] != (uint8_t) (0x80 | i)) {
+						fail (progname, "Allocations overlap");
+					}
+				}
+			}
+		}
+		for (p = 0; p < NUM_POOLS; p++) {
+			lillymem_endpool (pools [p]);
+		}
+	}
+	//
+	// Check that sizes near SIZE_MAX are refused, not wrapped around
+	LillyPool pool = lillymem_newpool ();
+	size_t huge [] = { SIZE_MAX, SIZE_MAX - 7, SIZE_MAX - 31 };
+	for (i = 0; i < 3; i++) {
+		errno = 0;
+		if ((lillymem_alloc (pool, huge [i]) != NULL) || (errno != ENOMEM)) {
+			fail (progname, "A huge allocation did not fail with ENOMEM");
+		}
+		errno = 0;
+		if ((lillymem_alloc0 (pool, huge [i]) != NULL) || (errno != ENOMEM)) {
+			fail (progname, "A huge zeroed allocation did not fail with ENOMEM");
+		}
+		errno = 0;
+		if ((regionmem_alloc_aligned (pool, huge [i], 4096) != NULL) ||
+				(errno != ENOMEM)) {
+			fail (progname, "A huge aligned allocation did not fail with ENOMEM");
+		}
+	}
+	lillymem_endpool (pool);
+	//
+	// Check that cleanup routines run in reverse order
+	pool = lillymem_newpool ();
+	for (i = 0; i < 3; i++) {
+		if (!lillymem_atend (pool, cleanup, (void *) (intptr_t) i)) {
+			fail (progname, "Failed to register a cleanup routine");
+		}
+	}
+	lillymem_endpool (pool);
+	if ((cleanup_count != 3) || (cleanup_order [0] != 2) ||
+			(cleanup_order [1] != 1) || (cleanup_order [2] != 0)) {
+		fail (progname, "Cleanup routines did not run in reverse order");
+	}
+#ifndef CONFIG_SINGLE_THREADED
+	//
+	// Check that pools return to the thread that created them
+	remote_return (progname);
+#endif
+	exit (0);
+}
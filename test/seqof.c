@@ -0,0 +1,178 @@
+/* seqof.c -- Check the arrays for SEQUENCE OF and SET OF fields.
+ *
+ * The LDAPMessages from the given files are passed through LillyDAP with
+ * all opcodes set in seqof_unpack.  The arrays that lillyget_operation()
+ * receives after the overlay are compared with the collections that they
+ * were unpacked from, by walking those once more.
+ *
+ * Usage: seqof.test ldapmsg.bin...
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+
+#include <quick-der/api.h>
+
+
+static char *progname;
+static int checked = 0;
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+/* Check that an array has one element per element of a collection, and
+ * return the element cursors of the collection in elems.
+ */
+static size_t check_count (const LillyArray *array, dercursor coll,
+				dercursor *elems, size_t max) {
+	size_t count = 0;
+	while (coll.derlen > 0) {
+		if (count == max) {
+			fail ("Too many elements in a collection");
+		}
+		elems [count] = coll;
+		if (der_skip (&coll) == -1) {
+			fail ("Failed to skip over an element");
+		}
+		elems [count].derlen -= coll.derlen;
+		count++;
+	}
+	if (array->count != count) {
+		fail ("Array size differs from collection size");
+	}
+	if ((count == 0) != (array->elems == NULL)) {
+		fail ("Array elements are not set as expected");
+	}
+	return count;
+}
+
+
+/* Check the values of an attribute.
+ */
+static void check_vals (const LillyArray *vals, dercursor coll) {
+	dercursor elems [256];
+	size_t count = check_count (vals, coll, elems, 256);
+	const DER_OVLY_rfc4511_AttributeValue *val = vals->elems;
+	size_t i;
+	for (i = 0; i < count; i++) {
+		if ((val [i].derptr < elems [i].derptr) ||
+				(val [i].derptr + val [i].derlen !=
+				 elems [i].derptr + elems [i].derlen)) {
+			fail ("Attribute value is not in its element");
+		}
+	}
+}
+
+
+static int check_arrays (LDAP *lil,
+				LillyPool qpool,
+				const LillyMsgId msgid,
+				const uint8_t opcode,
+				const dercursor *data,
+				const dercursor controls) {
+	dercursor elems [256];
+	size_t count, i;
+	if (opcode == 3) {
+		const LillyArrays_SearchRequest *sr = (void *) data;
+		count = check_count (&sr->attributes, sr->op.attributes, elems, 256);
+		const DER_OVLY_rfc4511_LDAPString *attr = sr->attributes.elems;
+		for (i = 0; i < count; i++) {
+			if (attr [i].derptr + attr [i].derlen !=
+					elems [i].derptr + elems [i].derlen) {
+				fail ("Attribute selector is not in its element");
+			}
+		}
+		checked++;
+	} else if (opcode == 4) {
+		const LillyArrays_SearchResultEntry *sre = (void *) data;
+		count = check_count (&sre->attributes, sre->op.attributes, elems, 256);
+		const LillyElem_PartialAttribute *attr = sre->attributes.elems;
+		for (i = 0; i < count; i++) {
+			if ((attr [i].attr.type.derptr < elems [i].derptr) ||
+					(attr [i].attr.vals.derptr + attr [i].attr.vals.derlen !=
+					 elems [i].derptr + elems [i].derlen)) {
+				fail ("Attribute is not in its element");
+			}
+			check_vals (&attr [i].vals, attr [i].attr.vals);
+		}
+		checked++;
+	}
+	lillymem_endpool (qpool);
+	return 0;
+}
+
+
+/* Load a file into memory allocated from the given pool.
+ */
+static uint8_t *load (LillyPool pool, char *filename, size_t *len) {
+	int fd = open (filename, O_RDONLY);
+	if (fd < 0) {
+		fail ("Failed to open an LDAPMessage file");
+	}
+	off_t size = lseek (fd, 0, SEEK_END);
+	uint8_t *buf = lillymem_alloc (pool, size);
+	if ((size < 0) || (buf == NULL) ||
+			(pread (fd, buf, size, 0) != size)) {
+		fail ("Failed to load an LDAPMessage file");
+	}
+	close (fd);
+	*len = size;
+	return buf;
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	if (argc < 2) {
+		fprintf (stderr, "Usage: %s ldapmsg.bin...\n", progname);
+		exit (1);
+	}
+	lillymem_newpool_fun = sillymem_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc;
+	LillyPool lipo = lillymem_newpool ();
+	if (lipo == NULL) {
+		fail ("Failed to allocate a memory pool");
+	}
+	LDAP *lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	lil->def = &lillydap;
+	lil->def->seqof_unpack [0]     = 0xffffffff;
+	lil->def->lillyget_dercursor   = lillyget_dercursor;
+	lil->def->lillyget_ldapmessage = lillyget_ldapmessage;
+	lil->def->lillyget_opcode      = lillyget_opcode;
+	lil->def->lillyget_operation   = check_arrays;
+	lil->cnxpool = lipo;
+	lil->get_fd = lil->put_fd = -1;
+	int i;
+	for (i = 1; i < argc; i++) {
+		size_t len;
+		uint8_t *buf = load (lipo, argv [i], &len);
+		if (lillyget_netbytes (lil, buf, len) == -1) {
+			fail ("Failed to process an LDAPMessage");
+		}
+	}
+	if (checked == 0) {
+		fail ("No collections were checked");
+	}
+	printf ("Checked the arrays of %d operations\n", checked);
+	lillymem_endpool (lipo);
+	exit (0);
+}
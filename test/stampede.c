@@ -24,6 +24,17 @@
  * of 3 at a time; as a result, 0-2 should appear in one sequence, and so
  * should 3-5 and 6-8, and os on.  The last bits may be different.
  *
+ * The threads may enqueue their messages one by one, or they may link them
+ * into a chain and append it with lillyput_enqueue_chain().  This is set
+ * with a second argument "single" or "chain", and the time it takes for
+ * all threads to enqueue is reported on stderr, to compare the two.  The
+ * report includes the latency of enqueueing, with its tail percentiles,
+ * and how often the queue had to wait while spinning, yielding or parked.
+ *
+ * The second argument "scale" runs the stampede in single mode for 1, 2,
+ * 4, ... up to the given number of threads, writing to /dev/null.  This
+ * shows how throughput and tail latency develop with more producers.
+ *
  * From: Rick van Rein <rick@openfortress.nl>
  */
 
@@ -31,6 +42,9 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
 
 #include <errno.h>
 #include <fcntl.h>
@@ -60,6 +74,31 @@ static pthread_barrier_t cowshed_door;
 // The earmark counter provides each cattle with their unique serial number
 static OPA_int_t earmark_counter = { 0 };
 
+// The number of LillySend structures that each of the cattle enqueues
+#define NUM_LISE ((1000+2)/3)
+
+// The cattle may run in a chain, and the time they are done is noted
+static bool chained = false;
+static struct timespec *go_time, *done_time;
+
+// The latency of each enqueue operation, in nanoseconds
+static uint32_t *latency;
+
+
+// Nanoseconds from one timespec to another
+static int64_t nanodiff (struct timespec *from, struct timespec *upto) {
+	return (upto->tv_sec  - from->tv_sec ) * 1000000000LL +
+	       (upto->tv_nsec - from->tv_nsec);
+}
+
+
+// Sort latencies in rising order
+static int latency_cmp (const void *a, const void *b) {
+	uint32_t la = * (const uint32_t *) a;
+	uint32_t lb = * (const uint32_t *) b;
+	return (la > lb) - (la < lb);
+}
+
 
 void *cattle (void *nullarg) {
 	int thrid = OPA_fetch_and_incr_int (&earmark_counter);
@@ -101,9 +140,25 @@ void *cattle (void *nullarg) {
 	pthread_barrier_wait (&electric_fence);
 	//
 	// The stampede is on!  As soon as possible, deliver your dung
-	for (i=0; i<(1000+2)/3; i++) {
-		lillyput_enqueue (&lil, lise [i]);
+	struct timespec t0, t1;
+	clock_gettime (CLOCK_MONOTONIC, &go_time [thrid]);
+	if (chained) {
+		for (i=0; i<NUM_LISE-1; i++) {
+			lise [i]->put_qnext = lise [i+1];
+		}
+		clock_gettime (CLOCK_MONOTONIC, &t0);
+		lillyput_enqueue_chain (&lil, lise [0], lise [NUM_LISE-1]);
+		clock_gettime (CLOCK_MONOTONIC, &t1);
+		latency [thrid] = nanodiff (&t0, &t1);
+	} else {
+		for (i=0; i<NUM_LISE; i++) {
+			clock_gettime (CLOCK_MONOTONIC, &t0);
+			lillyput_enqueue (&lil, lise [i]);
+			clock_gettime (CLOCK_MONOTONIC, &t1);
+			latency [thrid * NUM_LISE + i] = nanodiff (&t0, &t1);
+		}
 	}
+	clock_gettime (CLOCK_MONOTONIC, &done_time [thrid]);
 	//
 	// Once we're done, we line up in front of the cowshed's door
 	pthread_barrier_wait (&cowshed_door);
@@ -113,25 +168,15 @@ void *cattle (void *nullarg) {
 }
 
 
-int main (int argc, char *argv []) {
-	int nthr = 10000;
-	int thr;
+/* Run one stampede with the given number of threads, and report on it.
+ */
+void stampede (char *progname, int nthr) {
 	int i;
-	//
-	// Memory functions are plain silly
-	lillymem_newpool_fun = sillymem_newpool;
-	lillymem_endpool_fun = sillymem_endpool;
-	lillymem_alloc_fun   = sillymem_alloc  ;
-	//
-	// Parse a few commandline arguments
-	if (argc >= 2) {
-		nthr = atoi (argv [1]);
-	}
-	if ((argc >= 3) || (nthr <= 0)) {
-		fprintf (stderr, "Usage: %s [num_threads]\n", argv [0]);
+	pthread_t *herd = calloc (nthr, sizeof (pthread_t));
+	if (herd == NULL) {
+		perror ("Error allocating thread table");
 		exit (1);
 	}
-
 	//
 	// Raise the electric_fence for the herd of cattle to be held back
 	pthread_barrier_init (&electric_fence, NULL, nthr+1);
@@ -140,12 +185,13 @@ int main (int argc, char *argv []) {
 	pthread_barrier_init (&cowshed_door, NULL, nthr+1);
 	//
 	// Construct the earmark_counter that cattle use to get their number
-	//static// earmark_counter = 0;
+	OPA_store_int (&earmark_counter, 0);
+	struct LillyPutContention before;
+	lillyput_contention (&lil, &before);
 	//
 	// Create the cattle
 	for (i=0; i<nthr; i++) {
-		pthread_t thr;
-		if (pthread_create (&thr, NULL, cattle, NULL) != 0) {
+		if (pthread_create (&herd [i], NULL, cattle, NULL) != 0) {
 			perror ("Error creating thread");
 			exit (1);
 		}
@@ -161,9 +207,106 @@ int main (int argc, char *argv []) {
 	//
 	// End the stampede together, by forcing the cowshed door open as one
 	pthread_barrier_wait (&cowshed_door);
+	for (i=0; i<nthr; i++) {
+		pthread_join (herd [i], NULL);
+	}
+	//
+	// Shovel out what the event loop did not get to yet
+	while ((lillyput_event (&lil) >= 0) || lillyput_cansend (&lil)) {
+		;
+	}
+	//
+	// Report how long it took from the first start to the last finish
+	struct timespec *first_go = &go_time [0];
+	struct timespec *last_done = &done_time [0];
+	for (i=1; i<nthr; i++) {
+		if (nanodiff (&go_time [i], first_go) > 0) {
+			first_go = &go_time [i];
+		}
+		if (nanodiff (last_done, &done_time [i]) > 0) {
+			last_done = &done_time [i];
+		}
+	}
+	int64_t maxdone = nanodiff (first_go, last_done);
+	int nlat = chained ? nthr : nthr * NUM_LISE;
+	qsort (latency, nlat, sizeof (uint32_t), latency_cmp);
+	struct LillyPutContention after;
+	lillyput_contention (&lil, &after);
+	fprintf (stderr, "%s: %d threads enqueued %d items in %s mode in %.6f s, %.0f items/s\n",
+			progname, nthr, nthr * NUM_LISE,
+			chained ? "chain" : "single",
+			maxdone * 1e-9, nthr * NUM_LISE / (maxdone * 1e-9));
+	fprintf (stderr, "%s: enqueue latency p50 %u ns, p99 %u ns, p99.9 %u ns, max %u ns\n",
+			progname,
+			latency [nlat / 2],
+			latency [(int) (nlat * 0.99)],
+			latency [(int) (nlat * 0.999)],
+			latency [nlat - 1]);
+	fprintf (stderr, "%s: contended waits %d spun, %d yielded, %d parked\n",
+			progname,
+			after.spun    - before.spun,
+			after.yielded - before.yielded,
+			after.parked  - before.parked);
 	//
 	// Cleanup
 	pthread_barrier_destroy (&electric_fence);
 	pthread_barrier_destroy (&cowshed_door);
+	free (herd);
 }
 
+
+int main (int argc, char *argv []) {
+	int nthr = 10000;
+	bool scale = false;
+	//
+	// Memory functions are plain silly
+	lillymem_newpool_fun = sillymem_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc  ;
+	//
+	// Parse a few commandline arguments
+	if (argc >= 2) {
+		nthr = atoi (argv [1]);
+	}
+	if (argc >= 3) {
+		if (strcmp (argv [2], "chain") == 0) {
+			chained = true;
+		} else if (strcmp (argv [2], "scale") == 0) {
+			scale = true;
+		} else if (strcmp (argv [2], "single") != 0) {
+			nthr = 0;
+		}
+	}
+	if ((argc >= 4) || (nthr <= 0)) {
+		fprintf (stderr, "Usage: %s [num_threads [single|chain|scale]]\n", argv [0]);
+		exit (1);
+	}
+	go_time   = calloc (nthr, sizeof (struct timespec));
+	done_time = calloc (nthr, sizeof (struct timespec));
+	latency = calloc (nthr * NUM_LISE, sizeof (uint32_t));
+	if ((go_time == NULL) || (done_time == NULL) || (latency == NULL)) {
+		perror ("Error allocating timing table");
+		exit (1);
+	}
+	//
+	// Run one stampede, or a series of them with more and more threads
+	if (scale) {
+		lil.put_fd = open ("/dev/null", O_WRONLY);
+		if (lil.put_fd < 0) {
+			perror ("Error opening /dev/null");
+			exit (1);
+		}
+		int herdsize = 1;
+		while (herdsize < nthr) {
+			stampede (argv [0], herdsize);
+			herdsize *= 2;
+		}
+	}
+	stampede (argv [0], nthr);
+	//
+	// Cleanup
+	free (go_time);
+	free (done_time);
+	free (latency);
+	return 0;
+}
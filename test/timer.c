@@ -0,0 +1,190 @@
+/* timer.c -- Test timeouts of outstanding requests.
+ *
+ * Three connections have a time limit of one second and share a timer
+ * wheel.  The first has a lillymsg_timeout callback, and half of its
+ * requests are freed before their time is up; only the other half may
+ * expire, and none of them early.  While they expire, they cannot be
+ * found by a response, and afterwards they are freed.  The second uses the default, which
+ * abandons the request; its MessageID needs a leading zero byte in the
+ * AbandonRequest.  The third is detached from the wheel before its
+ * requests expire, so they never do.
+ *
+ * Usage: timer.test
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+#include <lillydap/timer.h>
+#include <lillydap/regionmem.h>
+
+
+#define NUM_REQUESTS 100
+#define TICK_MS 10
+
+
+static char *progname;
+static int timeouts = 0;
+static int abandons = 0;
+static bool early = true;
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+static void count_timeout (LDAP *lil, LillyMsgId mid) {
+	if (early) {
+		fail ("Request timed out before its time limit");
+	}
+	if ((mid & 1) == 0) {
+		fail ("Request timed out after it was freed");
+	}
+	if (lillymsg_id_qpool (lil, mid) != NULL) {
+		fail ("Request is still outstanding during its timeout");
+	}
+	// A response that arrives now finds no request to free
+	dercursor nocontrols = { .derptr = NULL, .derlen = 0 };
+	if (lillyget_correlate (lil, lillymem_newpool (), mid & 0x7fffffff,
+				1, NULL, nocontrols) != -1) {
+		fail ("Response was correlated with an expiring request");
+	}
+	timeouts++;
+}
+
+
+static void never_timeout (LDAP *lil, LillyMsgId mid) {
+	fail ("Request timed out on a detached connection");
+}
+
+
+/* Capture the AbandonRequest and check that it ends in the MessageID 0x80,
+ * with the leading zero byte that keeps the INTEGER positive.
+ */
+static int capture_dercursor (LDAP *lil, LillyPool qpool, dercursor dermsg) {
+	static const uint8_t tail [] = { 0x02, 0x00, 0x80 };
+	if (early) {
+		fail ("Request was abandoned before its time limit");
+	}
+	if ((dermsg.derlen < sizeof (tail)) ||
+			(memcmp (dermsg.derptr + dermsg.derlen - sizeof (tail),
+					tail, sizeof (tail)) != 0)) {
+		fail ("AbandonRequest does not hold the MessageID");
+	}
+	abandons++;
+	lillymem_endpool (qpool);
+	return 0;
+}
+
+
+static LDAP *newcnx (LillyPool lipo, LillyDAP *def) {
+	LDAP *lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	if (lil == NULL) {
+		fail ("Failed to allocate a connection");
+	}
+	lil->def = def;
+	lil->cnxpool = lillymem_newpool ();
+	lil->ld_timelimit = 1;
+	return lil;
+}
+
+
+static double elapsed_ms (struct timespec *t0) {
+	struct timespec t1;
+	clock_gettime (CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) * 1e3 + (t1.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+
+static LillyDAP callbackdap;
+static LillyDAP abandondap;
+static LillyDAP detachdap;
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	regionmem_setup ();
+	LillyPool lipo = lillymem_newpool ();
+	LillyTimers *tmr = lillytimer_open (lipo, TICK_MS);
+	if (tmr == NULL) {
+		fail ("Failed to open the timers");
+	}
+	callbackdap.lillymsg_timeout = count_timeout;
+	abandondap.lillyput_operation = lillyput_operation;
+	abandondap.lillyput_dercursor = capture_dercursor;
+	detachdap.lillymsg_timeout = never_timeout;
+	LDAP *cblil = newcnx (lipo, &callbackdap);
+	LDAP *ablil = newcnx (lipo, &abandondap);
+	LDAP *dtlil = newcnx (lipo, &detachdap);
+	lillytimer_attach (tmr, cblil);
+	lillytimer_attach (tmr, ablil);
+	lillytimer_attach (tmr, dtlil);
+	struct timespec t0;
+	clock_gettime (CLOCK_MONOTONIC, &t0);
+	//
+	// Send requests, and free the even ones as if they were answered
+	LillyMsgId ids [NUM_REQUESTS];
+	int i;
+	for (i = 0; i < NUM_REQUESTS; i++) {
+		ids [i] = lillymsg_id_alloc (cblil, NULL);
+		if (ids [i] == 0) {
+			fail ("Failed to allocate a MessageID");
+		}
+	}
+	for (i = 0; i < NUM_REQUESTS; i++) {
+		if ((ids [i] & 1) == 0) {
+			lillymsg_id_free (cblil, ids [i]);
+		}
+	}
+	ablil->msgid_next = 0x80;
+	LillyMsgId abid = lillymsg_id_alloc (ablil, NULL);
+	if (abid == 0) {
+		fail ("Failed to allocate a MessageID to abandon");
+	}
+	for (i = 0; i < 5; i++) {
+		if (lillymsg_id_alloc (dtlil, NULL) == 0) {
+			fail ("Failed to allocate a MessageID to detach");
+		}
+	}
+	//
+	// Run the timers until well after the time limit
+	while (elapsed_ms (&t0) < 1500) {
+		if (elapsed_ms (&t0) > 1000 - 2 * TICK_MS) {
+			early = false;
+		}
+		lillytimer_run (tmr);
+		if (elapsed_ms (&t0) > 500) {
+			lillytimer_detach (tmr, dtlil);
+		}
+		struct timespec nap = { 0, TICK_MS * 1000000 / 2 };
+		nanosleep (&nap, NULL);
+	}
+	if (timeouts != NUM_REQUESTS / 2) {
+		fail ("Not all outstanding requests timed out");
+	}
+	for (i = 0; i < NUM_REQUESTS; i++) {
+		if (lillymsg_id_qpool (cblil, ids [i]) != NULL) {
+			fail ("An expired request was not freed");
+		}
+	}
+	if (abandons != 1) {
+		fail ("The request was not abandoned");
+	}
+	if (lillymsg_id_qpool (ablil, abid) != NULL) {
+		fail ("The abandoned request was not freed");
+	}
+	lillymem_endpool (cblil->cnxpool);
+	lillymem_endpool (ablil->cnxpool);
+	lillymem_endpool (dtlil->cnxpool);
+	lillymem_endpool (lipo);
+	exit (0);
+}
@@ -0,0 +1,193 @@
+/* uring.c -- Pass LDAPMessages back and forth through a LillyRing.
+ *
+ * One end of a socketpair is attached to a LillyRing, and every message
+ * that arrives on it is queued to be sent back.  The LDAPMessages from the
+ * given files are written to the other end in pieces of varying sizes, so
+ * messages arrive split over several receives and several messages arrive
+ * in one receive.  The latter makes the ring send more than one message in
+ * a chain of linked writes.  What comes back must be what was written.
+ * Closing the other end must then report the connection as done.
+ *
+ * Usage: uring.test ldapmsg.bin...
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+#include <lillydap/queue.h>
+#include <lillydap/uring.h>
+
+
+static char *progname;
+static int done = 0;
+static int done_error = -1;
+
+
+/* Sizes of the pieces that are written, in turn.
+ */
+static const size_t pieces [] = { 1, 3, 20, 700, 2, 5000, 64, 9 };
+#define NUM_PIECES (sizeof (pieces) / sizeof (pieces [0]))
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+static void connection_done (LDAP *lil, int error) {
+	done++;
+	done_error = error;
+}
+
+
+/* Load the files into one buffer, allocated from the given pool.
+ */
+static uint8_t *load (LillyPool pool, int argc, char *argv [], size_t *len) {
+	size_t total = 0;
+	int i;
+	for (i = 1; i < argc; i++) {
+		int fd = open (argv [i], O_RDONLY);
+		off_t size = (fd < 0) ? -1 : lseek (fd, 0, SEEK_END);
+		if (size < 0) {
+			fail ("Failed to open an LDAPMessage file");
+		}
+		total += size;
+		close (fd);
+	}
+	uint8_t *buf = lillymem_alloc (pool, total);
+	if (buf == NULL) {
+		fail ("Failed to allocate input memory");
+	}
+	*len = 0;
+	for (i = 1; i < argc; i++) {
+		int fd = open (argv [i], O_RDONLY);
+		off_t size = lseek (fd, 0, SEEK_END);
+		if (pread (fd, buf + *len, size, 0) != size) {
+			fail ("Failed to load an LDAPMessage file");
+		}
+		*len += size;
+		close (fd);
+	}
+	return buf;
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	if (argc < 2) {
+		fprintf (stderr, "Usage: %s ldapmsg.bin...\n", progname);
+		exit (1);
+	}
+	alarm (30);
+	lillymem_newpool_fun = sillymem_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc;
+	LillyPool lipo = lillymem_newpool ();
+	if (lipo == NULL) {
+		fail ("Failed to allocate a memory pool");
+	}
+	size_t inlen;
+	uint8_t *in = load (lipo, argc, argv, &inlen);
+	uint8_t *out = lillymem_alloc (lipo, inlen);
+	if (out == NULL) {
+		fail ("Failed to allocate output memory");
+	}
+	//
+	// Send every message back as it is
+	LDAP *lil = lillymem_alloc0 (lipo, sizeof (LDAP));
+	lil->def = &lillydap;
+	lil->def->lillyget_dercursor = lillyput_dercursor;
+	lil->cnxpool = lipo;
+	int sv [2];
+	if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		fail ("Failed to create a socketpair");
+	}
+	if (fcntl (sv [1], F_SETFL, O_NONBLOCK) == -1) {
+		fail ("Failed to set the peer non-blocking");
+	}
+	lil->get_fd = lil->put_fd = sv [0];
+	LillyRing *ring = lillyring_open (lipo, 64, connection_done);
+	if (ring == NULL) {
+		perror ("Failed to open a LillyRing");
+		exit (1);
+	}
+	if (lillyring_attach (ring, lil) == -1) {
+		fail ("Failed to attach to the LillyRing");
+	}
+	//
+	// Write pieces and read back what the ring sends, until all is back
+	size_t written = 0;
+	size_t gotten = 0;
+	unsigned chain = 0;
+	int piece = 0;
+	while (gotten < inlen) {
+		if (written < inlen) {
+			size_t todo = pieces [piece++ % NUM_PIECES];
+			if (todo > inlen - written) {
+				todo = inlen - written;
+			}
+			ssize_t sent = write (sv [1], in + written, todo);
+			if ((sent == -1) && (errno != EAGAIN)) {
+				fail ("Failed to write to the LillyRing");
+			}
+			if (sent > 0) {
+				written += sent;
+			}
+		}
+		if (lillyring_run (ring, true) == -1) {
+			fail ("Failed to run the LillyRing");
+		}
+		if (lil->put_ringwrites > chain) {
+			chain = lil->put_ringwrites;
+		}
+		ssize_t got = read (sv [1], out + gotten, inlen - gotten);
+		if ((got == -1) && (errno != EAGAIN)) {
+			fail ("Failed to read from the LillyRing");
+		}
+		if (got > 0) {
+			gotten += got;
+		}
+	}
+	if (memcmp (in, out, inlen) != 0) {
+		fail ("Messages came back differently");
+	}
+	if (chain < 2) {
+		fail ("Messages were never sent in a chain of linked writes");
+	}
+	//
+	// Closing the other end ends the connection
+	close (sv [1]);
+	while (done == 0) {
+		if (lillyring_run (ring, true) == -1) {
+			fail ("Failed to run the LillyRing");
+		}
+	}
+	if ((done != 1) || (done_error != 0)) {
+		fail ("The connection was not reported as closed");
+	}
+	if (lillyput_cansend (lil)) {
+		fail ("Messages were left in the queue");
+	}
+	printf ("Passed %zu bytes back and forth, with up to %u linked writes\n",
+			inlen, chain);
+	lillyring_close (ring);
+	close (sv [0]);
+	lillymem_endpool (lipo);
+	exit (0);
+}
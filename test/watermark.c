@@ -0,0 +1,164 @@
+/* watermark.c -- Test the backpressure of the output queue.
+ *
+ * Messages are queued until the high watermark is crossed, and sent
+ * until the queue drained to the low watermark, twice over.  Each crossing
+ * must lead to one callback, and lillyput_canqueue() must be false from
+ * the high watermark until the low watermark.  Then the same is done with
+ * watermarks and messages beyond 2 GiB, which are sent with lillyput_sent()
+ * because they are not really there.
+ *
+ * Usage: watermark.test
+ *
+ * From: Rick van Rein <rick@openfortress.nl>
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lillydap/api.h>
+#include <lillydap/mem.h>
+#include <lillydap/queue.h>
+
+
+#define MSG_SIZE 300
+#define HUGE_SIZE ((size_t) 5 << 28)	/* 1.25 GiB */
+
+
+static char *progname;
+static int highs = 0;
+static int lows = 0;
+
+
+static void fail (char *what) {
+	fprintf (stderr, "%s: %s\n", progname, what);
+	exit (1);
+}
+
+
+static void count_high (LDAP *lil) {
+	highs++;
+}
+
+
+static void count_low (LDAP *lil) {
+	lows++;
+}
+
+
+/* Queue a message of the given size in its own qpool.  Only MSG_SIZE
+ * bytes are really there; larger messages must not be written.
+ */
+static void queue_message (LDAP *lil, size_t size) {
+	LillyPool qpool = lillymem_newpool ();
+	dercursor msg;
+	msg.derptr = lillymem_alloc (qpool, MSG_SIZE);
+	msg.derlen = size;
+	if (msg.derptr == NULL) {
+		fail ("Failed to allocate a message");
+	}
+	memset (msg.derptr, 0x5a, MSG_SIZE);
+	if (lillyput_dercursor (lil, qpool, msg) == -1) {
+		fail ("Failed to queue a message");
+	}
+}
+
+
+/* Check the callbacks so far, and whether producers may queue.
+ */
+static void expect (LDAP *lil, int exphighs, int explows, bool canqueue,
+				char *what) {
+	if ((highs != exphighs) || (lows != explows) ||
+			(lillyput_canqueue (lil) != canqueue)) {
+		fail (what);
+	}
+}
+
+
+static LillyDAP lillydap;
+
+int main (int argc, char *argv []) {
+	progname = argv [0];
+	lillymem_newpool_fun = sillymem_newpool;
+	lillymem_endpool_fun = sillymem_endpool;
+	lillymem_alloc_fun   = sillymem_alloc;
+	LillyPool cnxpool = lillymem_newpool ();
+	LDAP *lil = lillymem_alloc0 (cnxpool, sizeof (LDAP));
+	if (lil == NULL) {
+		fail ("Failed to allocate memory");
+	}
+	lillydap.lillyput_highwater = count_high;
+	lillydap.lillyput_lowwater  = count_low;
+	lil->def = &lillydap;
+	lil->cnxpool = cnxpool;
+	lil->get_fd = -1;
+	lil->put_fd = open ("/dev/null", O_WRONLY);
+	lil->put_sigfd = -1;
+	if (lil->put_fd < 0) {
+		fail ("Failed to open /dev/null");
+	}
+	lil->put_highwater = 1000;
+	lil->put_lowwater  = 200;
+	//
+	// Cross both watermarks twice, one message at a time
+	int round;
+	for (round = 0; round < 2; round++) {
+		int i;
+		for (i = 0; i < 3; i++) {
+			queue_message (lil, MSG_SIZE);
+		}
+		expect (lil, round, round, true,
+			"Throttled below the high watermark");
+		queue_message (lil, MSG_SIZE);
+		expect (lil, round + 1, round, false,
+			"Not throttled at the high watermark");
+		queue_message (lil, MSG_SIZE);
+		expect (lil, round + 1, round, false,
+			"High watermark was signaled twice");
+		for (i = 0; i < 4; i++) {
+			if (lillyput_event (lil) != MSG_SIZE) {
+				fail ("Failed to send a message");
+			}
+		}
+		expect (lil, round + 1, round, false,
+			"Throttling ended above the low watermark");
+		if (lillyput_event (lil) != MSG_SIZE) {
+			fail ("Failed to send the last message");
+		}
+		expect (lil, round + 1, round + 1, true,
+			"Throttling did not end at the low watermark");
+		if ((lillyput_event (lil) != -1) || lillyput_cansend (lil)) {
+			fail ("Queue was not empty");
+		}
+	}
+	//
+	// Count beyond 2 GiB where size_t can
+	if (sizeof (size_t) > 4) {
+		lil->put_highwater = 3 * HUGE_SIZE;
+		lil->put_lowwater  = HUGE_SIZE / 2;
+		queue_message (lil, HUGE_SIZE);
+		queue_message (lil, HUGE_SIZE);
+		expect (lil, 2, 2, true,
+			"Throttled below a high watermark beyond 2 GiB");
+		queue_message (lil, HUGE_SIZE);
+		expect (lil, 3, 2, false,
+			"Not throttled at a high watermark beyond 2 GiB");
+		lillyput_sent (lil, 2 * HUGE_SIZE);
+		expect (lil, 3, 2, false,
+			"Throttling ended above a low watermark beyond 2 GiB");
+		lillyput_sent (lil, HUGE_SIZE);
+		expect (lil, 3, 3, true,
+			"Throttling did not end after sending over 2 GiB");
+		if (lillyput_cansend (lil)) {
+			fail ("Queue was not empty after sending over 2 GiB");
+		}
+	}
+	close (lil->put_fd);
+	lillymem_endpool (cnxpool);
+	exit (0);
+}